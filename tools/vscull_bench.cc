@@ -0,0 +1,226 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+ 
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/* vscull_bench: impact of the frame copies on a co-located workload.
+ 
+   A victim thread walks a working set while the main thread writes frames to the device,
+   first with cached copies (VSCULL_CACHED), then with non-temporal ones (VSCULL_NOCACHE).
+   For each mode the victim reports the time and the LLC misses per pass. */
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+#include <vscull_dev.h>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <err.h>
+
+extern char *__progname;
+
+const char usage[]=
+      "%s [options]\n"
+      "   -m minor            vscull video device (/dev/video0 is default)\n"
+      "   -n frames           frames written per mode (500 is default)\n"
+      "   -w KB               working set of the victim (4096 is default)\n"
+      "   -c cpu              cpu of the writer\n"
+      "   -C cpu              cpu of the victim\n"
+      "   -h                  print this help\n";
+
+
+static inline double 
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void 
+pin(int cpu)
+{
+    if (cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        warnx("couldn't pin to cpu %d", cpu);
+}
+
+
+struct victim
+{
+    std::vector<char> ws;
+    int cpu;
+    volatile bool stop;
+
+    unsigned long long passes;
+    unsigned long long misses;
+    double elapsed;
+};
+
+
+static void *
+victim_run(void *arg)
+{
+    victim *v = static_cast<victim *>(arg);
+
+    pin(v->cpu);
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+
+    int pfd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (pfd < 0)
+        warn("perf_event_open (LLC misses not available)");
+
+    /* warm up the working set */
+    memset(&v->ws[0], 1, v->ws.size());
+
+    unsigned long long sum = 0;
+    double start = now();
+
+    while (!v->stop) {
+        for(size_t i = 0; i < v->ws.size(); i += 64)
+            sum += v->ws[i]++;
+        v->passes++;
+    }
+
+    v->elapsed = now() - start;
+
+    if (pfd >= 0) {
+        if (read(pfd, &v->misses, sizeof(v->misses)) != sizeof(v->misses))
+            v->misses = 0;
+        close(pfd);
+    }
+
+    return reinterpret_cast<void *>(sum);
+}
+
+
+static void
+run(vscull::Dev &dev, int mode, const char *name, int frames, size_t ws, int cpu, int vcpu)
+{
+    dev.flags((dev.flags() & ~(VSCULL_NOCACHE|VSCULL_CACHED)) | mode);
+    dev.commit();
+    dev.update();
+
+    struct vscull_planes pl;
+    size_t size = 0;
+    if (dev.planes(pl)) {
+        for(int n = 0; n < pl.nplanes; n++)
+            size += pl.plane[n].size;
+    }
+    if (size == 0)
+        errx(1, "%s: empty frame", dev.name().c_str());
+
+    std::vector<char> frame(size, 0x55);
+
+    victim v;
+    v.ws.resize(ws << 10);
+    v.cpu = vcpu;
+    v.stop = false;
+    v.passes = v.misses = 0;
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, victim_run, &v) != 0)
+        errx(1, "pthread_create");
+
+    pin(cpu);
+
+    double start = now();
+    for(int i = 0; i < frames; i++) {
+        if (dev.write(&frame[0], size) < 0)
+            err(2, "write");
+    }
+    double elapsed = now() - start;
+
+    v.stop = true;
+    pthread_join(t, NULL);
+
+    printf("%-8s %8.1f fps %9.1f MB/s | victim: %8.1f us/pass %10.0f LLC misses/pass\n", name,
+            frames / elapsed, frames * size / elapsed / 1e6,
+            v.passes ? v.elapsed * 1e6 / v.passes : 0.0,
+            v.passes ? double(v.misses) / v.passes : 0.0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+    int minor = 0;
+    int frames = 500;
+    int ws = 4096;
+    int cpu = -1;
+    int vcpu = -1;
+
+    while(( i = getopt(argc, argv, "m:n:w:c:C:h")) != EOF)
+        switch(i) {
+        case 'm': minor = atoi(optarg);
+                  break;
+        case 'n': frames = atoi(optarg);
+                  break;
+        case 'w': ws = atoi(optarg);
+                  break;
+        case 'c': cpu = atoi(optarg);
+                  break;
+        case 'C': vcpu = atoi(optarg);
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    vscull::Dev dev(minor);
+
+    int fps   = dev.fps();
+    int flags = dev.flags();
+
+    /* write at full speed */
+    dev.fps(0);
+    dev.commit();
+
+    std::cout << dev.name() << ": " << dev.width() << "x" << dev.height() << " " 
+              << PALETTE(dev.palette()) << ", working set " << ws << " KB\n";
+
+    run(dev, VSCULL_CACHED,  "cached",  frames, ws, cpu, vcpu);
+    run(dev, VSCULL_NOCACHE, "nocache", frames, ws, cpu, vcpu);
+
+    dev.fps(fps);
+    dev.flags(flags);
+    dev.commit();
+
+    return 0;
+}
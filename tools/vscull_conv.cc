@@ -0,0 +1,764 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+#include <vscull_conv.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONV_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CONV_NEON
+#endif
+
+namespace vscull {
+
+    namespace {
+
+        enum { KIND_NONE, KIND_YUV, KIND_RGB };
+
+        int kind(int palette)
+        {
+            switch(palette) {
+            case VIDEO_PALETTE_GREY:
+            case VIDEO_PALETTE_YUV422:
+            case VIDEO_PALETTE_YUYV:
+            case VIDEO_PALETTE_UYVY:
+            case VIDEO_PALETTE_YUV422P:
+            case VIDEO_PALETTE_YUV411P:
+            case VIDEO_PALETTE_YUV420P:
+            case VIDEO_PALETTE_YUV410P:
+                return KIND_YUV;
+            case VIDEO_PALETTE_RGB565:
+            case VIDEO_PALETTE_RGB24:
+            case VIDEO_PALETTE_RGB32:
+            case VIDEO_PALETTE_RGB555:
+                return KIND_RGB;
+            }
+            return KIND_NONE;
+        }
+
+        /* YUV422 capture is handled as YUYV */
+        int canonical(int palette)
+        { return palette == VIDEO_PALETTE_YUV422 ? VIDEO_PALETTE_YUYV : palette; }
+
+        inline unsigned char clamp8(int v)
+        { return v < 0 ? 0 : (v > 255 ? 255 : v); }
+
+        //  BT.601, limited range, 8 bit fixed point:
+        //
+        //  R = (298 (Y-16)             + 409 (V-128) + 128) >> 8
+        //  G = (298 (Y-16) - 100 (U-128) - 208 (V-128) + 128) >> 8
+        //  B = (298 (Y-16) + 516 (U-128)             + 128) >> 8
+        //
+        //  Y = ((  66 R + 129 G +  25 B + 128) >> 8) +  16
+        //  U = (( -38 R -  74 G + 112 B + 128) >> 8) + 128
+        //  V = (( 112 R -  94 G -  18 B + 128) >> 8) + 128
+
+        void yuv_to_bgrx_scalar(const unsigned char *y, const unsigned char *u, const unsigned char *v, unsigned char *bgrx, int n)
+        {
+            for(int i = 0; i < n; i++) {
+                int c = 298 * (y[i] - 16) + 128;
+                int d = u[i] - 128;
+                int e = v[i] - 128;
+                bgrx[4*i]   = clamp8((c + 516 * d) >> 8);
+                bgrx[4*i+1] = clamp8((c - 100 * d - 208 * e) >> 8);
+                bgrx[4*i+2] = clamp8((c + 409 * e) >> 8);
+                bgrx[4*i+3] = 0xff;
+            }
+        }
+
+        void bgrx_to_yuv_scalar(const unsigned char *bgrx, unsigned char *y, unsigned char *u, unsigned char *v, int n)
+        {
+            for(int i = 0; i < n; i++) {
+                int b = bgrx[4*i], g = bgrx[4*i+1], r = bgrx[4*i+2];
+                y[i] = (( 66 * r + 129 * g +  25 * b + 128) >> 8) +  16;
+                u[i] = ((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+                v[i] = ((112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+            }
+        }
+
+#ifdef CONV_X86
+
+        __attribute__((target("sse4.1")))
+        inline __m128i load4_epu8(const unsigned char *p)
+        {
+            int w; memcpy(&w, p, 4);
+            return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(w));
+        }
+
+        __attribute__((target("sse4.1")))
+        void yuv_to_bgrx_sse4(const unsigned char *y, const unsigned char *u, const unsigned char *v, unsigned char *bgrx, int n)
+        {
+            const __m128i k16 = _mm_set1_epi32(16), k128 = _mm_set1_epi32(128);
+            const __m128i k0 = _mm_setzero_si128(), k255 = _mm_set1_epi32(255);
+            const __m128i alpha = _mm_set1_epi32(0xff000000);
+            int i = 0;
+
+            for(; i + 4 <= n; i += 4) {
+                __m128i c = _mm_add_epi32(_mm_mullo_epi32(_mm_sub_epi32(load4_epu8(y+i), k16), _mm_set1_epi32(298)), k128);
+                __m128i d = _mm_sub_epi32(load4_epu8(u+i), k128);
+                __m128i e = _mm_sub_epi32(load4_epu8(v+i), k128);
+
+                __m128i b = _mm_srai_epi32(_mm_add_epi32(c, _mm_mullo_epi32(d, _mm_set1_epi32(516))), 8);
+                __m128i g = _mm_srai_epi32(_mm_sub_epi32(_mm_sub_epi32(c, _mm_mullo_epi32(d, _mm_set1_epi32(100))),
+                                                         _mm_mullo_epi32(e, _mm_set1_epi32(208))), 8);
+                __m128i r = _mm_srai_epi32(_mm_add_epi32(c, _mm_mullo_epi32(e, _mm_set1_epi32(409))), 8);
+
+                b = _mm_min_epi32(_mm_max_epi32(b, k0), k255);
+                g = _mm_min_epi32(_mm_max_epi32(g, k0), k255);
+                r = _mm_min_epi32(_mm_max_epi32(r, k0), k255);
+
+                __m128i px = _mm_or_si128(_mm_or_si128(b, _mm_slli_epi32(g, 8)), _mm_or_si128(_mm_slli_epi32(r, 16), alpha));
+                _mm_storeu_si128((__m128i *)(bgrx + 4*i), px);
+            }
+
+            yuv_to_bgrx_scalar(y+i, u+i, v+i, bgrx+4*i, n-i);
+        }
+
+        __attribute__((target("sse4.1")))
+        inline void store4_epu8(unsigned char *p, __m128i x)
+        {
+            x = _mm_packus_epi32(x, x);
+            x = _mm_packus_epi16(x, x);
+            int w = _mm_cvtsi128_si32(x);
+            memcpy(p, &w, 4);
+        }
+
+        /* dot product of 4 BGRX pixels with (kb, kg, kr, 0) */
+        __attribute__((target("sse4.1")))
+        inline __m128i dot4(__m128i lo, __m128i hi, __m128i k)
+        {
+            return _mm_hadd_epi32(_mm_madd_epi16(lo, k), _mm_madd_epi16(hi, k));
+        }
+
+        __attribute__((target("sse4.1")))
+        void bgrx_to_yuv_sse4(const unsigned char *bgrx, unsigned char *y, unsigned char *u, unsigned char *v, int n)
+        {
+            const __m128i k0 = _mm_setzero_si128(), k128 = _mm_set1_epi32(128);
+            const __m128i ky = _mm_set_epi16(0,  66, 129,  25, 0,  66, 129,  25);
+            const __m128i ku = _mm_set_epi16(0, -38, -74, 112, 0, -38, -74, 112);
+            const __m128i kv = _mm_set_epi16(0, 112, -94, -18, 0, 112, -94, -18);
+            int i = 0;
+
+            for(; i + 4 <= n; i += 4) {
+                __m128i px = _mm_loadu_si128((const __m128i *)(bgrx + 4*i));
+                __m128i lo = _mm_unpacklo_epi8(px, k0);     /* pixels 0, 1 (16 bit) */
+                __m128i hi = _mm_unpackhi_epi8(px, k0);     /* pixels 2, 3 */
+
+                __m128i yy = _mm_add_epi32(dot4(lo, hi, ky), k128);
+                __m128i uu = _mm_add_epi32(dot4(lo, hi, ku), k128);
+                __m128i vv = _mm_add_epi32(dot4(lo, hi, kv), k128);
+
+                store4_epu8(y+i, _mm_add_epi32(_mm_srai_epi32(yy, 8), _mm_set1_epi32(16)));
+                store4_epu8(u+i, _mm_add_epi32(_mm_srai_epi32(uu, 8), k128));
+                store4_epu8(v+i, _mm_add_epi32(_mm_srai_epi32(vv, 8), k128));
+            }
+
+            bgrx_to_yuv_scalar(bgrx+4*i, y+i, u+i, v+i, n-i);
+        }
+
+        __attribute__((target("avx2")))
+        inline __m256i load8_epu8(const unsigned char *p)
+        {
+            return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p));
+        }
+
+        __attribute__((target("avx2")))
+        void yuv_to_bgrx_avx2(const unsigned char *y, const unsigned char *u, const unsigned char *v, unsigned char *bgrx, int n)
+        {
+            const __m256i k16 = _mm256_set1_epi32(16), k128 = _mm256_set1_epi32(128);
+            const __m256i k0 = _mm256_setzero_si256(), k255 = _mm256_set1_epi32(255);
+            const __m256i alpha = _mm256_set1_epi32(0xff000000);
+            int i = 0;
+
+            for(; i + 8 <= n; i += 8) {
+                __m256i c = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(load8_epu8(y+i), k16), _mm256_set1_epi32(298)), k128);
+                __m256i d = _mm256_sub_epi32(load8_epu8(u+i), k128);
+                __m256i e = _mm256_sub_epi32(load8_epu8(v+i), k128);
+
+                __m256i b = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_mullo_epi32(d, _mm256_set1_epi32(516))), 8);
+                __m256i g = _mm256_srai_epi32(_mm256_sub_epi32(_mm256_sub_epi32(c, _mm256_mullo_epi32(d, _mm256_set1_epi32(100))),
+                                                               _mm256_mullo_epi32(e, _mm256_set1_epi32(208))), 8);
+                __m256i r = _mm256_srai_epi32(_mm256_add_epi32(c, _mm256_mullo_epi32(e, _mm256_set1_epi32(409))), 8);
+
+                b = _mm256_min_epi32(_mm256_max_epi32(b, k0), k255);
+                g = _mm256_min_epi32(_mm256_max_epi32(g, k0), k255);
+                r = _mm256_min_epi32(_mm256_max_epi32(r, k0), k255);
+
+                __m256i px = _mm256_or_si256(_mm256_or_si256(b, _mm256_slli_epi32(g, 8)), _mm256_or_si256(_mm256_slli_epi32(r, 16), alpha));
+                _mm256_storeu_si256((__m256i *)(bgrx + 4*i), px);
+            }
+
+            yuv_to_bgrx_scalar(y+i, u+i, v+i, bgrx+4*i, n-i);
+        }
+
+        __attribute__((target("avx2")))
+        inline void store8_epu8(unsigned char *p, __m256i x)
+        {
+            /* packs work on 128 bit lanes: pixels 0-3 end up in the low lane, 4-7 in the high one */
+            x = _mm256_packus_epi32(x, x);
+            x = _mm256_packus_epi16(x, x);
+            int lo = _mm_cvtsi128_si32(_mm256_castsi256_si128(x));
+            int hi = _mm_cvtsi128_si32(_mm256_extracti128_si256(x, 1));
+            memcpy(p, &lo, 4);
+            memcpy(p + 4, &hi, 4);
+        }
+
+        /* dot product of 8 BGRX pixels with (kb, kg, kr, 0): lanes keep the pixel order */
+        __attribute__((target("avx2")))
+        inline __m256i dot8(__m256i lo, __m256i hi, __m256i k)
+        {
+            return _mm256_hadd_epi32(_mm256_madd_epi16(lo, k), _mm256_madd_epi16(hi, k));
+        }
+
+        __attribute__((target("avx2")))
+        void bgrx_to_yuv_avx2(const unsigned char *bgrx, unsigned char *y, unsigned char *u, unsigned char *v, int n)
+        {
+            const __m256i k0 = _mm256_setzero_si256(), k128 = _mm256_set1_epi32(128);
+            const __m256i ky = _mm256_set_epi16(0,  66, 129,  25, 0,  66, 129,  25, 0,  66, 129,  25, 0,  66, 129,  25);
+            const __m256i ku = _mm256_set_epi16(0, -38, -74, 112, 0, -38, -74, 112, 0, -38, -74, 112, 0, -38, -74, 112);
+            const __m256i kv = _mm256_set_epi16(0, 112, -94, -18, 0, 112, -94, -18, 0, 112, -94, -18, 0, 112, -94, -18);
+            int i = 0;
+
+            for(; i + 8 <= n; i += 8) {
+                __m256i px = _mm256_loadu_si256((const __m256i *)(bgrx + 4*i));
+                __m256i lo = _mm256_unpacklo_epi8(px, k0);  /* pixels 0, 1 | 4, 5 (16 bit) */
+                __m256i hi = _mm256_unpackhi_epi8(px, k0);  /* pixels 2, 3 | 6, 7 */
+
+                __m256i yy = _mm256_add_epi32(dot8(lo, hi, ky), k128);
+                __m256i uu = _mm256_add_epi32(dot8(lo, hi, ku), k128);
+                __m256i vv = _mm256_add_epi32(dot8(lo, hi, kv), k128);
+
+                store8_epu8(y+i, _mm256_add_epi32(_mm256_srai_epi32(yy, 8), _mm256_set1_epi32(16)));
+                store8_epu8(u+i, _mm256_add_epi32(_mm256_srai_epi32(uu, 8), k128));
+                store8_epu8(v+i, _mm256_add_epi32(_mm256_srai_epi32(vv, 8), k128));
+            }
+
+            bgrx_to_yuv_scalar(bgrx+4*i, y+i, u+i, v+i, n-i);
+        }
+
+#endif /* CONV_X86 */
+
+#ifdef CONV_NEON
+
+        inline int32x4_t neon_yuv_px(int32x4_t c, int32x4_t d, int32x4_t e, int32x4_t &g, int32x4_t &r)
+        {
+            const int32x4_t k0 = vdupq_n_s32(0), k255 = vdupq_n_s32(255);
+            int32x4_t b = vshrq_n_s32(vmlaq_n_s32(c, d, 516), 8);
+            g = vshrq_n_s32(vmlaq_n_s32(vmlaq_n_s32(c, d, -100), e, -208), 8);
+            r = vshrq_n_s32(vmlaq_n_s32(c, e, 409), 8);
+            g = vminq_s32(vmaxq_s32(g, k0), k255);
+            r = vminq_s32(vmaxq_s32(r, k0), k255);
+            return vminq_s32(vmaxq_s32(b, k0), k255);
+        }
+
+        inline uint32x4_t neon_bgrx(int32x4_t b, int32x4_t g, int32x4_t r)
+        {
+            uint32x4_t px = vorrq_u32(vreinterpretq_u32_s32(b), vshlq_n_u32(vreinterpretq_u32_s32(g), 8));
+            px = vorrq_u32(px, vshlq_n_u32(vreinterpretq_u32_s32(r), 16));
+            return vorrq_u32(px, vdupq_n_u32(0xff000000));
+        }
+
+        void yuv_to_bgrx_neon(const unsigned char *y, const unsigned char *u, const unsigned char *v, unsigned char *bgrx, int n)
+        {
+            int i = 0;
+
+            for(; i + 8 <= n; i += 8) {
+                int16x8_t yy = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y+i)));
+                int16x8_t uu = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(u+i)));
+                int16x8_t vv = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(v+i)));
+
+                for(int h = 0; h < 2; h++) {
+                    int32x4_t y4 = vmovl_s16(h ? vget_high_s16(yy) : vget_low_s16(yy));
+                    int32x4_t u4 = vmovl_s16(h ? vget_high_s16(uu) : vget_low_s16(uu));
+                    int32x4_t v4 = vmovl_s16(h ? vget_high_s16(vv) : vget_low_s16(vv));
+
+                    int32x4_t c = vaddq_s32(vmulq_n_s32(vsubq_s32(y4, vdupq_n_s32(16)), 298), vdupq_n_s32(128));
+                    int32x4_t d = vsubq_s32(u4, vdupq_n_s32(128));
+                    int32x4_t e = vsubq_s32(v4, vdupq_n_s32(128));
+                    int32x4_t g, r;
+                    int32x4_t b = neon_yuv_px(c, d, e, g, r);
+
+                    vst1q_u32((uint32_t *)(bgrx + 4*(i + 4*h)), neon_bgrx(b, g, r));
+                }
+            }
+
+            yuv_to_bgrx_scalar(y+i, u+i, v+i, bgrx+4*i, n-i);
+        }
+
+        inline int16x4_t neon_dot(int32x4_t r, int32x4_t g, int32x4_t b, int kr, int kg, int kb, int off)
+        {
+            int32x4_t x = vmlaq_n_s32(vmlaq_n_s32(vmulq_n_s32(r, kr), g, kg), b, kb);
+            x = vaddq_s32(vshrq_n_s32(vaddq_s32(x, vdupq_n_s32(128)), 8), vdupq_n_s32(off));
+            return vmovn_s32(x);
+        }
+
+        void bgrx_to_yuv_neon(const unsigned char *bgrx, unsigned char *y, unsigned char *u, unsigned char *v, int n)
+        {
+            const uint32x4_t mask = vdupq_n_u32(0xff);
+            int i = 0;
+
+            for(; i + 8 <= n; i += 8) {
+                int16x4_t yh[2], uh[2], vh[2];
+
+                for(int h = 0; h < 2; h++) {
+                    uint32x4_t px = vld1q_u32((const uint32_t *)(bgrx + 4*(i + 4*h)));
+                    int32x4_t b = vreinterpretq_s32_u32(vandq_u32(px, mask));
+                    int32x4_t g = vreinterpretq_s32_u32(vandq_u32(vshrq_n_u32(px, 8), mask));
+                    int32x4_t r = vreinterpretq_s32_u32(vandq_u32(vshrq_n_u32(px, 16), mask));
+
+                    yh[h] = neon_dot(r, g, b,  66, 129,  25,  16);
+                    uh[h] = neon_dot(r, g, b, -38, -74, 112, 128);
+                    vh[h] = neon_dot(r, g, b, 112, -94, -18, 128);
+                }
+
+                vst1_u8(y+i, vqmovun_s16(vcombine_s16(yh[0], yh[1])));
+                vst1_u8(u+i, vqmovun_s16(vcombine_s16(uh[0], uh[1])));
+                vst1_u8(v+i, vqmovun_s16(vcombine_s16(vh[0], vh[1])));
+            }
+
+            bgrx_to_yuv_scalar(bgrx+4*i, y+i, u+i, v+i, n-i);
+        }
+
+#endif /* CONV_NEON */
+
+        struct kernels
+        {
+            const char *name;
+            void (*yuv_to_bgrx)(const unsigned char *, const unsigned char *, const unsigned char *, unsigned char *, int);
+            void (*bgrx_to_yuv)(const unsigned char *, unsigned char *, unsigned char *, unsigned char *, int);
+            bool (*available)();
+        };
+
+        bool always() { return true; }
+
+#ifdef CONV_X86
+        bool has_sse4() { return __builtin_cpu_supports("sse4.1"); }
+        bool has_avx2() { return __builtin_cpu_supports("avx2"); }
+#endif
+
+        /* the best last */
+        const kernels isa_table[] =
+        {
+            { "scalar", yuv_to_bgrx_scalar, bgrx_to_yuv_scalar, always },
+#ifdef CONV_X86
+            { "sse4.1", yuv_to_bgrx_sse4,   bgrx_to_yuv_sse4,   has_sse4 },
+            { "avx2",   yuv_to_bgrx_avx2,   bgrx_to_yuv_avx2,   has_avx2 },
+#endif
+#ifdef CONV_NEON
+            { "neon",   yuv_to_bgrx_neon,   bgrx_to_yuv_neon,   always },
+#endif
+        };
+
+        const kernels * best()
+        {
+            const kernels *k = &isa_table[0];
+#ifdef CONV_X86
+            __builtin_cpu_init();   /* we run from a static constructor */
+#endif
+            for(std::size_t n = 0; n < sizeof(isa_table)/sizeof(isa_table[0]); n++)
+                if (isa_table[n].available())
+                    k = &isa_table[n];
+            return k;
+        }
+
+        const kernels * kern = best();
+
+
+        // row unpacking/packing (memory bound: scalar)
+
+        void unpack_rgb(int palette, const unsigned char *src, unsigned char *bgrx, int w)
+        {
+            switch(palette) {
+            case VIDEO_PALETTE_RGB32:
+                memcpy(bgrx, src, 4 * w);
+                break;
+            case VIDEO_PALETTE_RGB24:
+                for(int x = 0; x < w; x++) {
+                    bgrx[4*x]   = src[3*x];
+                    bgrx[4*x+1] = src[3*x+1];
+                    bgrx[4*x+2] = src[3*x+2];
+                    bgrx[4*x+3] = 0xff;
+                }
+                break;
+            case VIDEO_PALETTE_RGB565:
+                for(int x = 0; x < w; x++) {
+                    unsigned int p = src[2*x] | (src[2*x+1] << 8);
+                    unsigned int r = (p >> 11) & 0x1f, g = (p >> 5) & 0x3f, b = p & 0x1f;
+                    bgrx[4*x]   = (b << 3) | (b >> 2);
+                    bgrx[4*x+1] = (g << 2) | (g >> 4);
+                    bgrx[4*x+2] = (r << 3) | (r >> 2);
+                    bgrx[4*x+3] = 0xff;
+                }
+                break;
+            case VIDEO_PALETTE_RGB555:
+                for(int x = 0; x < w; x++) {
+                    unsigned int p = src[2*x] | (src[2*x+1] << 8);
+                    unsigned int r = (p >> 10) & 0x1f, g = (p >> 5) & 0x1f, b = p & 0x1f;
+                    bgrx[4*x]   = (b << 3) | (b >> 2);
+                    bgrx[4*x+1] = (g << 3) | (g >> 2);
+                    bgrx[4*x+2] = (r << 3) | (r >> 2);
+                    bgrx[4*x+3] = 0xff;
+                }
+                break;
+            }
+        }
+
+        void pack_rgb(int palette, const unsigned char *bgrx, unsigned char *dst, int w)
+        {
+            switch(palette) {
+            case VIDEO_PALETTE_RGB32:
+                memcpy(dst, bgrx, 4 * w);
+                break;
+            case VIDEO_PALETTE_RGB24:
+                for(int x = 0; x < w; x++) {
+                    dst[3*x]   = bgrx[4*x];
+                    dst[3*x+1] = bgrx[4*x+1];
+                    dst[3*x+2] = bgrx[4*x+2];
+                }
+                break;
+            case VIDEO_PALETTE_RGB565:
+                for(int x = 0; x < w; x++) {
+                    unsigned int p = ((bgrx[4*x+2] >> 3) << 11) | ((bgrx[4*x+1] >> 2) << 5) | (bgrx[4*x] >> 3);
+                    dst[2*x]   = p & 0xff;
+                    dst[2*x+1] = p >> 8;
+                }
+                break;
+            case VIDEO_PALETTE_RGB555:
+                for(int x = 0; x < w; x++) {
+                    unsigned int p = ((bgrx[4*x+2] >> 3) << 10) | ((bgrx[4*x+1] >> 3) << 5) | (bgrx[4*x] >> 3);
+                    dst[2*x]   = p & 0xff;
+                    dst[2*x+1] = p >> 8;
+                }
+                break;
+            }
+        }
+
+        /* bytes of a row of a plane */
+        unsigned int row_bytes(int palette, int plane, int w)
+        {
+            const struct vscull_format *f = PALETTE_FORMAT(palette);
+            if (f->nplanes == 1)
+                return (w * f->bpp + 7) / 8;
+            return plane == 0 ? w : (w + (1 << f->hsub) - 1) >> f->hsub;
+        }
+
+        int plane_rows(int palette, int plane, int h)
+        {
+            const struct vscull_format *f = PALETTE_FORMAT(palette);
+            return plane == 0 ? h : (h + (1 << f->vsub) - 1) >> f->vsub;
+        }
+    }
+
+
+    image::image()
+    : palette(0), width(0), height(0)
+    {
+        memset(plane, 0, sizeof(plane));
+        memset(stride, 0, sizeof(stride));
+    }
+
+
+    image::image(int p, int w, int h, unsigned char *base)
+    : palette(p), width(w), height(h)
+    {
+        const struct vscull_format *f = PALETTE_FORMAT(p);
+
+        memset(plane, 0, sizeof(plane));
+        memset(stride, 0, sizeof(stride));
+
+        for(int n = 0; n < f->nplanes; n++) {
+            plane[n]  = base;
+            stride[n] = row_bytes(p, n, w);
+            base += stride[n] * plane_rows(p, n, h);
+        }
+    }
+
+
+    image::image(int p, int w, int h, unsigned char *base, const struct vscull_planes &pl)
+    : palette(p), width(w), height(h)
+    {
+        memset(plane, 0, sizeof(plane));
+        memset(stride, 0, sizeof(stride));
+
+        for(int n = 0; n < pl.nplanes && n < VSCULL_MAX_PLANES; n++) {
+            plane[n]  = base + pl.plane[n].offset;
+            stride[n] = pl.plane[n].stride;
+        }
+    }
+
+
+    std::size_t
+    image::size(int p, int w, int h)
+    {
+        if (!Converter::supported(p) || w <= 0 || h <= 0)
+            return 0;
+
+        const struct vscull_format *f = PALETTE_FORMAT(p);
+        std::size_t s = 0;
+        for(int n = 0; n < f->nplanes; n++)
+            s += (std::size_t)row_bytes(p, n, w) * plane_rows(p, n, h);
+        return s;
+    }
+
+
+    bool
+    Converter::supported(int palette)
+    {
+        return kind(palette) != KIND_NONE;
+    }
+
+
+    Converter::Converter(int src, int dst, int w, int h)
+    : _M_src(src),
+    _M_dst(dst),
+    _M_width(w),
+    _M_height(h),
+    _M_rows(1),
+    _M_yuv(),
+    _M_bgrx()
+    {
+        if (!supported(src) || !supported(dst))
+            throw std::invalid_argument(std::string("vscull: conversion not supported: ").append(PALETTE((unsigned int)src)).append(" -> ").append(PALETTE((unsigned int)dst)));
+        if (w <= 0 || h <= 0)
+            throw std::invalid_argument("vscull: bad frame size");
+
+        const struct vscull_format *f = PALETTE_FORMAT(dst);
+        if (f->nplanes > 1)
+            _M_rows = 1 << f->vsub;
+
+        _M_yuv.resize(_M_rows * 3 * w);
+        _M_bgrx.resize(_M_rows * 4 * w);
+    }
+
+
+    void
+    Converter::operator()(const image &src, const image &dst)
+    {
+        if (src.palette != _M_src || dst.palette != _M_dst ||
+            src.width != _M_width || src.height != _M_height ||
+            dst.width != _M_width || dst.height != _M_height)
+            throw std::invalid_argument("vscull: frame doesn't match the converter");
+
+        if (canonical(_M_src) == canonical(_M_dst)) {
+            for(int n = 0; n < PALETTE_FORMAT(_M_src)->nplanes; n++) {
+                unsigned int len = row_bytes(_M_src, n, _M_width);
+                for(int r = 0; r < plane_rows(_M_src, n, _M_height); r++)
+                    memcpy(dst.plane[n] + r * dst.stride[n], src.plane[n] + r * src.stride[n], len);
+            }
+            return;
+        }
+
+        int w = _M_width;
+
+        for(int r = 0; r < _M_height; r += _M_rows) {
+            int rows = std::min(_M_rows, _M_height - r);
+            for(int i = 0; i < rows; i++) {
+                unsigned char *y = &_M_yuv[i * 3 * w];
+                unpack(src, r + i, y, y + w, y + 2 * w, &_M_bgrx[i * 4 * w]);
+            }
+            pack(dst, r, rows);
+        }
+    }
+
+
+    /* a source row to full resolution YUV or BGRX, whatever the destination needs */
+    void
+    Converter::unpack(const image &src, int row, unsigned char *y, unsigned char *u, unsigned char *v, unsigned char *bgrx)
+    {
+        const unsigned char *s = src.plane[0] + row * src.stride[0];
+        int w = _M_width;
+
+        if (kind(_M_src) == KIND_RGB) {
+            unpack_rgb(_M_src, s, bgrx, w);
+            if (kind(_M_dst) == KIND_YUV)
+                kern->bgrx_to_yuv(bgrx, y, u, v, w);
+            return;
+        }
+
+        switch(canonical(_M_src)) {
+        case VIDEO_PALETTE_GREY:
+            memcpy(y, s, w);
+            memset(u, 128, w);
+            memset(v, 128, w);
+            break;
+        case VIDEO_PALETTE_YUYV:
+        case VIDEO_PALETTE_UYVY:
+            {
+                int yo = _M_src == VIDEO_PALETTE_UYVY ? 1 : 0;
+                int co = 1 - yo;
+                for(int x = 0; x < w; x++) {
+                    int c = 4*(x/2) + co;
+                    y[x] = s[2*x + yo];
+                    u[x] = s[c];
+                    v[x] = c + 2 < 2*w ? s[c + 2] : 128;  /* odd width: the last pair has no V */
+                }
+            } break;
+        default: /* planar */
+            {
+                const struct vscull_format *f = PALETTE_FORMAT(_M_src);
+                const unsigned char *su = src.plane[1] + (row >> f->vsub) * src.stride[1];
+                const unsigned char *sv = src.plane[2] + (row >> f->vsub) * src.stride[2];
+                memcpy(y, s, w);
+                if (f->hsub == 1) {
+                    for(int x = 0; x < w / 2; x++) {
+                        u[2*x] = u[2*x+1] = su[x];
+                        v[2*x] = v[2*x+1] = sv[x];
+                    }
+                    if (w & 1) {
+                        u[w-1] = su[w/2];
+                        v[w-1] = sv[w/2];
+                    }
+                }
+                else {
+                    for(int x = 0; x < w; x++) {
+                        u[x] = su[x >> f->hsub];
+                        v[x] = sv[x >> f->hsub];
+                    }
+                }
+            } break;
+        }
+
+        if (kind(_M_dst) == KIND_RGB)
+            kern->yuv_to_bgrx(y, u, v, bgrx, w);
+    }
+
+
+    /* the rows in the buffers to the destination, from row on */
+    void
+    Converter::pack(const image &dst, int row, int rows)
+    {
+        int w = _M_width;
+
+        if (kind(_M_dst) == KIND_RGB) {
+            for(int i = 0; i < rows; i++)
+                pack_rgb(_M_dst, &_M_bgrx[i * 4 * w], dst.plane[0] + (row + i) * dst.stride[0], w);
+            return;
+        }
+
+        switch(canonical(_M_dst)) {
+        case VIDEO_PALETTE_GREY:
+            for(int i = 0; i < rows; i++)
+                memcpy(dst.plane[0] + (row + i) * dst.stride[0], &_M_yuv[i * 3 * w], w);
+            break;
+        case VIDEO_PALETTE_YUYV:
+        case VIDEO_PALETTE_UYVY:
+            {
+                int yo = _M_dst == VIDEO_PALETTE_UYVY ? 1 : 0;
+                int co = 1 - yo;
+                for(int i = 0; i < rows; i++) {
+                    const unsigned char *y = &_M_yuv[i * 3 * w], *u = y + w, *v = u + w;
+                    unsigned char *d = dst.plane[0] + (row + i) * dst.stride[0];
+                    for(int x = 0; x < w; x += 2) {
+                        int x1 = std::min(x + 1, w - 1);
+                        d[2*x + yo] = y[x];
+                        d[2*x + co] = (u[x] + u[x1] + 1) >> 1;
+                        if (x + 1 < w) {
+                            d[2*x + 2 + yo] = y[x1];
+                            d[2*x + 2 + co] = (v[x] + v[x1] + 1) >> 1;
+                        }
+                    }
+                }
+            } break;
+        default: /* planar: chroma averaged over the subsampling block */
+            {
+                const struct vscull_format *f = PALETTE_FORMAT(_M_dst);
+                int hs = 1 << f->hsub;
+                int crow = row >> f->vsub;
+                int cw = (w + hs - 1) >> f->hsub;
+
+                for(int i = 0; i < rows; i++)
+                    memcpy(dst.plane[0] + (row + i) * dst.stride[0], &_M_yuv[i * 3 * w], w);
+
+                unsigned char *du = dst.plane[1] + crow * dst.stride[1];
+                unsigned char *dv = dst.plane[2] + crow * dst.stride[2];
+
+                /* full blocks: the count is a power of 2 */
+                int full = rows == (1 << f->vsub) ? w >> f->hsub : 0;
+                int shift = f->hsub + f->vsub;
+                int cx = 0;
+
+                if (hs == 2 && rows <= 2) {     /* 4:2:0 and 4:2:2, vectorized by the compiler */
+                    const unsigned char *u0 = &_M_yuv[w], *v0 = u0 + w;
+                    const unsigned char *u1 = rows == 2 ? &_M_yuv[3 * w + w] : u0, *v1 = u1 + w;   /* a single row counts twice */
+                    for(; cx < w / 2; cx++) {
+                        du[cx] = (u0[2*cx] + u0[2*cx+1] + u1[2*cx] + u1[2*cx+1] + 2) >> 2;
+                        dv[cx] = (v0[2*cx] + v0[2*cx+1] + v1[2*cx] + v1[2*cx+1] + 2) >> 2;
+                    }
+                }
+
+                for(; cx < cw; cx++) {
+                    int x0 = cx * hs, x1 = std::min(x0 + hs, w);
+                    int su = 0, sv = 0, cnt = (x1 - x0) * rows;
+                    for(int i = 0; i < rows; i++) {
+                        const unsigned char *u = &_M_yuv[i * 3 * w + w], *v = u + w;
+                        for(int x = x0; x < x1; x++) {
+                            su += u[x];
+                            sv += v[x];
+                        }
+                    }
+                    if (cx < full) {
+                        du[cx] = (su + (cnt >> 1)) >> shift;
+                        dv[cx] = (sv + (cnt >> 1)) >> shift;
+                    }
+                    else {
+                        du[cx] = (su + cnt/2) / cnt;
+                        dv[cx] = (sv + cnt/2) / cnt;
+                    }
+                }
+            } break;
+        }
+    }
+
+
+    const char *
+    conv_isa()
+    { return kern->name; }
+
+
+    bool
+    conv_select(const char *isa)
+    {
+        for(std::size_t n = 0; n < sizeof(isa_table)/sizeof(isa_table[0]); n++)
+            if (strcmp(isa_table[n].name, isa) == 0 && isa_table[n].available()) {
+                kern = &isa_table[n];
+                return true;
+            }
+        return false;
+    }
+
+
+    std::vector<const char *>
+    conv_isa_list()
+    {
+        std::vector<const char *> ret;
+        for(std::size_t n = 0; n < sizeof(isa_table)/sizeof(isa_table[0]); n++)
+            if (isa_table[n].available())
+                ret.push_back(isa_table[n].name);
+        return ret;
+    }
+}
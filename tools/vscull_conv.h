@@ -0,0 +1,98 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+//  Palette conversion between the v4l palettes of vscull_palette.h.
+//
+//  Supported: GREY, RGB565, RGB555, RGB24, RGB32, YUV422 (as YUYV), YUYV, UYVY and the
+//  planar YUV422P, YUV411P, YUV420P, YUV410P. RGB24/RGB32 are stored B,G,R(,X) as in v4l;
+//  the colour space is BT.601 with limited range.
+//
+//  Rows are unpacked to full resolution YUV or BGRX, converted if needed and packed into
+//  the destination. The colour conversion kernels have scalar, SSE4.1, AVX2 and NEON
+//  versions, selected at runtime; all of them give the same result bit by bit.
+//
+
+#ifndef _VSCULL_CONV_H_
+#define _VSCULL_CONV_H_
+
+#include <sys/types.h>
+#include <vscull_ioctl.h>
+
+#include <cstddef>
+#include <vector>
+
+namespace vscull {
+
+    // frame description: planes and strides in bytes
+
+    struct image
+    {
+        int palette;
+        int width;
+        int height;
+        unsigned char * plane[VSCULL_MAX_PLANES];
+        unsigned int    stride[VSCULL_MAX_PLANES];
+
+        image();
+
+        /* packed frame, as accepted by read()/write() */
+        image(int palette, int width, int height, unsigned char *base);
+
+        /* frame laid out by the driver (mmap, see VSIOCGPLANES) */
+        image(int palette, int width, int height, unsigned char *base, const struct vscull_planes &pl);
+
+        /* size of the packed frame (0: palette not supported) */
+        static std::size_t size(int palette, int width, int height);
+    };
+
+    class Converter
+    {
+        int _M_src;
+        int _M_dst;
+        int _M_width;
+        int _M_height;
+        int _M_rows;                            // rows converted together (vertical chroma subsampling)
+
+        std::vector<unsigned char> _M_yuv;      // _M_rows rows of Y, U, V at full resolution
+        std::vector<unsigned char> _M_bgrx;     // _M_rows rows of BGRX
+
+    public:
+        /* throws std::invalid_argument if a palette is not supported */
+        Converter(int src_palette, int dst_palette, int width, int height);
+
+        /* convert a frame: doesn't allocate */
+        void operator()(const image &src, const image &dst);
+
+        static bool supported(int palette);
+
+    private:
+        void unpack(const image &src, int row, unsigned char *y, unsigned char *u, unsigned char *v, unsigned char *bgrx);
+        void pack(const image &dst, int row, int rows);
+    };
+
+    /* kernels in use: "scalar", "sse4.1", "avx2" or "neon" */
+    const char * conv_isa();
+
+    /* select the kernels (for testing and benchmarking): false if not available here */
+    bool conv_select(const char *isa);
+
+    /* kernels available on this cpu, the best last */
+    std::vector<const char *> conv_isa_list();
+}
+
+#endif /* _VSCULL_CONV_H_ */
@@ -0,0 +1,146 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/* vscull_conv_bench: palette conversion throughput.
+
+   Each conversion is run with every set of kernels available on this cpu; the output
+   is checked against the scalar kernels. No device is needed. */
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+#include <vscull_conv.h>
+
+#include <getopt.h>
+#include <time.h>
+
+extern char *__progname;
+
+const char usage[]=
+      "%s [options]\n"
+      "   -W width            (640 is default)\n"
+      "   -H height           (480 is default)\n"
+      "   -n frames           frames converted per test (500 is default)\n"
+      "   -s palette          source palette (default: a set of common conversions)\n"
+      "   -d palette          destination palette\n"
+      "   -h                  print this help\n";
+
+
+static inline double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static bool
+bench(int s, int d, int w, int h, int frames)
+{
+    std::vector<unsigned char> src(vscull::image::size(s, w, h));
+    std::vector<unsigned char> ref(vscull::image::size(d, w, h));
+    std::vector<unsigned char> out(ref.size());
+
+    srand(s * 256 + d);
+    for(size_t n = 0; n < src.size(); n++)
+        src[n] = rand();
+
+    vscull::Converter conv(s, d, w, h);
+    vscull::image si(s, w, h, &src[0]);
+
+    vscull::conv_select("scalar");
+    conv(si, vscull::image(d, w, h, &ref[0]));
+
+    bool ok = true;
+    std::vector<const char *> isa = vscull::conv_isa_list();
+
+    for(size_t k = 0; k < isa.size(); k++) {
+        vscull::conv_select(isa[k]);
+        vscull::image di(d, w, h, &out[0]);
+
+        double t0 = now();
+        for(int f = 0; f < frames; f++)
+            conv(si, di);
+        double t = now() - t0;
+
+        bool same = out == ref;
+        ok = ok && same;
+
+        printf("%-18s -> %-18s %-7s %8.1f fps %8.1f Mpixel/s%s\n", PALETTE((unsigned int)s), PALETTE((unsigned int)d), isa[k],
+               frames / t, (double)w * h * frames / t / 1e6, same ? "" : "  MISMATCH");
+    }
+    return ok;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+    int w = 640, h = 480;
+    int frames = 500;
+    int s = -1, d = -1;
+
+    while(( i = getopt(argc, argv, "W:H:n:s:d:h")) != EOF)
+        switch(i) {
+        case 'W': w = atoi(optarg);
+                  break;
+        case 'H': h = atoi(optarg);
+                  break;
+        case 'n': frames = atoi(optarg);
+                  break;
+        case 's': s = atoi(optarg);
+                  break;
+        case 'd': d = atoi(optarg);
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    static const int common[][2] =
+    {
+        { VIDEO_PALETTE_YUV420P, VIDEO_PALETTE_RGB24   },
+        { VIDEO_PALETTE_YUV420P, VIDEO_PALETTE_RGB32   },
+        { VIDEO_PALETTE_RGB24,   VIDEO_PALETTE_YUYV    },
+        { VIDEO_PALETTE_RGB24,   VIDEO_PALETTE_YUV420P },
+        { VIDEO_PALETTE_YUYV,    VIDEO_PALETTE_YUV420P },
+        { VIDEO_PALETTE_UYVY,    VIDEO_PALETTE_RGB565  },
+    };
+
+    bool ok = true;
+
+    try {
+        if (s > 0 && d > 0)
+            ok = bench(s, d, w, h, frames);
+        else
+            for(size_t n = 0; n < sizeof(common)/sizeof(common[0]); n++)
+                ok = bench(common[n][0], common[n][1], w, h, frames) && ok;
+    }
+    catch(std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/* vscull_convert: conversion stage between two vscull devices.
+
+   Frames read from the input device are converted to the palette of the output device
+   and published there. The output device is set to the geometry of the input one. */
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+#include <vscull_stream.h>
+#include <vscull_conv.h>
+
+#include <getopt.h>
+
+extern char *__progname;
+
+const char usage[]=
+      "%s [options]\n"
+      "   -i minor            input vscull device (/dev/video0 is default)\n"
+      "   -o minor            output vscull device (/dev/video1 is default)\n"
+      "   -p palette          palette of the output [1-16] see include/linux/videodev.h\n"
+      "   -n frames           frames to convert (0: forever, default)\n"
+      "   -r                  use read()/write() instead of mmap()\n"
+      "   -I isa              conversion kernels (scalar, sse4.1, avx2, neon)\n"
+      "   -h                  print this help\n";
+
+
+template <typename S, typename F>
+static vscull::image
+frame_image(const S &s, const F &f)
+{
+    vscull::image img;
+    img.palette = s.dev().palette();
+    img.width   = s.dev().width();
+    img.height  = s.dev().height();
+    for(int n = 0; n < s.nplanes(); n++) {
+        img.plane[n]  = const_cast<unsigned char *>(f.plane(n).data());
+        img.stride[n] = s.stride(n);
+    }
+    return img;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+    int in = 0, out = 1;
+    int p = -1;
+    long n = 0;
+    vscull::access a = vscull::access::automatic;
+
+    while(( i = getopt(argc, argv, "i:o:p:n:rI:h")) != EOF)
+        switch(i) {
+        case 'i': in = atoi(optarg);
+                  break;
+        case 'o': out = atoi(optarg);
+                  break;
+        case 'p': p = atoi(optarg);
+                  break;
+        case 'n': n = atol(optarg);
+                  break;
+        case 'r': a = vscull::access::rw;
+                  break;
+        case 'I': if (!vscull::conv_select(optarg)) {
+                      fprintf(stderr,"%s: kernels not available\n", optarg);
+                      exit(1);
+                  }
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    try {
+        vscull::Consumer cons(in, a);
+        const vscull::Dev &src = cons.dev();
+
+        if (p < 0)
+            p = src.palette();
+
+        if (!vscull::Converter::supported(src.palette()) || !vscull::Converter::supported(p)) {
+            std::cerr << "palette not supported: " << PALETTE((unsigned int)src.palette()) << " -> " << PALETTE((unsigned int)p) << std::endl;
+            return 1;
+        }
+
+        /* the output takes the input geometry: set it before it's mapped */
+        {
+            vscull::Dev dst(out);
+            dst.width(src.width());
+            dst.height(src.height());
+            dst.palette(p);
+            dst.depth(PALETTE_FORMAT(p)->bpp);
+            dst.commit();
+        }
+
+        vscull::Producer prod(out, a);
+        vscull::Converter conv(src.palette(), p, src.width(), src.height());
+
+        std::cout << src.name() << " [" << src.width() << "x" << src.height() << " " << PALETTE((unsigned int)src.palette()) << "] -> "
+                  << prod.dev().name() << " [" << PALETTE((unsigned int)p) << "] (" << vscull::conv_isa()
+                  << (cons.mapped() ? ", mmap" : ", read") << "/" << (prod.mapped() ? "mmap" : "write") << ")" << std::endl;
+
+        for(long k = 0; n == 0 || k < n; k++) {
+            vscull::Consumer::Frame f = cons.acquire();
+            if (!f)
+                return 1;
+
+            vscull::Producer::Frame g = prod.acquire();
+            conv(frame_image(cons, f), frame_image(prod, g));
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -17,7 +17,11 @@
 */
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
 #include <cstdlib>
+#include <cstring>
 
 #include <vscull_ioctl.h>
 #include <vscull_palette.h>
@@ -35,8 +39,194 @@ const char usage[]=
       "   -p palette          [1-16] see include/linux/videodev.h\n"
       "   -d depth            32/24 bit per pixel\n"
       "   -f fps              frame per second\n"
+      "   -F flags            device flags (1: page-aligned planes, 2: nocache copies,\n"
+      "                       4: cached copies, 8: streaming writes, 16: repeat the last frame\n"
+      "                       at the fps while the writer stalls, 32: detect the frames written\n"
+      "                       identical to the last one)\n"
+      "   -N node             place the frame on a NUMA node (-1: follow the writer)\n"
+      "   -L kb               max. frame memory of the device (0: no limit)\n"
+      "   -T tiles            mosaic: slice the frames into child devices, 'minor@x:y,...'\n"
+      "                       (tiles have the geometry of the child; '-': no mosaic)\n"
+      "   -R regions          composition: regions written by concurrent producers, 'WxH@x:y,...'\n"
+      "                       ('-': single writer)\n"
+      "   -t trigger          publish the composed frame: all (all regions updated, default),\n"
+      "                       ms (every ms, if any region was updated), all+ms\n"
+      "   -P                  print frame pool statistics\n"
+      "   -a                  print the state of all the devices (/dev/" VSCULL_CTL_NAME ")\n"
+      "   -c file             configure many devices at once, one line per device:\n"
+      "                       'minor width height palette depth fps' ('-' keeps the value)\n"
       "   -h                  print this help\n";
 
+static void
+print_all(const vscull::Ctl &ctl)
+{
+    std::vector<struct vscull_dev_state> st;
+    if (!ctl.state(st))
+        return;
+
+    std::cout << "minor  width height palette        depth fps flags   pid open node   image_size    memory     limit\n";
+    for(size_t n = 0; n < st.size(); n++) {
+        char line[160];
+        snprintf(line, sizeof(line), "%5d %6d %6d %2d[%-10s] %5d %3d 0x%-3x %5d %4d %4d %12u %9llu %9llu\n",
+                 st[n].minor, st[n].par.width, st[n].par.height, st[n].par.palette, PALETTE(st[n].par.palette),
+                 st[n].par.depth, st[n].par.fps, st[n].flags, (int)st[n].pid, st[n].openers, st[n].frame_node,
+                 st[n].image_size, st[n].mem, st[n].mem_limit);
+        std::cout << line;
+    }
+}
+
+
+/* 'minor@x:y,...' */
+static bool
+parse_tiles(const char *s, std::vector<struct vscull_tile> &tiles)
+{
+    if (strcmp(s, "-") == 0)
+        return true;
+
+    while (*s) {
+        struct vscull_tile t;
+        int len;
+        if (sscanf(s, "%d@%d:%d%n", &t.minor, &t.x, &t.y, &len) != 3)
+            return false;
+        tiles.push_back(t);
+        s += len;
+        if (*s == ',')
+            s++;
+        else if (*s)
+            return false;
+    }
+    return true;
+}
+
+
+/* 'WxH@x:y,...' */
+static bool
+parse_regions(const char *s, std::vector<struct vscull_region> &regions)
+{
+    if (strcmp(s, "-") == 0)
+        return true;
+
+    while (*s) {
+        struct vscull_region r;
+        int len;
+        if (sscanf(s, "%dx%d@%d:%d%n", &r.width, &r.height, &r.x, &r.y, &len) != 4)
+            return false;
+        regions.push_back(r);
+        s += len;
+        if (*s == ',')
+            s++;
+        else if (*s)
+            return false;
+    }
+    return true;
+}
+
+
+/* 'all', 'ms' or 'all+ms' */
+static bool
+parse_trigger(const char *s, int &trigger, unsigned int &period)
+{
+    trigger = 0;
+    if (strncmp(s, "all", 3) == 0) {
+        trigger |= VSCULL_TRIG_ALL;
+        s += 3;
+        if (*s == '\0')
+            return true;
+        if (*s++ != '+')
+            return false;
+    }
+    char *end;
+    period = strtoul(s, &end, 10);
+    if (end == s || *end || period == 0)
+        return false;
+    trigger |= VSCULL_TRIG_TIMER;
+    return true;
+}
+
+
+static bool
+parse_field(const std::string &tok, int cur, int &val)
+{
+    if (tok == "-") {
+        val = cur;
+        return true;
+    }
+    char *end;
+    val = strtol(tok.c_str(), &end, 0);
+    return *end == '\0';
+}
+
+
+static int
+configure(vscull::Ctl &ctl, const char *file)
+{
+    std::ifstream in(file);
+    if (!in) {
+        std::clog << "open: couldn't open " << file << std::endl;
+        return 1;
+    }
+
+    std::vector<struct vscull_dev_state> st;
+    if (!ctl.state(st))
+        return 1;
+
+    std::vector<struct vscull_dev_par> par;
+    std::string line;
+    int lineno = 0;
+
+    while (std::getline(in, line)) {
+        lineno++;
+        line = line.substr(0, line.find('#'));
+
+        std::istringstream ss(line);
+        std::string tok[6];
+        int k = 0;
+        while (k < 6 && ss >> tok[k])
+            k++;
+        if (k == 0)
+            continue;
+
+        struct vscull_dev_par p;
+        memset(&p, 0, sizeof(p));
+
+        size_t n;
+        if (k != 6 || !parse_field(tok[0], -1, p.minor)) {
+            std::clog << file << ":" << lineno << ": syntax error" << std::endl;
+            return 1;
+        }
+        for(n = 0; n < st.size() && st[n].minor != p.minor; n++)
+        { }
+        if (n == st.size()) {
+            std::clog << file << ":" << lineno << ": no such device /dev/video" << p.minor << std::endl;
+            return 1;
+        }
+
+        if (!parse_field(tok[1], st[n].par.width,   p.par.width)   ||
+            !parse_field(tok[2], st[n].par.height,  p.par.height)  ||
+            !parse_field(tok[3], st[n].par.palette, p.par.palette) ||
+            !parse_field(tok[4], st[n].par.depth,   p.par.depth)   ||
+            !parse_field(tok[5], st[n].par.fps,     p.par.fps)) {
+            std::clog << file << ":" << lineno << ": syntax error" << std::endl;
+            return 1;
+        }
+        par.push_back(p);
+    }
+
+    if (!ctl.set(par))
+        return 1;
+
+    int ret = 0;
+    for(size_t n = 0; n < par.size(); n++) {
+        if (par[n].result < 0) {
+            std::clog << "/dev/video" << par[n].minor << ": " << strerror(-par[n].result) << std::endl;
+            ret = 1;
+        }
+    }
+    std::cout << "committing changes to " << par.size() << " device(s)...\n"; 
+    return ret;
+}
+
+
 int
 main(int argc, char *argv[])
 {
@@ -48,8 +238,18 @@ main(int argc, char *argv[])
     int p = -1;
     int d = -1;
     int f = -1;
+    int F = -1;
+    bool P = false;
+    int N = -2;
+    long long L = -1;
+    const char *T = NULL;
+    const char *R = NULL;
+    int trigger = VSCULL_TRIG_ALL;
+    unsigned int period = 0;
+    bool a = false;
+    const char *c = NULL;
 
-    while(( i = getopt(argc, argv, "m:W:H:p:d:f:h")) != EOF)
+    while(( i = getopt(argc, argv, "m:W:H:p:d:f:F:N:L:T:R:t:Pac:h")) != EOF)
         switch(i) {
         case 'm': minor = atoi(optarg);
                   break;
@@ -63,10 +263,42 @@ main(int argc, char *argv[])
                   break;
         case 'f': f = atoi(optarg);
                   break;
+        case 'F': F = strtol(optarg, NULL, 0);
+                  break;
+        case 'P': P = true;
+                  break;
+        case 'N': N = atoi(optarg);
+                  break;
+        case 'L': L = atoll(optarg);
+                  break;
+        case 'T': T = optarg;
+                  break;
+        case 'R': R = optarg;
+                  break;
+        case 't': if (!parse_trigger(optarg, trigger, period)) {
+                      fprintf(stderr, "bad trigger: %s\n", optarg);
+                      exit(1);
+                  }
+                  break;
+        case 'a': a = true;
+                  break;
+        case 'c': c = optarg;
+                  break;
         case 'h': fprintf(stderr,usage,__progname); exit(0);
         case '?': fprintf(stderr,"unknown option!\n"); exit(1);
         }
 
+    if (a || c) {
+        vscull::Ctl ctl;
+        int ret = 0;
+
+        if (c)
+            ret = configure(ctl, c);
+        if (a)
+            print_all(ctl);
+        return ret;
+    }
+
     vscull::Dev dev(minor);
 
     if (w > 0) {
@@ -84,11 +316,37 @@ main(int argc, char *argv[])
     if (f > -1) {
         dev.fps(f);
     }
+    if (F > -1) {
+        dev.flags(F);
+    }
 
     if( dev.commit() ) {
         std::cout << "committing changes...\n"; 
     }
 
+    if (N > -2) {
+        dev.numa(N);
+    }
+    if (L > -1) {
+        dev.mem_limit(L << 10);
+    }
+    if (T) {
+        std::vector<struct vscull_tile> tiles;
+        if (!parse_tiles(T, tiles)) {
+            fprintf(stderr, "bad tiles: %s\n", T);
+            return 1;
+        }
+        dev.mosaic(tiles);
+    }
+    if (R) {
+        std::vector<struct vscull_region> regions;
+        if (!parse_regions(R, regions)) {
+            fprintf(stderr, "bad regions: %s\n", R);
+            return 1;
+        }
+        dev.regions(regions, trigger, period);
+    }
+
     dev.update();
 
     std::cout << dev.name() << " vscull settings: \n"; 
@@ -97,6 +355,55 @@ main(int argc, char *argv[])
     std::cout << "   palette: " << dev.palette() << "[" << PALETTE(dev.palette()) << "]" << std::endl;    
     std::cout << "   depth  : " << dev.depth() << std::endl;    
     std::cout << "   fps    : " << dev.fps() << std::endl;    
+    std::cout << "   flags  : 0x" << std::hex << dev.flags() << std::dec << std::endl;    
+
+    struct vscull_planes pl;
+    if (dev.planes(pl)) {
+        for(int n = 0; n < pl.nplanes; n++)
+            std::cout << "   plane " << n << ": offset=" << pl.plane[n].offset 
+                      << " size=" << pl.plane[n].size << " stride=" << pl.plane[n].stride << std::endl;
+    }
+
+    struct vscull_numa numa;
+    if (dev.numa(numa)) {
+        std::cout << "   numa   : node=" << numa.node << " frame_node=" << numa.frame_node 
+                  << " writer_cpu=" << numa.writer_cpu << " reader_cpu=" << numa.reader_cpu << std::endl;
+    }
+
+    struct vscull_mosaic mo;
+    if (dev.mosaic(mo)) {
+        if (mo.master >= 0)
+            std::cout << "   mosaic : tile of /dev/video" << mo.master << std::endl;
+        for(int n = 0; n < mo.count; n++)
+            std::cout << "   tile " << n << " : /dev/video" << mo.tile[n].minor << " at " << mo.tile[n].x << "," << mo.tile[n].y << std::endl;
+    }
+
+    struct vscull_regions rg;
+    if (dev.regions(rg) && rg.count) {
+        std::cout << "   compose: " << ((rg.trigger & VSCULL_TRIG_ALL) ? "all regions" : "")
+                  << ((rg.trigger & VSCULL_TRIG_ALL) && (rg.trigger & VSCULL_TRIG_TIMER) ? " or " : "");
+        if (rg.trigger & VSCULL_TRIG_TIMER)
+            std::cout << "every " << rg.period_ms << " ms";
+        std::cout << ", pending 0x" << std::hex << rg.pending << std::dec << std::endl;
+        for(int n = 0; n < rg.count; n++)
+            std::cout << "   region " << n << ": " << rg.region[n].width << "x" << rg.region[n].height
+                      << " at " << rg.region[n].x << "," << rg.region[n].y << std::endl;
+    }
+
+    struct vscull_mem mem;
+    if (dev.mem(mem)) {
+        std::cout << "   memory : " << (mem.used >> 10) << " KB (limit " << (mem.limit >> 10) << " KB), all devices "
+                  << (mem.total >> 10) << " KB (budget " << (mem.budget >> 10) << " KB)" << std::endl;
+    }
+
+    struct vscull_pool_stats st;
+    if (P && dev.pool(st)) {
+        std::cout << "frame pool: \n"; 
+        std::cout << "   hits   : " << st.hits << std::endl;
+        std::cout << "   misses : " << st.misses << std::endl;
+        std::cout << "   trimmed: " << st.trims << std::endl;
+        std::cout << "   cached : " << st.cached << " bytes (" << st.buffers << " buffers, max " << st.max_kb << " KB)" << std::endl;
+    }
 
     return 0;
 }
@@ -23,73 +23,496 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
 
-// #include <vscull_dev.h>
+#include <vscull_ioctl.h>
+#include <vscull_shm.h>
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
 #include <string>
+#include <vector>
+#include <memory>
 #include <stdexcept>
 
+#ifndef VIDIOCSYNC
+#define VIDIOCSYNC  _IOW('v',18,int)    /* V4L1 ABI, include/linux/videodev.h */
+#endif
+
 namespace vscull {
 
+    // backend of the devices: the vscull module, or its user-space emulation (vscull_shm.h)
+
+    enum class backend { kernel, shm };
+
+    /* VSCULL_BACKEND=shm selects the user-space emulation */
+    static inline backend
+    default_backend()
+    {
+        const char *b = getenv("VSCULL_BACKEND");
+        return b && strcmp(b, "shm") == 0 ? backend::shm : backend::kernel;
+    }
+
     class Dev
     {
-        int         _M_fd;
+        int         _M_fd;          // -1 with the shm backend
         int         _M_minor; 
         std::string _M_dev;
+        std::unique_ptr<shm::device> _M_shm;
 
         struct vscull_ioctl _M_par;
+        int         _M_flags;
 
         bool        _M_changes;
+        bool        _M_flags_changes;
 
     public:
-        Dev(int min = 0)
-        : _M_fd(0),
+        Dev(int min = 0, backend b = default_backend())
+        : _M_fd(-1),
         _M_minor(min),
         _M_dev(),
+        _M_shm(),
         _M_par(),
-        _M_changes(false)
+        _M_flags(0),
+        _M_changes(false),
+        _M_flags_changes(false)
         {
-            char dev[80];
-            sprintf(dev, "/dev/video%d", _M_minor);
-            _M_dev.append(dev);
-
-            _M_fd = open(_M_dev.c_str(), O_RDWR);
-            if (_M_fd < 0) {
-                throw std::runtime_error(std::string("open: couldn't open ").append(_M_dev)); 
+            if (b == backend::shm) {
+                _M_shm.reset(new shm::device(_M_minor));
+                _M_dev.append("/dev/shm").append(shm::path(_M_minor));
+            }
+            else {
+                char dev[80];
+                sprintf(dev, "/dev/video%d", _M_minor);
+                _M_dev.append(dev);
+
+                _M_fd = open(_M_dev.c_str(), O_RDWR);
+                if (_M_fd < 0) {
+                    throw std::runtime_error(std::string("open: couldn't open ").append(_M_dev)); 
+                }
             }
 
             update();
         }
 
+        Dev(Dev &&other)
+        : _M_fd(other._M_fd),
+        _M_minor(other._M_minor),
+        _M_dev(std::move(other._M_dev)),
+        _M_shm(std::move(other._M_shm)),
+        _M_par(other._M_par),
+        _M_flags(other._M_flags),
+        _M_changes(other._M_changes),
+        _M_flags_changes(other._M_flags_changes)
+        {
+            other._M_fd = -1;
+        }
+
+        Dev & operator=(Dev &&other)
+        {
+            if (this != &other) {
+                if (_M_fd >= 0)
+                    close(_M_fd);
+                _M_fd = other._M_fd;
+                _M_minor = other._M_minor;
+                _M_dev = std::move(other._M_dev);
+                _M_shm = std::move(other._M_shm);
+                _M_par = other._M_par;
+                _M_flags = other._M_flags;
+                _M_changes = other._M_changes;
+                _M_flags_changes = other._M_flags_changes;
+                other._M_fd = -1;
+            }
+            return *this;
+        }
+
         ~Dev()
         {
-            close(_M_fd);
+            if (_M_fd >= 0)
+                close(_M_fd);
         }
 
         bool commit() 
         {
-            if (!_M_changes) {
+            if (!_M_changes && !_M_flags_changes) {
                 return false; 
             }
 
-            if ( ioctl(_M_fd, VSIOCSPAR, &_M_par) < 0 ) {
+            if ( _M_changes && (_M_shm ? !_M_shm->set_par(_M_par) : ioctl(_M_fd, VSIOCSPAR, &_M_par) < 0) ) {
                 std::clog << "ioctl: VSIOCSPAR error" << std::endl;
                 return false;
             }
+            if ( _M_flags_changes && (_M_shm ? !_M_shm->flags(_M_flags) : ioctl(_M_fd, VSIOCSFLAGS, &_M_flags) < 0) ) {
+                std::clog << "ioctl: VSIOCSFLAGS error" << std::endl;
+                return false;
+            }
+            _M_changes = _M_flags_changes = false;
             return true;
         }
 
-        bool update() const
+        bool update()
         {
+            if (_M_shm) {
+                _M_shm->get_par(_M_par);
+                _M_flags = _M_shm->flags();
+                return true;
+            }
             if ( ioctl(_M_fd, VSIOCGPAR, &_M_par) < 0 ) {
                 std::clog << "ioctl: VSIOCGPAR error" << std::endl;
                 return false;
             }
+            if ( ioctl(_M_fd, VSIOCGFLAGS, &_M_flags) < 0 ) {
+                std::clog << "ioctl: VSIOCGFLAGS error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool planes(struct vscull_planes &pl) const
+        {
+            if (_M_shm)
+                return _M_shm->planes(pl);
+            if ( ioctl(_M_fd, VSIOCGPLANES, &pl) < 0 ) {
+                std::clog << "ioctl: VSIOCGPLANES error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* use the producer's shared memory as the frame (addr = 0: back to a private frame) */
+        bool import(void *addr, size_t size)
+        {
+            struct vscull_import imp;
+            imp.addr = addr;
+            imp.size = size;
+
+            if (_M_shm)
+                return unsupported("VSIOCSIMPORT");
+
+            if ( ioctl(_M_fd, VSIOCSIMPORT, &imp) < 0 ) {
+                std::clog << "ioctl: VSIOCSIMPORT error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* signal the readers that the frame has been updated in place */
+        bool publish()
+        {
+            if (_M_shm)
+                return _M_shm->publish();
+            if ( ioctl(_M_fd, VSIOCPUBLISH) < 0 ) {
+                std::clog << "ioctl: VSIOCPUBLISH error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool pool(struct vscull_pool_stats &st) const
+        {
+            if (_M_shm)
+                return unsupported("VSIOCGPOOL");
+            if ( ioctl(_M_fd, VSIOCGPOOL, &st) < 0 ) {
+                std::clog << "ioctl: VSIOCGPOOL error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool mem(struct vscull_mem &mem) const
+        {
+            if (_M_shm) {
+                memset(&mem, 0, sizeof(mem));
+                mem.used = mem.total = (unsigned long long)_M_shm->state().frame_size * VSCULL_SHM_SLOTS;
+                return true;
+            }
+            if ( ioctl(_M_fd, VSIOCGMEM, &mem) < 0 ) {
+                std::clog << "ioctl: VSIOCGMEM error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* max. frame memory of the device, in bytes (0: no limit; CAP_SYS_ADMIN) */
+        bool mem_limit(unsigned long long limit)
+        {
+            if (_M_shm)
+                return unsupported("VSIOCSMEM");
+            if ( ioctl(_M_fd, VSIOCSMEM, &limit) < 0 ) {
+                std::clog << "ioctl: VSIOCSMEM error" << std::endl;
+                return false;
+            }
             return true;
         }
 
+        /* tiles fed by this device (mosaic master), or the master of a child */
+        bool mosaic(struct vscull_mosaic &mo) const
+        {
+            if (_M_shm) {
+                memset(&mo, 0, sizeof(mo));
+                mo.master = -1;
+                return true;
+            }
+            if ( ioctl(_M_fd, VSIOCGMOSAIC, &mo) < 0 ) {
+                std::clog << "ioctl: VSIOCGMOSAIC error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* slice the frames of this device into tiles published by the child devices */
+        bool mosaic(const std::vector<struct vscull_tile> &tiles)
+        {
+            struct vscull_mosaic mo;
+
+            if (tiles.size() > VSCULL_MAX_TILES) {
+                std::clog << "mosaic: too many tiles" << std::endl;
+                return false;
+            }
+            if (_M_shm)
+                return unsupported("VSIOCSMOSAIC");
+
+            memset(&mo, 0, sizeof(mo));
+            mo.count  = tiles.size();
+            mo.master = -1;
+            for(size_t n = 0; n < tiles.size(); n++)
+                mo.tile[n] = tiles[n];
+
+            if ( ioctl(_M_fd, VSIOCSMOSAIC, &mo) < 0 ) {
+                std::clog << "ioctl: VSIOCSMOSAIC error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* regions of the frame written by concurrent producers (composition) */
+        bool regions(struct vscull_regions &rg) const
+        {
+            if (_M_shm) {
+                memset(&rg, 0, sizeof(rg));
+                return true;
+            }
+            if ( ioctl(_M_fd, VSIOCGREGIONS, &rg) < 0 ) {
+                std::clog << "ioctl: VSIOCGREGIONS error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* split the frame into regions (none: a single writer); trigger: VSCULL_TRIG_* */
+        bool regions(const std::vector<struct vscull_region> &reg, int trigger = VSCULL_TRIG_ALL, unsigned int period_ms = 0)
+        {
+            struct vscull_regions rg;
+
+            if (reg.size() > VSCULL_MAX_REGIONS) {
+                std::clog << "regions: too many regions" << std::endl;
+                return false;
+            }
+            if (_M_shm)
+                return unsupported("VSIOCSREGIONS");
+
+            memset(&rg, 0, sizeof(rg));
+            rg.count     = reg.size();
+            rg.trigger   = trigger;
+            rg.period_ms = period_ms;
+            for(size_t n = 0; n < reg.size(); n++)
+                rg.region[n] = reg[n];
+
+            if ( ioctl(_M_fd, VSIOCSREGIONS, &rg) < 0 ) {
+                std::clog << "ioctl: VSIOCSREGIONS error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* write() (and publish()) update the given region only (-1: the whole frame) */
+        bool region(int n)
+        {
+            if (_M_shm)
+                return unsupported("VSIOCSREGION");
+            if ( ioctl(_M_fd, VSIOCSREGION, &n) < 0 ) {
+                std::clog << "ioctl: VSIOCSREGION error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool numa(struct vscull_numa &numa) const
+        {
+            if (_M_shm) {
+                errno = ENOTTY;     /* no placement to report */
+                return false;
+            }
+            if ( ioctl(_M_fd, VSIOCGNUMA, &numa) < 0 ) {
+                std::clog << "ioctl: VSIOCGNUMA error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* place the frame on a NUMA node (-1: follow the writer) */
+        bool numa(int node)
+        {
+            if (_M_shm)
+                return unsupported("VSIOCSNUMA");
+            if ( ioctl(_M_fd, VSIOCSNUMA, &node) < 0 ) {
+                std::clog << "ioctl: VSIOCSNUMA error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* select the plane returned by read() (-1: the whole frame) */
+        bool plane(int n)
+        {
+            if (_M_shm)
+                return _M_shm->plane(n);
+            if ( ioctl(_M_fd, VSIOCSPLANE, &n) < 0 ) {
+                std::clog << "ioctl: VSIOCSPLANE error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* enqueue a frame for presentation at pts (CLOCK_MONOTONIC, nsec) */
+        bool queue(const void *buf, size_t len, long long pts)
+        {
+            struct vscull_qframe qf;
+            qf.data = buf;
+            qf.size = len;
+            qf.pts  = pts;
+
+            if (_M_shm) {
+                /* no presentation thread: the frame is written at its pts */
+                struct timespec ts = { (time_t)(pts / 1000000000LL), (long)(pts % 1000000000LL) };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+                { }
+                return write(buf, len) >= 0;
+            }
+
+            if ( ioctl(_M_fd, VSIOCQFRAME, &qf) < 0 ) {
+                std::clog << "ioctl: VSIOCQFRAME error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        bool flush()
+        {
+            if ( !_M_shm && ioctl(_M_fd, VSIOCQFLUSH) < 0 ) {
+                std::clog << "ioctl: VSIOCQFLUSH error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        pid_t reserved() const
+        {
+            pid_t pid = 0;
+            if (_M_shm)
+                return _M_shm->reserved();
+            if ( ioctl(_M_fd, VSIOCGRES, &pid) < 0 )
+                std::clog << "ioctl: VSIOCGRES error" << std::endl;
+            return pid;
+        }
+
+        bool reserve(pid_t pid)
+        {
+            if (_M_shm)
+                return _M_shm->reserve(pid);
+            if ( ioctl(_M_fd, VSIOCSRES, &pid) < 0 ) {
+                std::clog << "ioctl: VSIOCSRES error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        // frame access (see vscull_stream.h)
+
+        /* map the frame (size: the frame extent); NULL on failure */
+        unsigned char * map(size_t size, int prot)
+        {
+            if (_M_shm)
+                return _M_shm->map(prot);
+            void *m = ::mmap(0, size, prot, MAP_SHARED, _M_fd, 0);
+            return m == MAP_FAILED ? 0 : static_cast<unsigned char *>(m);
+        }
+
+        void unmap(unsigned char *addr, size_t size)
+        {
+            if (_M_shm)
+                _M_shm->unmap();
+            else
+                ::munmap(addr, size);
+        }
+
+        /* offset of the frame in the mapping: the frame to write, or the last one synced */
+        size_t offset(bool writer) const
+        { return _M_shm ? _M_shm->offset(writer) : 0; }
+
+        /* wait for a frame not seen yet, up to a frame period (VIDIOCSYNC) */
+        bool sync()
+        {
+            int frame = 0;
+            if (_M_shm)
+                return _M_shm->sync();
+            if ( ioctl(_M_fd, VIDIOCSYNC, &frame) < 0 ) {
+                std::clog << "ioctl: VIDIOCSYNC error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* read() and sync() skip the frames identical to the previous one (repeats, duplicates):
+           ignored by the shm backend, which publishes them all */
+        bool skip(bool on)
+        {
+            int val = on;
+            if (_M_shm)
+                return true;
+            if ( ioctl(_M_fd, VSIOCSSKIP, &val) < 0 ) {
+                std::clog << "ioctl: VSIOCSSKIP error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* the frame last seen with read() or sync(): sequence, repeat/duplicate flags, time */
+        bool frame_info(struct vscull_frame_info &fi) const
+        {
+            if (_M_shm) {
+                memset(&fi, 0, sizeof(fi));
+                fi.seq = _M_shm->seen();
+                fi.ts  = _M_shm->state().last;
+                return true;
+            }
+            if ( ioctl(_M_fd, VSIOCGFINFO, &fi) < 0 ) {
+                std::clog << "ioctl: VSIOCGFINFO error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        ssize_t read(void *buf, size_t len)
+        { return _M_shm ? _M_shm->read(buf, len) : ::read(_M_fd, buf, len); }
+
+        ssize_t write(const void *buf, size_t len)
+        { return _M_shm ? _M_shm->write(buf, len) : ::write(_M_fd, buf, len); }
+
+        /* the device descriptor, for poll() (-1 with the shm backend) */
+        const int
+        fd() const
+        { return _M_fd; }
+
+        /* true with the shm backend */
+        bool emulated() const
+        { return _M_shm != 0; }
+
         const std::string
         name() const
         { return _M_dev; }
@@ -118,6 +541,10 @@ namespace vscull {
         fps() const
         { return _M_par.fps; }
 
+        const int
+        flags() const
+        { return _M_flags; }
+
         void width(int w)
         { set(_M_par.width,w); }
 
@@ -133,10 +560,25 @@ namespace vscull {
         void fps(int f)
         { set(_M_par.fps,f); } 
 
+        void flags(int f)
+        {
+            if (_M_flags != f) {
+                _M_flags = f;
+                _M_flags_changes = true;
+            }
+        }
+
     private:
-        // non-copyable idiom
-        Dev(const Dev &);
-        Dev & operator=(const Dev &);
+        // non-copyable, movable
+        Dev(const Dev &) = delete;
+        Dev & operator=(const Dev &) = delete;
+
+        bool unsupported(const char *what) const
+        {
+            std::clog << _M_dev << ": " << what << " not supported by the shm backend" << std::endl;
+            errno = ENOTTY;
+            return false;
+        }
 
         template <typename T>
         void set(T & r, T val)
@@ -147,6 +589,154 @@ namespace vscull {
             }
         }
     };
+
+    // control node: bulk query and configuration of all the devices 
+
+    class Ctl
+    {
+        int _M_fd;      // -1 with the shm backend: the devices are looked up one by one
+
+    public:
+        Ctl(backend b = default_backend())
+        : _M_fd(-1)
+        {
+            if (b == backend::shm)
+                return;
+
+            _M_fd = open("/dev/" VSCULL_CTL_NAME, O_RDWR);
+            if (_M_fd < 0) {
+                throw std::runtime_error("open: couldn't open /dev/" VSCULL_CTL_NAME); 
+            }
+        }
+
+        ~Ctl()
+        {
+            if (_M_fd >= 0)
+                close(_M_fd);
+        }
+
+        /* snapshot of all the devices */
+        bool state(std::vector<struct vscull_dev_state> &st) const
+        {
+            struct vscull_bulk bulk;
+
+            if (_M_fd < 0) {
+                st.clear();
+                for(int minor = 0; minor < VSCULL_MAXDEVS; minor++) {
+                    try {
+                        shm::device dev(minor, false);
+                        const shm::header &h = dev.state();
+                        struct vscull_dev_state s;
+
+                        memset(&s, 0, sizeof(s));
+                        s.minor      = minor;
+                        dev.get_par(s.par);
+                        s.flags      = h.flags;
+                        s.pid        = h.pid;
+                        s.openers    = h.openers - 1;       /* but this one */
+                        s.frame_node = -1;
+                        s.frame_size = h.frame_size;
+                        s.image_size = h.image_size;
+                        s.mem        = (unsigned long long)h.frame_size * VSCULL_SHM_SLOTS;
+                        st.push_back(s);
+                    }
+                    catch(std::exception &) {
+                    }
+                }
+                return true;
+            }
+
+            st.resize(VSCULL_MAXDEVS);
+            bulk.count   = st.size();
+            bulk.entries = &st[0];
+
+            if ( ioctl(_M_fd, VSIOCBGSTATE, &bulk) < 0 ) {
+                std::clog << "ioctl: VSIOCBGSTATE error" << std::endl;
+                return false;
+            }
+            st.resize(bulk.count);
+            return true;
+        }
+
+        /* activity counters of all the devices (the shm backend has no per-file counters) */
+        bool stats(std::vector<struct vscull_dev_stats> &st) const
+        {
+            struct vscull_bulk bulk;
+
+            if (_M_fd < 0) {
+                st.clear();
+                for(int minor = 0; minor < VSCULL_MAXDEVS; minor++) {
+                    try {
+                        shm::device dev(minor, false);
+                        const shm::header &h = dev.state();
+                        struct vscull_dev_stats s;
+
+                        memset(&s, 0, sizeof(s));
+                        s.minor      = minor;
+                        s.pid        = h.pid;
+                        s.fps        = h.par.fps;
+                        s.image_size = h.image_size;
+                        s.mem        = (unsigned long long)h.frame_size * VSCULL_SHM_SLOTS;
+                        s.ts         = shm::now_ns();
+                        s.seq        = (unsigned int)__atomic_load_n(&h.seq, __ATOMIC_ACQUIRE);
+                        s.written    = s.seq;
+                        s.nfiles     = h.openers - 1;       /* but this one */
+                        st.push_back(s);
+                    }
+                    catch(std::exception &) {
+                    }
+                }
+                return true;
+            }
+
+            st.resize(VSCULL_MAXDEVS);
+            bulk.count   = st.size();
+            bulk.entries = &st[0];
+
+            if ( ioctl(_M_fd, VSIOCBGSTATS, &bulk) < 0 ) {
+                std::clog << "ioctl: VSIOCBGSTATS error" << std::endl;
+                return false;
+            }
+            st.resize(std::min<size_t>(bulk.count, st.size()));
+            return true;
+        }
+
+        /* configure many devices in one call: par[n].result holds the outcome of each entry */
+        bool set(std::vector<struct vscull_dev_par> &par)
+        {
+            struct vscull_bulk bulk;
+
+            if (par.empty())
+                return true;
+
+            if (_M_fd < 0) {
+                for(size_t n = 0; n < par.size(); n++) {
+                    try {
+                        shm::device dev(par[n].minor, false);
+                        par[n].result = dev.set_par(par[n].par) ? 0 : -errno;
+                    }
+                    catch(std::exception &) {
+                        par[n].result = -ENODEV;
+                    }
+                }
+                return true;
+            }
+
+            bulk.count   = par.size();
+            bulk.entries = &par[0];
+
+            if ( ioctl(_M_fd, VSIOCBSPAR, &bulk) < 0 ) {
+                std::clog << "ioctl: VSIOCBSPAR error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+    private:
+        // non-copyable idiom
+        Ctl(const Ctl &);
+        Ctl & operator=(const Ctl &);
+    };
 }
 
 #endif /* _VSCULL_DEV_H_ */
@@ -0,0 +1,450 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/* vscull_gen: synthetic frame generator for load testing.
+
+   Feeds one or more devices with a test pattern (colour bars or a moving gradient) with
+   the frame counter and the CLOCK_MONOTONIC timestamp of the frame burnt in. Patterns
+   are rendered once in the palette of the device: each frame is a copy of the pattern
+   plus the counter, so the generator runs at memory speed.
+
+   Each device is driven by its own thread with absolute deadlines; the achieved fps and
+   the pacing error (publish time - deadline) are reported per device. */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+#include <vscull_stream.h>
+#include <vscull_conv.h>
+
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+
+extern char *__progname;
+
+const char usage[]=
+      "%s [options]\n"
+      "   -m minors           vscull video devices, e.g. 0,2-5 (/dev/video0 is default)\n"
+      "   -W width            (device setting is default)\n"
+      "   -H height           \n"
+      "   -p palette          [1-16] see include/linux/videodev.h\n"
+      "   -f fps              frame per second (0: as fast as possible, the driver doesn't pace)\n"
+      "   -P pattern          bars, gradient (bars is default)\n"
+      "   -s pixels           gradient speed per frame (4 is default)\n"
+      "   -n frames           frames per device (0: until interrupted, default)\n"
+      "   -t sec              report interval (1 is default)\n"
+      "   -r                  use write() instead of mmap()\n"
+      "   -h                  print this help\n";
+
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int)
+{
+    stop = 1;
+}
+
+
+static inline long long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/* 3x5 font: digits, '.', ' ' */
+
+static const unsigned char font[12][5] =
+{
+    { 7,5,5,5,7 }, { 2,6,2,2,7 }, { 7,1,7,4,7 }, { 7,1,7,1,7 }, { 5,5,7,1,1 }, { 7,4,7,1,7 },
+    { 7,4,7,5,7 }, { 7,1,1,1,1 }, { 7,5,7,5,7 }, { 7,5,7,1,7 }, { 0,0,0,0,2 }, { 0,0,0,0,0 }
+};
+
+
+struct pattern
+{
+    std::vector<unsigned char> buf;
+    vscull::image img;              // packed, 2 x width for the gradient (it scrolls)
+    int step;                       // pixels per horizontal move (chroma subsampling)
+};
+
+
+struct source
+{
+    int minor;
+    std::unique_ptr<vscull::Producer> prod;
+    pattern pat;
+
+    long long frames;
+    std::atomic<unsigned long long> done;
+    std::atomic<unsigned long long> err_sum;    // ns
+    std::atomic<unsigned long long> err_max;    // ns
+    std::atomic<unsigned long long> late;
+    std::atomic<bool> finished;
+
+    source()
+    : minor(0), prod(), pat(), frames(0), done(0), err_sum(0), err_max(0), late(0), finished(false)
+    {}
+};
+
+
+static void
+hsv(double h, double v, unsigned char *bgrx)
+{
+    double r = std::fabs(h * 6 - 3) - 1, g = 2 - std::fabs(h * 6 - 2), b = 2 - std::fabs(h * 6 - 4);
+    bgrx[0] = 255 * v * std::min(std::max(b, 0.0), 1.0);
+    bgrx[1] = 255 * v * std::min(std::max(g, 0.0), 1.0);
+    bgrx[2] = 255 * v * std::min(std::max(r, 0.0), 1.0);
+    bgrx[3] = 0xff;
+}
+
+
+static void
+make_pattern(pattern &pat, int palette, int w, int h, bool gradient)
+{
+    static const unsigned char bars[8][3] =   /* 75% bars, B,G,R */
+    {
+        { 191,191,191 }, { 0,191,191 }, { 191,191,0 }, { 0,191,0 }, { 191,0,191 }, { 0,0,191 }, { 191,0,0 }, { 0,0,0 }
+    };
+
+    int pw = gradient ? 2 * w : w;
+    std::vector<unsigned char> rgb(pw * h * 4);
+
+    for(int y = 0; y < h; y++)
+        for(int x = 0; x < pw; x++) {
+            unsigned char *p = &rgb[4 * (y * pw + x)];
+            if (gradient)
+                hsv((double)(x % w) / w, 0.25 + 0.75 * y / h, p);
+            else {
+                const unsigned char *b = bars[x * 8 / w];
+                p[0] = b[0]; p[1] = b[1]; p[2] = b[2]; p[3] = 0xff;
+            }
+        }
+
+    pat.buf.resize(vscull::image::size(palette, pw, h));
+    pat.img = vscull::image(palette, pw, h, &pat.buf[0]);
+
+    vscull::Converter conv(VIDEO_PALETTE_RGB32, palette, pw, h);
+    conv(vscull::image(VIDEO_PALETTE_RGB32, pw, h, &rgb[0]), pat.img);
+
+    const struct vscull_format *f = PALETTE_FORMAT(palette);
+    pat.step = f->nplanes > 1 ? 1 << f->hsub : (palette == VIDEO_PALETTE_YUYV || palette == VIDEO_PALETTE_UYVY || palette == VIDEO_PALETTE_YUV422 ? 2 : 1);
+}
+
+
+/* a pixel of the overlay: white or black, neutral chroma */
+static void
+put_pixel(const vscull::image &img, int x, int y, bool on)
+{
+    const struct vscull_format *f = PALETTE_FORMAT(img.palette);
+    unsigned char *row = img.plane[0] + y * img.stride[0];
+    unsigned char luma = on ? 235 : 16;
+
+    switch(img.palette) {
+    case VIDEO_PALETTE_RGB24:
+        memset(row + 3 * x, on ? 0xff : 0, 3);
+        break;
+    case VIDEO_PALETTE_RGB32:
+        memset(row + 4 * x, on ? 0xff : 0, 4);
+        break;
+    case VIDEO_PALETTE_RGB565:
+        row[2*x] = on ? 0xff : 0; row[2*x+1] = on ? 0xff : 0;
+        break;
+    case VIDEO_PALETTE_RGB555:
+        row[2*x] = on ? 0xff : 0; row[2*x+1] = on ? 0x7f : 0;
+        break;
+    case VIDEO_PALETTE_YUV422:
+    case VIDEO_PALETTE_YUYV:
+        row[2*x] = luma;
+        row[4*(x/2)+1] = row[4*(x/2)+3] = 128;
+        break;
+    case VIDEO_PALETTE_UYVY:
+        row[2*x+1] = luma;
+        row[4*(x/2)] = row[4*(x/2)+2] = 128;
+        break;
+    default:
+        row[x] = luma;
+        if (f->nplanes > 1) {
+            img.plane[1][(y >> f->vsub) * img.stride[1] + (x >> f->hsub)] = 128;
+            img.plane[2][(y >> f->vsub) * img.stride[2] + (x >> f->hsub)] = 128;
+        }
+    }
+}
+
+
+static void
+draw_text(const vscull::image &img, const char *s)
+{
+    int scale = std::max(1, img.height / 120);
+    int len = strlen(s);
+    int bw = (len * 4 + 1) * scale, bh = 7 * scale;
+
+    for(int y = 0; y < std::min(bh, img.height); y++)
+        for(int x = 0; x < std::min(bw, img.width); x++) {
+            int cx = x / scale - 1, cy = y / scale - 1;
+            int c = cx / 4, col = cx % 4;
+            bool on = false;
+            if (cx >= 0 && cy >= 0 && cy < 5 && c < len && col < 3) {
+                int g = s[c] == '.' ? 10 : (s[c] >= '0' && s[c] <= '9' ? s[c] - '0' : 11);
+                on = font[g][cy] & (4 >> col);
+            }
+            put_pixel(img, x, y, on);
+        }
+}
+
+
+static void
+render(source &src, vscull::Producer::Frame &frame, long long k, int speed, long long ts)
+{
+    vscull::Producer &prod = *src.prod;
+    const vscull::Dev &dev = prod.dev();
+    const struct vscull_format *f = PALETTE_FORMAT(dev.palette());
+    const vscull::image &pat = src.pat.img;
+
+    vscull::image img;
+    img.palette = dev.palette();
+    img.width   = dev.width();
+    img.height  = dev.height();
+
+    int off = pat.width > img.width ? (int)((k * speed) % img.width) / src.pat.step * src.pat.step : 0;
+
+    for(int n = 0; n < prod.nplanes(); n++) {
+        img.plane[n]  = frame.plane(n).data();
+        img.stride[n] = prod.stride(n);
+
+        int rows, len, boff;
+        if (f->nplanes > 1) {
+            rows = n == 0 ? img.height : (img.height + (1 << f->vsub) - 1) >> f->vsub;
+            len  = n == 0 ? img.width  : (img.width  + (1 << f->hsub) - 1) >> f->hsub;
+            boff = n == 0 ? off : off >> f->hsub;
+        }
+        else {
+            rows = img.height;
+            len  = (img.width * f->bpp + 7) / 8;
+            boff = off * f->bpp / 8;
+        }
+
+        for(int r = 0; r < rows; r++)
+            memcpy(img.plane[n] + r * img.stride[n], pat.plane[n] + r * pat.stride[n] + boff, len);
+    }
+
+    char text[64];
+    snprintf(text, sizeof(text), "%08lld %.3f", k, ts / 1e9);
+    draw_text(img, text);
+}
+
+
+static void
+feed(source &src, int fps, int speed)
+{
+    long long period = fps > 0 ? 1000000000LL / fps : 0;
+    long long start = now_ns();
+    long long k = 0, slot = 0;
+
+    while (!stop && (src.frames == 0 || k < src.frames)) {
+
+        long long deadline = start + slot * period;
+
+        if (period) {
+            struct timespec ts = { (time_t)(deadline / 1000000000LL), (long)(deadline % 1000000000LL) };
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+            { }
+        }
+
+        {
+            vscull::Producer::Frame frame = src.prod->acquire();
+            render(src, frame, k, speed, period ? deadline : now_ns());
+            if (!frame.commit())
+                break;
+        }
+
+        k++, slot++;
+        src.done++;
+
+        if (period) {
+            long long err = now_ns() - deadline;
+            src.err_sum += err;
+            if ((unsigned long long)err > src.err_max)
+                src.err_max = err;
+
+            /* more than a period late: skip the lost slots */
+            if (err > period) {
+                src.late++;
+                slot = (now_ns() - start) / period + 1;
+            }
+        }
+    }
+
+    src.finished = true;
+}
+
+
+static std::vector<int>
+parse_minors(const char *s)
+{
+    std::vector<int> ret;
+    while (*s) {
+        char *end;
+        int a = strtol(s, &end, 10), b = a;
+        if (*end == '-')
+            b = strtol(end + 1, &end, 10);
+        for(int m = a; m <= b; m++)
+            ret.push_back(m);
+        s = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            break;
+    }
+    return ret;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+    std::vector<int> minors(1, 0);
+    int w = -1, h = -1, p = -1, fps = -1;
+    bool gradient = false;
+    int speed = 4;
+    long long frames = 0;
+    int interval = 1;
+    vscull::access a = vscull::access::automatic;
+
+    while(( i = getopt(argc, argv, "m:W:H:p:f:P:s:n:t:rh")) != EOF)
+        switch(i) {
+        case 'm': minors = parse_minors(optarg);
+                  break;
+        case 'W': w = atoi(optarg);
+                  break;
+        case 'H': h = atoi(optarg);
+                  break;
+        case 'p': p = atoi(optarg);
+                  break;
+        case 'f': fps = atoi(optarg);
+                  break;
+        case 'P': gradient = strcmp(optarg, "gradient") == 0;
+                  if (!gradient && strcmp(optarg, "bars") != 0) {
+                      fprintf(stderr,"unknown pattern!\n"); exit(1);
+                  }
+                  break;
+        case 's': speed = atoi(optarg);
+                  break;
+        case 'n': frames = atoll(optarg);
+                  break;
+        case 't': interval = std::max(1, atoi(optarg));
+                  break;
+        case 'r': a = vscull::access::rw;
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    std::vector<std::unique_ptr<source> > srcs;
+    std::vector<int> rate;
+
+    try {
+        for(size_t n = 0; n < minors.size(); n++) {
+
+            /* geometry first: it can't change while the frame is mapped */
+            {
+                vscull::Dev dev(minors[n]);
+                if (w > 0) dev.width(w);
+                if (h > 0) dev.height(h);
+                if (p > 0) {
+                    dev.palette(p);
+                    dev.depth(PALETTE_FORMAT(p)->bpp);
+                }
+                if (fps > -1) dev.fps(fps);
+                dev.commit();
+            }
+
+            std::unique_ptr<source> s(new source);
+            s->minor  = minors[n];
+            s->frames = frames;
+            s->prod.reset(new vscull::Producer(minors[n], a));
+
+            const vscull::Dev &dev = s->prod->dev();
+            make_pattern(s->pat, dev.palette(), dev.width(), dev.height(), gradient);
+            rate.push_back(dev.fps());
+
+            std::cout << dev.name() << ": " << dev.width() << "x" << dev.height() << " " << PALETTE((unsigned int)dev.palette())
+                      << " @ " << dev.fps() << " fps (" << (s->prod->mapped() ? "mmap" : "write") << ")" << std::endl;
+
+            srcs.push_back(std::move(s));
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::thread> thr;
+    for(size_t n = 0; n < srcs.size(); n++)
+        thr.push_back(std::thread(feed, std::ref(*srcs[n]), rate[n], speed));
+
+    std::vector<unsigned long long> last(srcs.size(), 0);
+    long long t0 = now_ns();
+    size_t running = srcs.size();
+
+    while (running) {
+        struct timespec ts = { interval, 0 };
+        nanosleep(&ts, NULL);
+
+        long long t1 = now_ns();
+        running = 0;
+
+        for(size_t n = 0; n < srcs.size(); n++) {
+            source &s = *srcs[n];
+            unsigned long long done = s.done;
+            unsigned long long cnt  = done - last[n];
+            unsigned long long sum  = s.err_sum.exchange(0);
+            unsigned long long max  = s.err_max.exchange(0);
+
+            printf("%s: %8.1f fps (target %d)  pacing avg %7.1f us max %7.1f us  late %llu\n",
+                   s.prod->dev().name().c_str(), cnt * 1e9 / (t1 - t0), rate[n], cnt ? sum / 1e3 / cnt : 0.0, max / 1e3, (unsigned long long)s.late);
+
+            last[n] = done;
+            if (!s.finished)
+                running++;
+        }
+        fflush(stdout);
+        t0 = t1;
+    }
+
+    for(size_t n = 0; n < thr.size(); n++)
+        thr[n].join();
+
+    return 0;
+}
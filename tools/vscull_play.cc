@@ -0,0 +1,514 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/* vscull_play: raw/Y4M/vscull_record file player.
+
+   Each file is memory-mapped and played on a device configured from the file header (Y4M,
+   vscull_record) or from the command line (raw). A read-ahead thread per file keeps the next frames
+   resident (madvise(MADV_WILLNEED) and a touch per page), so the player thread copies
+   from memory and never waits on the disk. Frames that can't be played in time are
+   dropped to keep the pace; dropped and late frames are reported per device. */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+#include <vscull_stream.h>
+#include <vscull_conv.h>
+#include <vscull_rec.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+extern char *__progname;
+
+const char usage[]=
+      "%s [options] file...           raw, Y4M or vscull_record files\n"
+      "   -m minors           vscull video devices, one per file, e.g. 0,2-5 (0,1,2... is default)\n"
+      "   -W width            raw files: frame geometry (device setting is default)\n"
+      "   -H height           \n"
+      "   -p palette          raw files: [1-16] see include/linux/videodev.h\n"
+      "   -f fps              raw files: frame per second\n"
+      "   -x rate             rate multiplier (1.0 is default)\n"
+      "   -s frame            start from frame\n"
+      "   -n frames           frames to play (0: the whole file, default)\n"
+      "   -l                  loop\n"
+      "   -a frames           read-ahead window (16 is default)\n"
+      "   -t sec              report interval (1 is default)\n"
+      "   -r                  use write() instead of mmap()\n"
+      "   -h                  print this help\n";
+
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int)
+{
+    stop = 1;
+}
+
+
+static inline long long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+struct stream
+{
+    std::string path;
+    int minor;
+
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+
+    int width, height, palette;
+    double fps;
+    size_t frame_size;
+    std::vector<size_t> index;          // frame offsets
+
+    std::unique_ptr<vscull::Producer>  prod;
+    std::unique_ptr<vscull::Converter> copy;
+
+    std::atomic<long long> pos;         // next frame (absolute, loops included)
+    std::atomic<unsigned long long> played;
+    std::atomic<unsigned long long> dropped;
+    std::atomic<unsigned long long> late;
+    std::atomic<unsigned long long> err_max;    // ns
+    std::atomic<bool> finished;
+
+    stream()
+    : path(), minor(0), fd(-1), map(0), map_size(0), width(0), height(0), palette(0), fps(0), frame_size(0),
+      index(), prod(), copy(), pos(0), played(0), dropped(0), late(0), err_max(0), finished(false)
+    {}
+
+    ~stream()
+    {
+        if (map)
+            munmap(map, map_size);
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+
+/* Y4M colour spaces vscull has a palette for */
+static int
+y4m_palette(const char *c)
+{
+    if (strncmp(c, "420", 3) == 0) return VIDEO_PALETTE_YUV420P;    /* 420jpeg, 420paldv, 420mpeg2 */
+    if (strncmp(c, "422", 3) == 0) return VIDEO_PALETTE_YUV422P;
+    if (strncmp(c, "411", 3) == 0) return VIDEO_PALETTE_YUV411P;
+    if (strncmp(c, "mono", 4) == 0) return VIDEO_PALETTE_GREY;
+    return -1;
+}
+
+
+static bool
+parse_y4m(stream &s)
+{
+    const char *p = (const char *)s.map, *end = p + s.map_size;
+    const char *eol = (const char *)memchr(p, '\n', s.map_size);
+    if (eol == NULL)
+        return false;
+
+    s.palette = VIDEO_PALETTE_YUV420P;
+    s.fps = 25;
+
+    for(const char *t = p + 9; t < eol; t++) {
+        if (*t != ' ')
+            continue;
+        switch(t[1]) {
+        case 'W': s.width = atoi(t + 2); break;
+        case 'H': s.height = atoi(t + 2); break;
+        case 'F': {
+                int num = 0, den = 1;
+                if (sscanf(t + 2, "%d:%d", &num, &den) == 2 && num > 0 && den > 0)
+                    s.fps = (double)num / den;
+            } break;
+        case 'C': s.palette = y4m_palette(t + 2); break;
+        }
+    }
+
+    if (s.palette < 0) {
+        std::cerr << s.path << ": Y4M colour space not supported" << std::endl;
+        return false;
+    }
+
+    s.frame_size = vscull::image::size(s.palette, s.width, s.height);
+    if (s.frame_size == 0)
+        return false;
+
+    /* frames: "FRAME[ params]\n" + data */
+    for(p = eol + 1; p + 6 <= end && memcmp(p, "FRAME", 5) == 0; ) {
+        const char *nl = (const char *)memchr(p, '\n', end - p);
+        if (nl == NULL || (size_t)(end - nl - 1) < s.frame_size)
+            break;
+        s.index.push_back(nl + 1 - (const char *)s.map);
+        p = nl + 1 + s.frame_size;
+    }
+    return true;
+}
+
+
+static bool
+parse_rec(stream &s)
+{
+    const struct vscull_rec_header *h = (const struct vscull_rec_header *)s.map;
+
+    if (s.map_size < sizeof(*h) || !vscull_rec_valid(h, s.map_size)) {
+        std::cerr << s.path << ": bad recording" << std::endl;
+        return false;
+    }
+
+    s.width   = h->width;
+    s.height  = h->height;
+    s.palette = h->palette;
+    s.fps     = h->fps;
+
+    s.frame_size = vscull::image::size(s.palette, s.width, s.height);
+    if (s.frame_size == 0 || s.frame_size != h->frame_size)
+        return false;
+
+    const struct vscull_rec_index *idx = (const struct vscull_rec_index *)(s.map + h->index_offset);
+    for(uint64_t n = 0; n < h->count; n++) {
+        if (idx[n].offset + s.frame_size > s.map_size)
+            break;
+        s.index.push_back(idx[n].offset);
+    }
+    return true;
+}
+
+
+static bool
+open_stream(stream &s, int w, int h, int p, double fps)
+{
+    struct stat st;
+
+    s.fd = open(s.path.c_str(), O_RDONLY);
+    if (s.fd < 0 || fstat(s.fd, &st) < 0 || st.st_size == 0) {
+        std::cerr << s.path << ": couldn't open" << std::endl;
+        return false;
+    }
+
+    s.map_size = st.st_size;
+    void *m = mmap(0, s.map_size, PROT_READ, MAP_SHARED, s.fd, 0);
+    if (m == MAP_FAILED) {
+        std::cerr << s.path << ": couldn't map" << std::endl;
+        return false;
+    }
+    s.map = (unsigned char *)m;
+    madvise(s.map, s.map_size, MADV_SEQUENTIAL);
+
+    if (s.map_size > 10 && memcmp(s.map, "YUV4MPEG2 ", 10) == 0)
+        return parse_y4m(s);
+    if (s.map_size > 8 && memcmp(s.map, VSCULL_REC_MAGIC, 8) == 0)
+        return parse_rec(s);
+
+    /* raw: the geometry comes from the command line, or from the device */
+    {
+        vscull::Dev dev(s.minor);
+        s.width   = w > 0 ? w : dev.width();
+        s.height  = h > 0 ? h : dev.height();
+        s.palette = p > 0 ? p : dev.palette();
+        s.fps     = fps > 0 ? fps : dev.fps();
+    }
+
+    s.frame_size = vscull::image::size(s.palette, s.width, s.height);
+    if (s.frame_size == 0) {
+        std::cerr << s.path << ": palette " << PALETTE((unsigned int)s.palette) << " not supported" << std::endl;
+        return false;
+    }
+
+    for(size_t off = 0; off + s.frame_size <= s.map_size; off += s.frame_size)
+        s.index.push_back(off);
+    return true;
+}
+
+
+/* keep the frames [pos, pos + ahead) resident */
+static void
+read_ahead(stream &s, long ahead, bool loop)
+{
+    long pagesz = sysconf(_SC_PAGESIZE);
+    long long n = s.index.size();
+    long long done = -1;
+    long long nap = s.fps > 0 ? (long long)(5e8 / s.fps) : 1000000;
+    volatile unsigned char sink = 0;
+
+    while (!s.finished && !stop) {
+        long long pos = s.pos;
+        long long k;
+
+        for(k = std::max(done + 1, pos); k < pos + ahead; k++) {
+            if (!loop && k >= n)
+                break;
+
+            size_t off = s.index[k % n];
+            size_t start = off & ~(pagesz - 1);
+            size_t len = off + s.frame_size - start;
+
+            madvise(s.map + start, len, MADV_WILLNEED);
+            for(size_t b = 0; b < len; b += pagesz)
+                sink += s.map[start + b];
+        }
+        done = k - 1;
+
+        struct timespec ts = { (time_t)(nap / 1000000000LL), (long)(nap % 1000000000LL) };
+        nanosleep(&ts, NULL);
+    }
+    (void)sink;
+}
+
+
+static void
+play(stream &s, double rate, long long first, long long count, bool loop)
+{
+    long long n = s.index.size();
+    long long period = (long long)(1e9 / (s.fps * rate));
+    long long start = now_ns();
+    long long k = 0;                    // slot
+
+    s.pos = first;
+
+    while (!stop) {
+        long long abs = s.pos;
+        if ((!loop && abs >= n) || (count && (long long)(s.played + s.dropped) >= count))
+            break;
+
+        long long deadline = start + k * period;
+        struct timespec ts = { (time_t)(deadline / 1000000000LL), (long)(deadline % 1000000000LL) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !stop)
+        { }
+
+        {
+            vscull::Producer::Frame frame = s.prod->acquire();
+            vscull::Producer &prod = *s.prod;
+
+            vscull::image dst;
+            dst.palette = s.palette;
+            dst.width   = s.width;
+            dst.height  = s.height;
+            for(int p = 0; p < prod.nplanes(); p++) {
+                dst.plane[p]  = frame.plane(p).data();
+                dst.stride[p] = prod.stride(p);
+            }
+
+            (*s.copy)(vscull::image(s.palette, s.width, s.height, s.map + s.index[abs % n]), dst);
+            if (!frame.commit())
+                break;
+        }
+
+        long long t = now_ns();
+        long long err = t - deadline;
+
+        s.played++;
+        if (err > period / 4)
+            s.late++;
+        if ((unsigned long long)err > s.err_max)
+            s.err_max = err;
+
+        /* behind: drop the frames whose slot is gone */
+        long long next = k + 1;
+        long long slot = (t - start) / period;
+        long long skip = slot > next ? slot - next : 0;
+
+        k = next + skip;
+        s.dropped += skip;
+        s.pos = abs + 1 + skip;
+    }
+
+    s.finished = true;
+}
+
+
+static std::vector<int>
+parse_minors(const char *s)
+{
+    std::vector<int> ret;
+    while (*s) {
+        char *end;
+        int a = strtol(s, &end, 10), b = a;
+        if (*end == '-')
+            b = strtol(end + 1, &end, 10);
+        for(int m = a; m <= b; m++)
+            ret.push_back(m);
+        s = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            break;
+    }
+    return ret;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+    std::vector<int> minors;
+    int w = -1, h = -1, p = -1;
+    double fps = -1, rate = 1.0;
+    long long first = 0, count = 0;
+    bool loop = false;
+    long ahead = 16;
+    int interval = 1;
+    vscull::access a = vscull::access::automatic;
+
+    while(( i = getopt(argc, argv, "m:W:H:p:f:x:s:n:la:t:rh")) != EOF)
+        switch(i) {
+        case 'm': minors = parse_minors(optarg);
+                  break;
+        case 'W': w = atoi(optarg);
+                  break;
+        case 'H': h = atoi(optarg);
+                  break;
+        case 'p': p = atoi(optarg);
+                  break;
+        case 'f': fps = atof(optarg);
+                  break;
+        case 'x': rate = atof(optarg);
+                  break;
+        case 's': first = atoll(optarg);
+                  break;
+        case 'n': count = atoll(optarg);
+                  break;
+        case 'l': loop = true;
+                  break;
+        case 'a': ahead = std::max(1L, atol(optarg));
+                  break;
+        case 't': interval = std::max(1, atoi(optarg));
+                  break;
+        case 'r': a = vscull::access::rw;
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    if (optind == argc || rate <= 0) {
+        fprintf(stderr,usage,__progname);
+        exit(1);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    std::vector<std::unique_ptr<stream> > ss;
+
+    try {
+        for(int n = 0; optind + n < argc; n++) {
+            std::unique_ptr<stream> s(new stream);
+            s->path  = argv[optind + n];
+            s->minor = n < (int)minors.size() ? minors[n] : n;
+
+            if (!open_stream(*s, w, h, p, fps))
+                return 1;
+            if (s->index.empty() || first >= (long long)s->index.size() || s->fps <= 0) {
+                std::cerr << s->path << ": nothing to play" << std::endl;
+                return 1;
+            }
+
+            /* the device takes the geometry of the file: set it before it's mapped */
+            {
+                vscull::Dev dev(s->minor);
+                dev.width(s->width);
+                dev.height(s->height);
+                dev.palette(s->palette);
+                dev.depth(PALETTE_FORMAT(s->palette)->bpp);
+                dev.fps((int)lround(s->fps * rate));
+                if (!dev.commit())
+                    std::cerr << dev.name() << ": couldn't set the geometry of " << s->path << std::endl;
+            }
+
+            s->prod.reset(new vscull::Producer(s->minor, a));
+
+            /* the frames are copied with the geometry of the file: the device must have it */
+            const vscull::Dev &dev = s->prod->dev();
+            if (dev.width() != s->width || dev.height() != s->height || dev.palette() != s->palette) {
+                std::cerr << dev.name() << ": " << dev.width() << "x" << dev.height() << " " << PALETTE((unsigned int)dev.palette())
+                          << ", " << s->path << " needs " << s->width << "x" << s->height << " " << PALETTE((unsigned int)s->palette) << std::endl;
+                return 1;
+            }
+            s->copy.reset(new vscull::Converter(s->palette, s->palette, s->width, s->height));
+
+            std::cout << s->path << " -> " << s->prod->dev().name() << ": " << s->index.size() << " frames "
+                      << s->width << "x" << s->height << " " << PALETTE((unsigned int)s->palette) << " @ " << s->fps * rate << " fps" << std::endl;
+
+            ss.push_back(std::move(s));
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::thread> thr;
+    for(size_t n = 0; n < ss.size(); n++) {
+        thr.push_back(std::thread(read_ahead, std::ref(*ss[n]), ahead, loop));
+        thr.push_back(std::thread(play, std::ref(*ss[n]), rate, first, count, loop));
+    }
+
+    std::vector<unsigned long long> last(ss.size(), 0);
+    long long t0 = now_ns();
+    size_t running = ss.size();
+
+    while (running) {
+        struct timespec ts = { interval, 0 };
+        nanosleep(&ts, NULL);
+
+        long long t1 = now_ns();
+        running = 0;
+
+        for(size_t n = 0; n < ss.size(); n++) {
+            stream &s = *ss[n];
+            unsigned long long played = s.played;
+
+            printf("%s: frame %lld  %7.1f fps  dropped %llu  late %llu  max error %.1f ms\n",
+                   s.prod->dev().name().c_str(), (long long)s.pos, (played - last[n]) * 1e9 / (t1 - t0),
+                   (unsigned long long)s.dropped, (unsigned long long)s.late, s.err_max.exchange(0) / 1e6);
+
+            last[n] = played;
+            if (!s.finished)
+                running++;
+        }
+        fflush(stdout);
+        t0 = t1;
+    }
+
+    for(size_t n = 0; n < thr.size(); n++)
+        thr[n].join();
+
+    return 0;
+}
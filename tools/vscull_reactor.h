@@ -0,0 +1,297 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+//  Reactor: many vscull devices served by one waiter and a small worker pool.
+//
+//  The waiter blocks in epoll_wait() on all the registered consumers (the driver reports
+//  POLLIN when a frame not yet seen by the reader is published) and hands the ready ones
+//  to the pool. Devices are armed one-shot: a device is processed by one worker at a time
+//  and re-armed when its callback returns, so callbacks never race on the same consumer.
+//
+//  Each worker owns a queue; a device is queued to its home worker for cache locality and
+//  idle workers steal from the others, so the processing scales with the cores rather than
+//  with the number of devices.
+//
+//  Usage:
+//
+//      vscull::Reactor r;
+//      for(int n = 0; n < 32; n++)
+//          r.add(vscull::Consumer(n), [](vscull::Consumer &c) {
+//              vscull::Consumer::Frame f = c.acquire();    // doesn't block
+//              process(f.plane(0));
+//          });
+//      r.run();
+//
+
+#ifndef _VSCULL_REACTOR_H_
+#define _VSCULL_REACTOR_H_
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <vscull_stream.h>
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <stdexcept>
+
+namespace vscull {
+
+    class Reactor
+    {
+    public:
+        typedef std::function<void(Consumer &)> callback;
+
+    private:
+        struct entry
+        {
+            Consumer    cons;
+            callback    cb;
+            unsigned    home;       // preferred worker
+
+            entry(Consumer &&c, callback &&f, unsigned h)
+            : cons(std::move(c)), cb(std::move(f)), home(h)
+            {}
+        };
+
+        struct queue
+        {
+            std::mutex          lock;
+            std::deque<entry *> ready;
+        };
+
+        int _M_epfd;
+        int _M_evfd;                                        // wakes up the waiter on stop()
+
+        std::mutex                           _M_lock;       // _M_entries
+        std::vector<std::unique_ptr<entry> > _M_entries;
+
+        std::vector<std::unique_ptr<queue> > _M_queues;
+        std::vector<std::thread>             _M_workers;
+
+        std::mutex              _M_idle_lock;
+        std::condition_variable _M_idle;
+        std::size_t             _M_pending;
+        bool                    _M_stop;
+        std::atomic<bool>       _M_running;
+
+    public:
+        explicit Reactor(unsigned workers = std::thread::hardware_concurrency())
+        : _M_epfd(-1),
+        _M_evfd(-1),
+        _M_lock(),
+        _M_entries(),
+        _M_queues(),
+        _M_workers(),
+        _M_idle_lock(),
+        _M_idle(),
+        _M_pending(0),
+        _M_stop(false),
+        _M_running(false)
+        {
+            if (workers == 0)
+                workers = 1;
+
+            _M_epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (_M_epfd < 0)
+                throw std::runtime_error("epoll_create1: couldn't create the reactor");
+
+            _M_evfd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+            if (_M_evfd < 0) {
+                close(_M_epfd);
+                throw std::runtime_error("eventfd: couldn't create the reactor");
+            }
+
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = 0;
+            epoll_ctl(_M_epfd, EPOLL_CTL_ADD, _M_evfd, &ev);
+
+            for(unsigned n = 0; n < workers; n++)
+                _M_queues.push_back(std::unique_ptr<queue>(new queue));
+            for(unsigned n = 0; n < workers; n++)
+                _M_workers.push_back(std::thread(&Reactor::worker, this, n));
+        }
+
+        ~Reactor()
+        {
+            stop();
+            {
+                std::lock_guard<std::mutex> l(_M_idle_lock);
+                _M_stop = true;
+            }
+            _M_idle.notify_all();
+
+            for(std::size_t n = 0; n < _M_workers.size(); n++)
+                _M_workers[n].join();
+
+            close(_M_evfd);
+            close(_M_epfd);
+        }
+
+        /* register a consumer: cb is called on a worker each time a frame is ready */
+        Consumer & add(Consumer &&c, callback cb)
+        {
+            if (c.dev().emulated())
+                throw std::runtime_error(std::string("vscull: the shm backend can't be polled: ").append(c.dev().name()));
+
+            std::lock_guard<std::mutex> l(_M_lock);
+
+            entry *e = new entry(std::move(c), std::move(cb), _M_entries.size() % _M_queues.size());
+            _M_entries.push_back(std::unique_ptr<entry>(e));
+
+            if (!arm(e, EPOLL_CTL_ADD)) {
+                std::string name = e->cons.dev().name();
+                _M_entries.pop_back();
+                throw std::runtime_error(std::string("epoll_ctl: couldn't register ").append(name));
+            }
+            return e->cons;
+        }
+
+        /* wait for frames and dispatch them until stop() */
+        void run()
+        {
+            struct epoll_event ev[64];
+
+            _M_running = true;
+
+            while (_M_running) {
+                int n = epoll_wait(_M_epfd, ev, 64, -1);
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    std::clog << "epoll_wait: error" << std::endl;
+                    break;
+                }
+
+                for(int i = 0; i < n; i++) {
+                    entry *e = static_cast<entry *>(ev[i].data.ptr);
+                    if (e == 0) {
+                        uint64_t v;
+                        if (read(_M_evfd, &v, sizeof(v)) < 0)
+                        { }
+                        continue;
+                    }
+                    dispatch(e);
+                }
+            }
+
+            _M_running = false;
+        }
+
+        /* make run() return (callable from any thread, callbacks included) */
+        void stop()
+        {
+            uint64_t v = 1;
+            _M_running = false;
+            if (write(_M_evfd, &v, sizeof(v)) < 0)
+            { }
+        }
+
+        std::size_t workers() const
+        { return _M_workers.size(); }
+
+    private:
+        bool arm(entry *e, int op)
+        {
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.ptr = e;
+            return epoll_ctl(_M_epfd, op, e->cons.dev().fd(), &ev) == 0;
+        }
+
+        void dispatch(entry *e)
+        {
+            queue &q = *_M_queues[e->home];
+            {
+                std::lock_guard<std::mutex> l(q.lock);
+                q.ready.push_back(e);
+            }
+            {
+                std::lock_guard<std::mutex> l(_M_idle_lock);
+                _M_pending++;
+            }
+            _M_idle.notify_one();
+        }
+
+        /* own queue first (oldest frame), then steal from the others (newest frame) */
+        entry * pop(unsigned self)
+        {
+            std::size_t nq = _M_queues.size();
+
+            for(std::size_t k = 0; k < nq; k++) {
+                queue &q = *_M_queues[(self + k) % nq];
+                std::lock_guard<std::mutex> l(q.lock);
+                if (q.ready.empty())
+                    continue;
+
+                entry *e;
+                if (k == 0) {
+                    e = q.ready.front();
+                    q.ready.pop_front();
+                }
+                else {
+                    e = q.ready.back();
+                    q.ready.pop_back();
+                }
+                return e;
+            }
+            return 0;
+        }
+
+        void worker(unsigned self)
+        {
+            for(;;) {
+                {
+                    std::unique_lock<std::mutex> l(_M_idle_lock);
+                    _M_idle.wait(l, [this] { return _M_stop || _M_pending > 0; });
+                    if (_M_pending == 0)
+                        return;     /* stopping */
+                    _M_pending--;
+                }
+
+                entry *e = pop(self);     /* queued before being counted */
+                if (e == 0)
+                    continue;
+
+                try {
+                    e->cb(e->cons);
+                }
+                catch(std::exception &ex) {
+                    std::clog << e->cons.dev().name() << ": " << ex.what() << std::endl;
+                }
+
+                if (!arm(e, EPOLL_CTL_MOD))
+                    std::clog << "epoll_ctl: couldn't re-arm " << e->cons.dev().name() << std::endl;
+            }
+        }
+
+        Reactor(const Reactor &) = delete;
+        Reactor & operator=(const Reactor &) = delete;
+    };
+}
+
+#endif /* _VSCULL_REACTOR_H_ */
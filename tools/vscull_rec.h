@@ -0,0 +1,91 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+//  vscull recording container (vscull_record, vscull_play):
+//
+//      header   VSCULL_REC_ALIGN bytes
+//      data     capacity slots of slot_size bytes: frame n at data_offset + n * slot_size
+//      index    capacity entries: sequence, timestamp and offset of frame n
+//
+//  Frames are packed (as accepted by read()/write()), slots and regions are aligned for
+//  O_DIRECT. Seeking to a frame is O(1); seeking to a time is a binary search on the index.
+//  count is updated with the index, so a recording cut short is readable up to the last
+//  index update.
+
+#ifndef _VSCULL_REC_H_
+#define _VSCULL_REC_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define VSCULL_REC_MAGIC    "VSCULLR1"
+#define VSCULL_REC_ALIGN    4096
+
+struct vscull_rec_header
+{
+    char     magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t palette;
+    uint32_t fps;
+    uint32_t frame_size;    /* bytes of a frame */
+    uint32_t slot_size;     /* bytes of a slot (frame_size aligned) */
+    uint64_t capacity;      /* slots */
+    uint64_t count;         /* frames recorded */
+    uint64_t data_offset;
+    uint64_t index_offset;
+};
+
+struct vscull_rec_index
+{
+    uint64_t seq;           /* device frame sequence (gaps: frames missed by the reader or dropped by the recorder) */
+    int64_t  ts;            /* publication time, CLOCK_MONOTONIC, nsec */
+    uint64_t offset;
+};
+
+static inline uint64_t
+vscull_rec_align(uint64_t n)
+{
+    return (n + VSCULL_REC_ALIGN - 1) & ~(uint64_t)(VSCULL_REC_ALIGN - 1);
+}
+
+static inline void
+vscull_rec_init(struct vscull_rec_header *h, int width, int height, int palette, int fps, uint32_t frame_size, uint64_t capacity)
+{
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, VSCULL_REC_MAGIC, 8);
+    h->width        = width;
+    h->height       = height;
+    h->palette      = palette;
+    h->fps          = fps;
+    h->frame_size   = frame_size;
+    h->slot_size    = vscull_rec_align(frame_size);
+    h->capacity     = capacity;
+    h->data_offset  = VSCULL_REC_ALIGN;
+    h->index_offset = h->data_offset + capacity * h->slot_size;
+}
+
+static inline int
+vscull_rec_valid(const struct vscull_rec_header *h, uint64_t file_size)
+{
+    return memcmp(h->magic, VSCULL_REC_MAGIC, 8) == 0 &&
+           h->count <= h->capacity && h->frame_size <= h->slot_size &&
+           h->index_offset + h->capacity * sizeof(struct vscull_rec_index) <= file_size;
+}
+
+#endif /* _VSCULL_REC_H_ */
@@ -0,0 +1,341 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/* vscull_record: capture a device to an indexed container (see vscull_rec.h).
+
+   The capture thread waits for frames with mmap+VIDIOCSYNC and copies them into a bounded
+   ring of aligned buffers; a writer thread stores them with O_DIRECT into the preallocated
+   file, so the recording doesn't go through the page cache. When the disk stalls and the
+   ring is full, frames are dropped (the index keeps the sequence gaps): the device is never
+   held back. */
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+#include <vscull_stream.h>
+#include <vscull_conv.h>
+#include <vscull_rec.h>
+
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+extern char *__progname;
+
+const char usage[]=
+      "%s [options] file\n"
+      "   -m minor            vscull video device (/dev/video0 is default)\n"
+      "   -n frames           frames to record (capacity is default)\n"
+      "   -d sec              seconds to record\n"
+      "   -N frames           capacity of the file (-n, or -d x fps, or 60 sec)\n"
+      "   -b buffers          frames buffered for the writer (32 is default)\n"
+      "   -B                  buffered I/O (no O_DIRECT)\n"
+      "   -u                  record the frames whose content changed only (static sources)\n"
+      "   -h                  print this help\n";
+
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int)
+{
+    stop = 1;
+}
+
+
+static inline long long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void *
+aligned_alloc_or_die(size_t size)
+{
+    void *p;
+    if (posix_memalign(&p, VSCULL_REC_ALIGN, size) != 0)
+        throw std::bad_alloc();
+    memset(p, 0, size);
+    return p;
+}
+
+
+struct recorder
+{
+    int fd;
+    struct vscull_rec_header *hdr;      // VSCULL_REC_ALIGN bytes
+    struct vscull_rec_index  *index;    // capacity entries, aligned
+
+    std::vector<unsigned char *> ring;
+    std::atomic<unsigned long long> head;       // frames queued (capture thread)
+    std::atomic<unsigned long long> tail;       // frames written (writer thread)
+    std::atomic<bool> done;
+    std::atomic<unsigned long long> dropped;
+    std::atomic<unsigned long long> errors;
+
+    std::mutex lock;
+    std::condition_variable ready;
+
+    recorder()
+    : fd(-1), hdr(0), index(0), ring(), head(0), tail(0), done(false), dropped(0), errors(0), lock(), ready()
+    {}
+
+    ~recorder()
+    {
+        for(size_t n = 0; n < ring.size(); n++)
+            free(ring[n]);
+        free(index);
+        free(hdr);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool write_at(const void *buf, size_t len, uint64_t off)
+    {
+        const char *p = (const char *)buf;
+        while (len) {
+            ssize_t r = pwrite(fd, p, len, off);
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            p += r, off += r, len -= r;
+        }
+        return true;
+    }
+
+    /* header and index up to the frames written */
+    bool sync_index()
+    {
+        hdr->count = tail;
+        size_t len = vscull_rec_align(hdr->count * sizeof(struct vscull_rec_index));
+        return write_at(index, len, hdr->index_offset) && write_at(hdr, VSCULL_REC_ALIGN, 0);
+    }
+};
+
+
+static void
+writer(recorder &rec)
+{
+    long long last_sync = now_ns();
+
+    for(;;) {
+        unsigned long long t = rec.tail;
+
+        if (t == rec.head) {
+            if (rec.done && t == rec.head)
+                break;
+            std::unique_lock<std::mutex> l(rec.lock);
+            rec.ready.wait_for(l, std::chrono::milliseconds(10));
+        }
+        else {
+            unsigned char *buf = rec.ring[t % rec.ring.size()];
+            if (!rec.write_at(buf, rec.hdr->slot_size, rec.index[t].offset))
+                rec.errors++;
+            rec.tail = t + 1;
+        }
+
+        if (now_ns() - last_sync > 1000000000LL) {
+            if (!rec.sync_index())
+                rec.errors++;
+            last_sync = now_ns();
+        }
+    }
+
+    if (!rec.sync_index())
+        rec.errors++;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+    int minor = 0;
+    long long frames = 0, capacity = 0;
+    int seconds = 0;
+    int buffers = 32;
+    bool direct = true;
+    bool skip = false;
+
+    while(( i = getopt(argc, argv, "m:n:d:N:b:Buh")) != EOF)
+        switch(i) {
+        case 'm': minor = atoi(optarg);
+                  break;
+        case 'n': frames = atoll(optarg);
+                  break;
+        case 'd': seconds = atoi(optarg);
+                  break;
+        case 'N': capacity = atoll(optarg);
+                  break;
+        case 'b': buffers = std::max(2, atoi(optarg));
+                  break;
+        case 'B': direct = false;
+                  break;
+        case 'u': skip = true;
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    if (optind + 1 != argc) {
+        fprintf(stderr,usage,__progname);
+        exit(1);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    try {
+        vscull::Consumer cons(minor);
+        if (skip && !cons.skip_unchanged())
+            return 1;
+        const vscull::Dev &dev = cons.dev();
+        int fps = dev.fps() > 0 ? dev.fps() : 25;
+
+        if (!vscull::Converter::supported(dev.palette())) {
+            std::cerr << "palette not supported: " << PALETTE((unsigned int)dev.palette()) << std::endl;
+            return 1;
+        }
+
+        if (capacity == 0)
+            capacity = frames ? frames : (long long)(seconds ? seconds : 60) * fps;
+        if (frames == 0 || frames > capacity)
+            frames = capacity;
+
+        recorder rec;
+        rec.hdr = (struct vscull_rec_header *)aligned_alloc_or_die(VSCULL_REC_ALIGN);
+        vscull_rec_init(rec.hdr, dev.width(), dev.height(), dev.palette(), fps,
+                        vscull::image::size(dev.palette(), dev.width(), dev.height()), capacity);
+        rec.index = (struct vscull_rec_index *)aligned_alloc_or_die(vscull_rec_align(capacity * sizeof(struct vscull_rec_index)));
+
+        for(int n = 0; n < buffers; n++)
+            rec.ring.push_back((unsigned char *)aligned_alloc_or_die(rec.hdr->slot_size));
+
+        /* preallocated file */
+        const char *path = argv[optind];
+        rec.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|(direct ? O_DIRECT : 0), 0644);
+        if (rec.fd < 0 && direct) {
+            std::clog << path << ": O_DIRECT not supported, using buffered I/O" << std::endl;
+            rec.fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        }
+        if (rec.fd < 0) {
+            std::cerr << path << ": couldn't open" << std::endl;
+            return 1;
+        }
+
+        off_t size = rec.hdr->index_offset + vscull_rec_align(capacity * sizeof(struct vscull_rec_index));
+        if (posix_fallocate(rec.fd, 0, size) != 0 && ftruncate(rec.fd, size) < 0) {
+            std::cerr << path << ": couldn't allocate " << size << " bytes" << std::endl;
+            return 1;
+        }
+        if (!rec.sync_index()) {
+            std::cerr << path << ": write error" << std::endl;
+            return 1;
+        }
+
+        std::cout << dev.name() << " -> " << path << ": " << dev.width() << "x" << dev.height() << " "
+                  << PALETTE((unsigned int)dev.palette()) << " @ " << fps << " fps, " << frames << " frames ("
+                  << (cons.mapped() ? "mmap" : "read") << (direct ? ", O_DIRECT" : "") << ")" << std::endl;
+
+        std::thread wr(writer, std::ref(rec));
+
+        vscull::Converter copy(dev.palette(), dev.palette(), dev.width(), dev.height());
+        unsigned long long seq = 0;     /* device sequence, extended to 64 bits */
+        unsigned long long missed = 0;
+        unsigned int last = 0;
+        bool first = true;
+
+        while (!stop && (long long)rec.head < frames) {
+            vscull::Consumer::Frame f = cons.acquire();
+            if (!f)
+                break;
+
+            /* sync() returns after a frame period even if the producer stalled: the frame
+               already recorded is not a new one */
+            struct vscull_frame_info fi;
+            if (!f.info(fi))
+                break;
+            if (!first && fi.seq == last)
+                continue;
+
+            if (!first) {
+                seq    += fi.seq - last;
+                missed += fi.seq - last - 1;
+            }
+            else
+                seq = fi.seq;
+            last  = fi.seq;
+            first = false;
+
+            unsigned long long h = rec.head;
+
+            if (h - rec.tail == rec.ring.size()) {
+                rec.dropped++;      /* the writer is behind: don't hold the device */
+                continue;
+            }
+
+            vscull::image src;
+            src.palette = dev.palette();
+            src.width   = dev.width();
+            src.height  = dev.height();
+            for(int p = 0; p < cons.nplanes(); p++) {
+                src.plane[p]  = const_cast<unsigned char *>(f.plane(p).data());
+                src.stride[p] = cons.stride(p);
+            }
+            copy(src, vscull::image(dev.palette(), dev.width(), dev.height(), rec.ring[h % rec.ring.size()]));
+
+            rec.index[h].seq    = seq;
+            rec.index[h].ts     = fi.ts ? fi.ts : now_ns();
+            rec.index[h].offset = rec.hdr->data_offset + h * rec.hdr->slot_size;
+
+            rec.head = h + 1;
+            rec.ready.notify_one();
+        }
+
+        rec.done = true;
+        rec.ready.notify_one();
+        wr.join();
+
+        std::cout << "recorded " << (unsigned long long)rec.tail << " frames, dropped " << (unsigned long long)rec.dropped
+                  << ", missed " << missed << ", write errors " << (unsigned long long)rec.errors << std::endl;
+
+        return rec.errors ? 1 : 0;
+    }
+    catch(std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
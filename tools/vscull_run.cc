@@ -1,6 +1,6 @@
 /*
     Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
- 
+
     This program is free software; you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
     the Free Software Foundation; either version 2 of the License, or
@@ -16,8 +16,21 @@
     Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
 */
 
+/* vscull_run: run a consumer on a reserved device.
+
+   The child reserves the video device (VSIOCSRES), sets ALSA_CARD and is placed before the
+   exec: cgroup, cpu set, NUMA memory policy and scheduling class are inherited by the
+   consumer. With -A the placement is derived from the device (VSIOCGNUMA): the cpus of
+   the node holding the frame except the producer's cpu, and memory bound to that node. */
+
 #include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
 #include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
 
 #include <vscull_ioctl.h>
 
@@ -25,33 +38,255 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
 
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <getopt.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <err.h>
 
+extern char *__progname;
+
+const char usage[]=
+      "%s [options] id_video id_audio [--] argv[0] argv[1]...\n"
+      "   -c cpus             run on the given cpus, e.g. 0,2-5\n"
+      "   -N [mode:]nodes     NUMA memory policy, mode: bind (default), preferred, interleave\n"
+      "   -F prio             SCHED_FIFO with the given priority [1-99]\n"
+      "   -D budget           SCHED_DEADLINE: budget (usec) per frame period of the device\n"
+      "   -g cgroup           move into the cgroup (absolute path, or relative to /sys/fs/cgroup)\n"
+      "   -A                  automatic placement: cpus and memory of the frame's node, except the\n"
+      "                       producer's cpu (explicit -c/-N take precedence)\n"
+      "   -v                  print the placement\n"
+      "   -h                  print this help\n";
+
+
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
+
+/* glibc has no wrapper for sched_setattr() */
+struct run_sched_attr
+{
+    uint32_t size;
+    uint32_t sched_policy;
+    uint64_t sched_flags;
+    int32_t  sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime;
+    uint64_t sched_deadline;
+    uint64_t sched_period;
+};
+
+
+static std::vector<int>
+parse_list(const char *s)
+{
+    std::vector<int> ret;
+    while (*s) {
+        char *end;
+        int a = strtol(s, &end, 10), b = a;
+        if (*end == '-')
+            b = strtol(end + 1, &end, 10);
+        for(int m = a; m <= b; m++)
+            ret.push_back(m);
+        s = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            break;
+    }
+    return ret;
+}
+
+
+static std::string
+sysfs_read(const char *fmt, int n)
+{
+    char path[128]; snprintf(path, sizeof(path), fmt, n);
+    std::ifstream in(path);
+    std::string ret;
+    std::getline(in, ret);
+    return ret;
+}
+
+
+static int
+cpu_node(int cpu)
+{
+    for(int node = 0; node < 1024; node++) {
+        char path[128]; snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+        if (access(path, F_OK) == 0)
+            return node;
+    }
+    return -1;
+}
+
+
+static std::string
+list_str(const std::vector<int> &l)
+{
+    std::string ret;
+    for(size_t n = 0; n < l.size(); n++) {
+        if (n) ret += ",";
+        ret += std::to_string(l[n]);
+    }
+    return ret;
+}
+
+
+/* -A: the node of the frame (or of the producer, before the first frame) */
+static void
+auto_placement(int fd, std::vector<int> &cpus, std::vector<int> &nodes)
+{
+    struct vscull_numa numa;
+    if (ioctl(fd, VSIOCGNUMA, &numa) < 0)
+        err(2, "ioctl: VSIOCGNUMA");
+
+    int node = numa.frame_node >= 0 ? numa.frame_node :
+               numa.writer_cpu >= 0 ? cpu_node(numa.writer_cpu) : numa.node;
+    if (node < 0) {
+        warnx("automatic placement: no frame nor producer yet, placement left to the kernel");
+        return;
+    }
+
+    if (nodes.empty())
+        nodes.push_back(node);
+
+    if (cpus.empty()) {
+        std::vector<int> local = parse_list(sysfs_read("/sys/devices/system/node/node%d/cpulist", node).c_str());
+        for(size_t n = 0; n < local.size(); n++)
+            if (local[n] != numa.writer_cpu)
+                cpus.push_back(local[n]);
+        if (cpus.empty())   /* the producer's cpu is the only one of the node */
+            cpus = local;
+    }
+}
+
+
+static void
+set_cgroup(const char *cg)
+{
+    std::string path = cg[0] == '/' ? cg : std::string("/sys/fs/cgroup/") + cg;
+    std::ofstream out((path + "/cgroup.procs").c_str());
+    out << getpid() << std::endl;
+    if (!out)
+        err(2, "cgroup %s", path.c_str());
+}
+
+
+static void
+set_cpus(const std::vector<int> &cpus)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(size_t n = 0; n < cpus.size(); n++)
+        if (cpus[n] >= 0 && cpus[n] < CPU_SETSIZE)
+            CPU_SET(cpus[n], &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+        err(2, "sched_setaffinity");
+}
+
+
+static void
+set_nodes(int mode, const std::vector<int> &nodes)
+{
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+    const unsigned long bits = 8 * sizeof(unsigned long);
+    for(size_t n = 0; n < nodes.size(); n++)
+        if (nodes[n] >= 0 && nodes[n] < 1024)
+            mask[nodes[n] / bits] |= 1UL << (nodes[n] % bits);
+    if (syscall(SYS_set_mempolicy, mode, mask, 1024 + 1) < 0)
+        err(2, "set_mempolicy");
+}
+
+
+static void
+set_sched(int fd, int fifo, int budget)
+{
+    if (fifo) {
+        struct sched_param sp;
+        sp.sched_priority = fifo;
+        if (sched_setscheduler(0, SCHED_FIFO, &sp) < 0)
+            err(2, "sched_setscheduler");
+        return;
+    }
+
+    struct vscull_ioctl par;
+    if (ioctl(fd, VSIOCGPAR, &par) < 0)
+        err(2, "ioctl: VSIOCGPAR");
+
+    struct run_sched_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size           = sizeof(attr);
+    attr.sched_policy   = SCHED_DEADLINE;
+    attr.sched_flags    = SCHED_FLAG_RESET_ON_FORK;     /* threads of the consumer run as normal tasks */
+    attr.sched_runtime  = budget * 1000ULL;
+    attr.sched_period   = 1000000000ULL / (par.fps > 0 ? par.fps : 25);
+    attr.sched_deadline = attr.sched_period;
+
+    if (syscall(SYS_sched_setattr, 0, &attr, 0) < 0)
+        err(2, "sched_setattr (SCHED_DEADLINE needs the cpus of the whole root domain: use a cpuset cgroup rather than -c)");
+}
+
 
 int
 main(int argc, char *argv[])
 {
-    int sta;
+    int i, sta;
+    std::vector<int> cpus, nodes;
+    int mode = MPOL_BIND;
+    int fifo = 0, budget = 0;
+    const char *cgroup = NULL;
+    bool automatic = false, verbose = false;
 
-    if (argc < 4) {
-        std::cout << "usage: " << argv[0] << " id_video id_audio -- argv[0] argv[1]..." << std::endl;
+    while(( i = getopt(argc, argv, "+c:N:F:D:g:Avh")) != EOF)
+        switch(i) {
+        case 'c': cpus = parse_list(optarg);
+                  break;
+        case 'N': {
+                const char *l = optarg;
+                if (strncmp(l, "bind:", 5) == 0) mode = MPOL_BIND, l += 5;
+                else if (strncmp(l, "preferred:", 10) == 0) mode = MPOL_PREFERRED, l += 10;
+                else if (strncmp(l, "interleave:", 11) == 0) mode = MPOL_INTERLEAVE, l += 11;
+                nodes = parse_list(l);
+            } break;
+        case 'F': fifo = atoi(optarg);
+                  break;
+        case 'D': budget = atoi(optarg);
+                  break;
+        case 'g': cgroup = optarg;
+                  break;
+        case 'A': automatic = true;
+                  break;
+        case 'v': verbose = true;
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    int cmd = optind + 2;
+    if (cmd < argc && strcmp(argv[cmd], "--") == 0)
+        cmd++;
+
+    if (cmd >= argc) {
+        fprintf(stderr,usage,__progname);
         exit(0);
     }
 
-    int id_video = atoi(argv[1]);
-    int id_audio = atoi(argv[2]);
+    if (fifo && budget)
+        errx(1, "-F and -D are exclusive");
+
+    int id_video = atoi(argv[optind]);
+    int id_audio = atoi(argv[optind + 1]);
 
     pid_t pid = fork();
-    if (pid == -1) 
+    if (pid == -1)
         err(1, "fork");
 
     if ( pid == 0 ) {    /* child */
-            
+
         char dev[80]; sprintf(dev, "/dev/video%d", id_video);
-       
+
         int fd = open(dev, O_RDWR);
         if (fd < 0) {
             err(2, "open");
@@ -62,12 +297,30 @@ main(int argc, char *argv[])
         if( ioctl(fd, VSIOCSRES, &pid) < 0 )
             err(2, "ioctl");
 
+        /* placement: the cgroup first, its limits apply to the scheduling class */
+        if (automatic)
+            auto_placement(fd, cpus, nodes);
+        if (cgroup)
+            set_cgroup(cgroup);
+        if (!cpus.empty())
+            set_cpus(cpus);
+        if (!nodes.empty())
+            set_nodes(mode, nodes);
+        if (fifo || budget)
+            set_sched(fd, fifo, budget);
+
+        if (verbose)
+            std::cout << "placement: cpus=" << (cpus.empty() ? "any" : list_str(cpus))
+                      << " nodes=" << (nodes.empty() ? "any" : list_str(nodes))
+                      << " sched=" << (fifo ? "fifo" : budget ? "deadline" : "other")
+                      << (cgroup ? " cgroup=" : "") << (cgroup ? cgroup : "") << std::endl;
+
         char alsa_card[80]; sprintf(alsa_card, "ALSA_CARD=%d", id_audio);
         putenv(alsa_card);
 
         /* exec command line... */
-        std::cout << "running: " << alsa_card << " " << argv[3] << "...\n";
-        if ( execv(argv[3], &argv[3]) < 0 ) {
+        std::cout << "running: " << alsa_card << " " << argv[cmd] << "...\n";
+        if ( execv(argv[cmd], &argv[cmd]) < 0 ) {
             err(3, "execve");
         }
     }
@@ -75,4 +328,3 @@ main(int argc, char *argv[])
     wait(&sta);
     return 0;
 }
- 
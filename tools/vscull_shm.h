@@ -0,0 +1,570 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+//  shm backend: the vscull device emulated in user space (VSCULL_BACKEND=shm, see vscull::Dev).
+//
+//  A device is a POSIX shared memory segment, /dev/shm/vscull-video<minor>, created on the
+//  first open with the module defaults:
+//
+//      header   one page: parameters, flags, reservation, plane layout, frame sequence
+//      ring     VSCULL_SHM_SLOTS frames of frame_size bytes (the layout of the module)
+//
+//  The writer fills the slot after the last published one and publishes it by bumping the
+//  sequence; readers wait on the sequence with a futex and view (mmap) or copy (read) the
+//  slot of the last frame, so a frame being written is never the one being read. Writers
+//  are paced at fps as by the module. Parameters are changed under a futex lock; a new
+//  geometry is refused (EBUSY) while the ring is mapped.
+//
+//  A writer that maps the ring fills the slot in place, out of the lock: one opener at a
+//  time can map it for writing, and write() is refused (EBUSY) to the others meanwhile.
+//
+//  Not emulated: poll() (use the kernel backend with vscull::Reactor), NUMA placement,
+//  the frame pool, VSIOCSIMPORT and VSCULL_STREAM. Queued frames (VSIOCQFRAME) are written
+//  at their pts by the caller. Segments outlive the processes, as device nodes do: remove
+//  them with rm /dev/shm/vscull-video*.
+
+#ifndef _VSCULL_SHM_H_
+#define _VSCULL_SHM_H_
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <climits>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+
+#define VSCULL_SHM_SLOTS    3
+#define VSCULL_SHM_MAGIC    0x76736d31      /* "vsm1" */
+
+namespace vscull { namespace shm {
+
+    struct header
+    {
+        unsigned int magic;     /* set when the segment is initialized */
+        int lock;               /* futex lock: 0 free, 1 locked, 2 contended */
+        int seq;                /* frames published: futex word of the readers */
+        int maps;               /* mappings of the ring */
+        int openers;
+        pid_t pid;              /* reservation */
+        int flags;
+        struct vscull_ioctl par;
+        struct vscull_planes planes;
+        unsigned int image_size;
+        unsigned int frame_size;    /* slot size: the frame extent, page aligned */
+        long long last;         /* last frame published (CLOCK_MONOTONIC, nsec): pacing */
+        int gen;                /* layout generation: odd while resizing */
+        pid_t writer;           /* opener with the ring mapped for writing (0: none) */
+    };
+
+    static inline long
+    futex(int *addr, int op, int val, const struct timespec *ts)
+    {
+        return syscall(SYS_futex, addr, op, val, ts, 0, 0);
+    }
+
+    static inline long long
+    now_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    static inline std::string
+    path(int minor)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "/vscull-video%d", minor);
+        return name;
+    }
+
+    // the plane layout of the module (vscull_frame_layout): returns the frame extent, or 0 if
+    // it exceeds VSCULL_MAX_FRAME (the sizes are bounded before they are multiplied)
+
+    static inline unsigned int
+    layout(const struct vscull_ioctl &par, int flags, struct vscull_planes &pl, unsigned int &image_size)
+    {
+        const struct vscull_format *fmt = PALETTE_FORMAT(par.palette);
+        const std::size_t page = sysconf(_SC_PAGESIZE);
+        std::size_t off = 0;
+
+        memset(&pl, 0, sizeof(pl));
+        pl.nplanes = fmt->nplanes;
+        image_size = 0;
+
+        for(int n = 0; n < pl.nplanes; n++) {
+            std::size_t w = n ? (par.width  + (1 << fmt->hsub) - 1) >> fmt->hsub : par.width;
+            std::size_t h = n ? (par.height + (1 << fmt->vsub) - 1) >> fmt->vsub : par.height;
+            std::size_t bpp = pl.nplanes > 1 ? 8 : fmt->bpp ? fmt->bpp : par.depth;
+
+            if (bpp && w > ((std::size_t)VSCULL_MAX_FRAME << 3) / bpp)
+                return 0;
+            std::size_t stride = (w * bpp + 7) / 8;
+            if (stride && h > VSCULL_MAX_FRAME / stride)
+                return 0;
+
+            if (flags & VSCULL_PLANAR)
+                off = (off + page - 1) & ~(page - 1);
+            pl.plane[n].stride = stride;
+            pl.plane[n].size   = stride * h;
+            pl.plane[n].offset = off;
+            off += pl.plane[n].size;
+            image_size += pl.plane[n].size;
+            if (off > VSCULL_MAX_FRAME)
+                return 0;
+        }
+
+        return ((off ? off : 1) + page - 1) & ~(page - 1);
+    }
+
+
+    class device
+    {
+        int             _M_fd;
+        struct header * _M_hdr;
+        unsigned char * _M_map;         // the whole segment, while the ring is mapped
+        std::size_t     _M_map_len;
+        int             _M_seen;        // last frame seen by this opener
+        int             _M_plane;       // plane returned by read() (-1: the whole frame)
+        bool            _M_wmap;        // the ring is mapped for writing by this opener
+
+    public:
+        /* open the device, creating it if create is set */
+        explicit device(int minor, bool create = true)
+        : _M_fd(-1), _M_hdr(0), _M_map(0), _M_map_len(0), _M_seen(0), _M_plane(-1), _M_wmap(false)
+        {
+            const std::size_t page = sysconf(_SC_PAGESIZE);
+            std::string name = path(minor);
+            bool creator = false;
+
+            if (create) {
+                _M_fd = shm_open(name.c_str(), O_RDWR|O_CREAT|O_EXCL, 0666);
+                creator = _M_fd >= 0;
+            }
+            if (_M_fd < 0)
+                _M_fd = shm_open(name.c_str(), O_RDWR, 0);
+            if (_M_fd < 0)
+                throw std::runtime_error(std::string("shm_open: couldn't open /dev/shm").append(name));
+
+            if (creator && ftruncate(_M_fd, page) < 0) {
+                shm_unlink(name.c_str());
+                close(_M_fd);
+                throw std::runtime_error(std::string("ftruncate: couldn't size /dev/shm").append(name));
+            }
+
+            /* another opener is creating the device: the header must exist before it is mapped */
+            struct stat st;
+            for(int n = 0; !creator && fstat(_M_fd, &st) == 0 && (std::size_t)st.st_size < page && n < 1000; n++)
+                usleep(1000);
+            if (!creator && (fstat(_M_fd, &st) < 0 || (std::size_t)st.st_size < page)) {
+                close(_M_fd);
+                throw std::runtime_error(std::string("shm: /dev/shm").append(name).append(" not initialized"));
+            }
+
+            void *m = ::mmap(0, page, PROT_READ|PROT_WRITE, MAP_SHARED, _M_fd, 0);
+            if (m == MAP_FAILED) {
+                close(_M_fd);
+                throw std::runtime_error(std::string("mmap: couldn't map /dev/shm").append(name));
+            }
+            _M_hdr = static_cast<struct header *>(m);
+
+            if (creator) {
+                /* the module defaults */
+                _M_hdr->par.width   = 320;
+                _M_hdr->par.height  = 240;
+                _M_hdr->par.depth   = 32;
+                _M_hdr->par.palette = VIDEO_PALETTE_YUV420P;
+                _M_hdr->par.fps     = 25;
+                resize(_M_hdr->par, 0);
+                __atomic_store_n(&_M_hdr->magic, VSCULL_SHM_MAGIC, __ATOMIC_RELEASE);
+            }
+            else {
+                for(int n = 0; __atomic_load_n(&_M_hdr->magic, __ATOMIC_ACQUIRE) != VSCULL_SHM_MAGIC; n++) {
+                    if (n == 1000) {
+                        ::munmap(_M_hdr, page);
+                        close(_M_fd);
+                        throw std::runtime_error(std::string("shm: /dev/shm").append(name).append(" not initialized"));
+                    }
+                    usleep(1000);
+                }
+            }
+
+            __atomic_add_fetch(&_M_hdr->openers, 1, __ATOMIC_RELAXED);
+            _M_seen = __atomic_load_n(&_M_hdr->seq, __ATOMIC_ACQUIRE) - 1;    /* the current frame is unseen */
+        }
+
+        ~device()
+        {
+            unmap();
+            __atomic_sub_fetch(&_M_hdr->openers, 1, __ATOMIC_RELAXED);
+            ::munmap(_M_hdr, sysconf(_SC_PAGESIZE));
+            close(_M_fd);
+        }
+
+        bool get_par(struct vscull_ioctl &par) const
+        {
+            lock();
+            par = _M_hdr->par;
+            unlock();
+            return true;
+        }
+
+        bool set_par(const struct vscull_ioctl &par)
+        {
+            if (par.width <= 0 || par.height <= 0 || par.depth < 0 || par.palette < 0 || par.fps < 0)
+                return fail(EINVAL);
+
+            lock();
+            const struct vscull_ioctl &cur = _M_hdr->par;
+            if (par.width != cur.width || par.height != cur.height || par.depth != cur.depth || par.palette != cur.palette) {
+                if (!resize(par, _M_hdr->flags)) {
+                    unlock();
+                    return false;
+                }
+            }
+            _M_hdr->par.fps = par.fps;
+            unlock();
+            return true;
+        }
+
+        int flags() const
+        { return __atomic_load_n(&_M_hdr->flags, __ATOMIC_RELAXED); }
+
+        bool flags(int f)
+        {
+            lock();
+            bool ok = ((f ^ _M_hdr->flags) & VSCULL_PLANAR) == 0 || resize(_M_hdr->par, f);
+            if (ok)
+                _M_hdr->flags = f;
+            unlock();
+            return ok;
+        }
+
+        bool planes(struct vscull_planes &pl) const
+        {
+            lock();
+            pl = _M_hdr->planes;
+            unlock();
+            return true;
+        }
+
+        /* select the plane returned by read() (-1: the whole frame) */
+        bool plane(int n)
+        {
+            if (n < -1 || n >= VSCULL_MAX_PLANES)
+                return fail(EINVAL);
+            _M_plane = n;
+            return true;
+        }
+
+        pid_t reserved() const
+        { return __atomic_load_n(&_M_hdr->pid, __ATOMIC_RELAXED); }
+
+        bool reserve(pid_t pid)
+        {
+            __atomic_store_n(&_M_hdr->pid, pid, __ATOMIC_RELAXED);
+            return true;
+        }
+
+        /* map the ring: returns the first slot (see offset()); EBUSY if mapped for writing 
+           by another opener */
+        unsigned char * map(int prot)
+        {
+            lock();
+            if ((prot & PROT_WRITE) && other_writer()) {
+                unlock();
+                errno = EBUSY;
+                return 0;
+            }
+            _M_map_len = sysconf(_SC_PAGESIZE) + VSCULL_SHM_SLOTS * (std::size_t)_M_hdr->frame_size;
+            void *m = ::mmap(0, _M_map_len, prot, MAP_SHARED, _M_fd, 0);
+            if (m != MAP_FAILED) {
+                _M_hdr->maps++;
+                if (prot & PROT_WRITE) {
+                    _M_hdr->writer = getpid();
+                    _M_wmap = true;
+                }
+            }
+            unlock();
+
+            if (m == MAP_FAILED)
+                return 0;
+            _M_map = static_cast<unsigned char *>(m);
+            return _M_map + sysconf(_SC_PAGESIZE);
+        }
+
+        void unmap()
+        {
+            if (_M_map == 0)
+                return;
+            ::munmap(_M_map, _M_map_len);
+            _M_map = 0;
+            __atomic_sub_fetch(&_M_hdr->maps, 1, __ATOMIC_RELAXED);
+            if (_M_wmap) {
+                lock();
+                _M_hdr->writer = 0;
+                unlock();
+                _M_wmap = false;
+            }
+        }
+
+        /* offset in the ring of the frame to write (the next one) or to read (the last seen) */
+        std::size_t offset(bool writer) const
+        {
+            int seq = writer ? __atomic_load_n(&_M_hdr->seq, __ATOMIC_ACQUIRE) + 1 : _M_seen;
+            return slot(seq) * (std::size_t)_M_hdr->frame_size;
+        }
+
+        /* the next slot has been filled in place */
+        bool publish()
+        {
+            pace();
+            lock();
+            __atomic_add_fetch(&_M_hdr->seq, 1, __ATOMIC_RELEASE);
+            unlock();
+            futex(&_M_hdr->seq, FUTEX_WAKE, INT_MAX, 0);
+            return true;
+        }
+
+        /* write a packed frame: paced and published */
+        ssize_t write(const void *buf, std::size_t len)
+        {
+            const unsigned char *p = static_cast<const unsigned char *>(buf);
+            ssize_t ret = 0;
+
+            pace();
+            lock();
+            if (other_writer()) {
+                unlock();
+                errno = EBUSY;
+                return -1;
+            }
+            off_t base = sysconf(_SC_PAGESIZE) + (off_t)slot(_M_hdr->seq + 1) * _M_hdr->frame_size;
+            for(int n = 0; n < _M_hdr->planes.nplanes && (std::size_t)ret < len; n++) {
+                std::size_t size = std::min<std::size_t>(_M_hdr->planes.plane[n].size, len - ret);
+                if (::pwrite(_M_fd, p + ret, size, base + _M_hdr->planes.plane[n].offset) != (ssize_t)size) {
+                    unlock();
+                    return -1;
+                }
+                ret += size;
+            }
+            __atomic_add_fetch(&_M_hdr->seq, 1, __ATOMIC_RELEASE);
+            unlock();
+
+            futex(&_M_hdr->seq, FUTEX_WAKE, INT_MAX, 0);
+            return ret;
+        }
+
+        /* read the next frame not seen yet, packed (or the selected plane) */
+        ssize_t read(void *buf, std::size_t len)
+        {
+            unsigned char *p = static_cast<unsigned char *>(buf);
+
+            for(;;) {
+                int seq = wait(0);
+                if (seq == _M_seen)
+                    return -1;      /* EINTR */
+
+                int gen = __atomic_load_n(&_M_hdr->gen, __ATOMIC_ACQUIRE);
+                if (gen & 1) {
+                    sched_yield();  /* resizing */
+                    continue;
+                }
+
+                struct vscull_planes pl;
+                planes(pl);
+                off_t base = sysconf(_SC_PAGESIZE) + (off_t)slot(seq) * _M_hdr->frame_size;
+                ssize_t ret = 0;
+                bool shortr = false;
+
+                for(int n = 0; n < pl.nplanes && (std::size_t)ret < len; n++) {
+                    if (_M_plane >= 0 && n != _M_plane)
+                        continue;
+                    std::size_t size = std::min<std::size_t>(pl.plane[n].size, len - ret);
+                    if (::pread(_M_fd, p + ret, size, base + pl.plane[n].offset) != (ssize_t)size) {
+                        shortr = true;
+                        break;
+                    }
+                    ret += size;
+                }
+
+                /* resized, or the slot reused by the writer while copying: take the frame again */
+                if (__atomic_load_n(&_M_hdr->gen, __ATOMIC_ACQUIRE) != gen ||
+                    __atomic_load_n(&_M_hdr->seq, __ATOMIC_ACQUIRE) - seq >= VSCULL_SHM_SLOTS - 1)
+                    continue;
+
+                if (shortr)
+                    return -1;
+
+                _M_seen = seq;
+                return ret;
+            }
+        }
+
+        /* VIDIOCSYNC: wait for a frame not seen yet, up to a frame period (unpaced: no timeout) */
+        bool sync()
+        {
+            int fps = __atomic_load_n(&_M_hdr->par.fps, __ATOMIC_RELAXED);
+            long long period = 1000000000LL / (fps > 0 ? fps : 1);
+            struct timespec ts = { (time_t)(period / 1000000000LL), (long)(period % 1000000000LL) };
+
+            _M_seen = wait(fps > 0 ? &ts : 0);
+            return true;
+        }
+
+        int fd() const
+        { return _M_fd; }
+
+        const struct header & state() const
+        { return *_M_hdr; }
+
+        /* last frame seen by this opener */
+        int seen() const
+        { return _M_seen; }
+
+    private:
+        device(const device &) = delete;
+        device & operator=(const device &) = delete;
+
+        static bool fail(int e)
+        {
+            errno = e;
+            return false;
+        }
+
+        static std::size_t slot(int seq)
+        { return (unsigned int)seq % VSCULL_SHM_SLOTS; }
+
+        /* wait for a sequence not seen yet (ts: timeout); returns the last sequence */
+        int wait(const struct timespec *ts)
+        {
+            int seq;
+            while ((seq = __atomic_load_n(&_M_hdr->seq, __ATOMIC_ACQUIRE)) == _M_seen) {
+                if (futex(&_M_hdr->seq, FUTEX_WAIT, seq, ts) < 0 && errno != EAGAIN)
+                    return __atomic_load_n(&_M_hdr->seq, __ATOMIC_ACQUIRE);     /* timeout, signal */
+            }
+            return seq;
+        }
+
+        /* the ring is mapped for writing by another opener, still alive (lock held) */
+        bool other_writer() const
+        {
+            pid_t w = _M_hdr->writer;
+            return w && !_M_wmap && (kill(w, 0) == 0 || errno != ESRCH);
+        }
+
+        /* futex lock, shared by the processes */
+        void lock() const
+        {
+            int c = 0;
+            if (__atomic_compare_exchange_n(&_M_hdr->lock, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return;
+            if (c != 2)
+                c = __atomic_exchange_n(&_M_hdr->lock, 2, __ATOMIC_ACQUIRE);
+            while (c != 0) {
+                futex(&_M_hdr->lock, FUTEX_WAIT, 2, 0);
+                c = __atomic_exchange_n(&_M_hdr->lock, 2, __ATOMIC_ACQUIRE);
+            }
+        }
+
+        void unlock() const
+        {
+            if (__atomic_fetch_sub(&_M_hdr->lock, 1, __ATOMIC_RELEASE) != 1) {
+                __atomic_store_n(&_M_hdr->lock, 0, __ATOMIC_RELEASE);
+                futex(&_M_hdr->lock, FUTEX_WAKE, 1, 0);
+            }
+        }
+
+        /* pace the writers at fps, as vscull_sleep() does: the time of the frame is reserved
+           under the lock, the sleep is out of it not to hold the readers and set_par() */
+        void pace()
+        {
+            lock();
+            int fps = _M_hdr->par.fps;
+            if (fps <= 0) {
+                unlock();
+                return;
+            }
+
+            long long period = 1000000000LL / fps;
+            long long next = _M_hdr->last + period, now = now_ns();
+
+            if (now < next)
+                _M_hdr->last = next;
+            else
+                _M_hdr->last = now;     /* we lost the temporal reference */
+            unlock();
+
+            if (now < next) {
+                struct timespec ts = { (time_t)(next / 1000000000LL), (long)(next % 1000000000LL) };
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+                { }
+            }
+        }
+
+        /* new layout of the ring (lock held): refused while mapped */
+        bool resize(const struct vscull_ioctl &par, int flags)
+        {
+            if (_M_hdr->maps)
+                return fail(EBUSY);
+
+            struct vscull_planes pl;
+            unsigned int image_size;
+            unsigned int frame_size = layout(par, flags, pl, image_size);
+            if (frame_size == 0)
+                return fail(E2BIG);
+
+            /* readers copying a slot retry (see read()); the slots are zeroed, as frames are
+               by the module */
+            __atomic_add_fetch(&_M_hdr->gen, 1, __ATOMIC_ACQ_REL);
+
+            bool ok = ftruncate(_M_fd, sysconf(_SC_PAGESIZE)) == 0 &&
+                      ftruncate(_M_fd, sysconf(_SC_PAGESIZE) + VSCULL_SHM_SLOTS * (off_t)frame_size) == 0;
+            if (ok) {
+                _M_hdr->par.width   = par.width;
+                _M_hdr->par.height  = par.height;
+                _M_hdr->par.depth   = par.depth;
+                _M_hdr->par.palette = par.palette;
+                _M_hdr->planes      = pl;
+                _M_hdr->image_size  = image_size;
+                _M_hdr->frame_size  = frame_size;
+            }
+
+            __atomic_add_fetch(&_M_hdr->gen, 1, __ATOMIC_RELEASE);
+            return ok;
+        }
+    };
+
+} }
+
+#endif /* _VSCULL_SHM_H_ */
@@ -0,0 +1,433 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+//  Producer/Consumer: zero-copy frame access on top of vscull::Dev.
+//
+//  Both own the device and, when the driver allows it, a shared mapping of the frame.
+//  Frames are handed out as leases: a Producer::Frame is published when it goes out of
+//  scope (or on commit()), a Consumer::Frame is a view of the last published frame.
+//  When mmap() is not available the same interface is served by write()/read() through a
+//  buffer allocated once at construction, so the hot loop never allocates.
+//
+//  The geometry is sampled at construction: while the frame is mapped the driver refuses
+//  VSIOCSPAR (EBUSY). With the shm backend the mapping is a ring of frames: a Producer
+//  fills the frame after the last published one, a Consumer views the last synced one.
+//
+//  Usage:
+//
+//      vscull::Producer prod(0);
+//      for(;;) {
+//          vscull::Producer::Frame f = prod.acquire();
+//          fill(f.plane(0).data(), f.plane(0).size());
+//      }                                               // published here
+//
+
+#ifndef _VSCULL_STREAM_H_
+#define _VSCULL_STREAM_H_
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <vscull_dev.h>
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <stdexcept>
+
+namespace vscull {
+
+    // contiguous view of bytes (or pixels)
+
+    template <typename T>
+    class span
+    {
+        T *         _M_ptr;
+        std::size_t _M_size;
+
+    public:
+        span()
+        : _M_ptr(0), _M_size(0)
+        {}
+
+        span(T *ptr, std::size_t size)
+        : _M_ptr(ptr), _M_size(size)
+        {}
+
+        T * data() const
+        { return _M_ptr; }
+
+        std::size_t size() const
+        { return _M_size; }
+
+        bool empty() const
+        { return _M_size == 0; }
+
+        T * begin() const
+        { return _M_ptr; }
+
+        T * end() const
+        { return _M_ptr + _M_size; }
+
+        T & operator[](std::size_t n) const
+        { return _M_ptr[n]; }
+
+        span subspan(std::size_t off, std::size_t len) const
+        { return span(_M_ptr + off, len); }
+    };
+
+    // access path to the frame
+
+    enum class access { automatic, mmap, rw };
+
+    namespace detail {
+
+        // frame access shared by Producer and Consumer: the mapping (or the bounce buffer)
+        // and the plane layout in it
+
+        class stream
+        {
+        protected:
+            Dev                   _M_dev;
+            unsigned char *       _M_map;
+            std::size_t           _M_map_size;
+            std::vector<unsigned char> _M_buf;
+            std::size_t           _M_image_size;
+            struct vscull_planes  _M_planes;    // offsets in the mapping, or packed in _M_buf
+            bool                  _M_leased;
+            bool                  _M_writer;
+
+            stream(int minor, access a, int prot)
+            : _M_dev(minor),
+            _M_map(0),
+            _M_map_size(0),
+            _M_buf(),
+            _M_image_size(0),
+            _M_planes(),
+            _M_leased(false),
+            _M_writer(prot & PROT_WRITE)
+            {
+                if (!_M_dev.planes(_M_planes) || _M_planes.nplanes < 1 || _M_planes.nplanes > VSCULL_MAX_PLANES)
+                    throw std::runtime_error(std::string("vscull: couldn't get the frame layout of ").append(_M_dev.name()));
+
+                const struct vscull_plane &last = _M_planes.plane[_M_planes.nplanes-1];
+                std::size_t page = sysconf(_SC_PAGESIZE);
+
+                for(int n = 0; n < _M_planes.nplanes; n++)
+                    _M_image_size += _M_planes.plane[n].size;
+
+                if (a != access::rw) {
+                    _M_map_size = (last.offset + last.size + page - 1) & ~(page - 1);
+                    _M_map = _M_dev.map(_M_map_size, prot);
+                    if (_M_map == 0 && a == access::mmap)
+                        throw std::runtime_error(std::string("mmap: couldn't map ").append(_M_dev.name()));
+                }
+
+                if (_M_map == 0) {
+                    // packed layout, as accepted by read()/write()
+                    _M_buf.resize(_M_image_size);
+                    for(int n = 0, off = 0; n < _M_planes.nplanes; off += _M_planes.plane[n].size, n++)
+                        _M_planes.plane[n].offset = off;
+                }
+            }
+
+            stream(stream &&other)
+            : _M_dev(std::move(other._M_dev)),
+            _M_map(other._M_map),
+            _M_map_size(other._M_map_size),
+            _M_buf(std::move(other._M_buf)),
+            _M_image_size(other._M_image_size),
+            _M_planes(other._M_planes),
+            _M_leased(other._M_leased),
+            _M_writer(other._M_writer)
+            {
+                other._M_map = 0;
+            }
+
+            stream & operator=(stream &&other)
+            {
+                if (this != &other) {
+                    unmap();
+                    _M_dev = std::move(other._M_dev);
+                    _M_map = other._M_map;
+                    _M_map_size = other._M_map_size;
+                    _M_buf = std::move(other._M_buf);
+                    _M_image_size = other._M_image_size;
+                    _M_planes = other._M_planes;
+                    _M_leased = other._M_leased;
+                    _M_writer = other._M_writer;
+                    other._M_map = 0;
+                }
+                return *this;
+            }
+
+            ~stream()
+            {
+                unmap();
+            }
+
+            unsigned char * base()
+            { return _M_map ? _M_map + _M_dev.offset(_M_writer) : &_M_buf[0]; }
+
+            span<unsigned char> plane(int n)
+            {
+                if (n < 0 || n >= _M_planes.nplanes)
+                    return span<unsigned char>();
+                return span<unsigned char>(base() + _M_planes.plane[n].offset, _M_planes.plane[n].size);
+            }
+
+            void lease()
+            {
+                if (_M_leased)
+                    throw std::logic_error("vscull: a frame is already leased");
+                _M_leased = true;
+            }
+
+        private:
+            void unmap()
+            {
+                if (_M_map)
+                    _M_dev.unmap(_M_map, _M_map_size);
+                _M_map = 0;
+            }
+
+            stream(const stream &) = delete;
+            stream & operator=(const stream &) = delete;
+
+        public:
+            const Dev & dev() const
+            { return _M_dev; }
+
+            bool mapped() const
+            { return _M_map != 0; }
+
+            std::size_t image_size() const
+            { return _M_image_size; }
+
+            int nplanes() const
+            { return _M_planes.nplanes; }
+
+            /* stride of a plane, in bytes */
+            unsigned int stride(int n) const
+            { return _M_planes.plane[n].stride; }
+        };
+    }
+
+    // writer side: frames are filled in place and published when the lease is released
+
+    class Producer : public detail::stream
+    {
+    public:
+        class Frame
+        {
+            Producer * _M_prod;
+
+        public:
+            explicit Frame(Producer *p)
+            : _M_prod(p)
+            {}
+
+            Frame(Frame &&other)
+            : _M_prod(other._M_prod)
+            {
+                other._M_prod = 0;
+            }
+
+            Frame & operator=(Frame &&other)
+            {
+                if (this != &other) {
+                    commit();
+                    _M_prod = other._M_prod;
+                    other._M_prod = 0;
+                }
+                return *this;
+            }
+
+            ~Frame()
+            {
+                commit();
+            }
+
+            /* the whole frame: planes are at their offsets (see Producer::stride()) */
+            span<unsigned char> data() const
+            { return span<unsigned char>(_M_prod->base(), _M_prod->mapped() ? _M_prod->_M_map_size : _M_prod->_M_image_size); }
+
+            span<unsigned char> plane(int n) const
+            { return _M_prod->plane(n); }
+
+            /* publish the frame to the readers */
+            bool commit()
+            {
+                if (_M_prod == 0)
+                    return false;
+                Producer *p = _M_prod;
+                _M_prod = 0;
+                p->_M_leased = false;
+                return p->publish();
+            }
+
+            /* release the lease without publishing */
+            void discard()
+            {
+                if (_M_prod)
+                    _M_prod->_M_leased = false;
+                _M_prod = 0;
+            }
+
+        private:
+            Frame(const Frame &) = delete;
+            Frame & operator=(const Frame &) = delete;
+        };
+
+        explicit Producer(int minor = 0, access a = access::automatic)
+        : detail::stream(minor, a, PROT_READ|PROT_WRITE)
+        {}
+
+        Producer(Producer &&) = default;
+        Producer & operator=(Producer &&) = default;
+
+        /* lease the frame: only one lease at a time */
+        Frame acquire()
+        {
+            lease();
+            return Frame(this);
+        }
+
+    private:
+        bool publish()
+        {
+            if (mapped())
+                return _M_dev.publish();
+
+            ssize_t r;
+            while ((r = _M_dev.write(&_M_buf[0], _M_image_size)) < 0 && errno == EINTR)
+            { }
+            if (r < 0) {
+                std::clog << "write: " << _M_dev.name() << " error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+    };
+
+    // reader side: each lease waits for the next frame and views it
+
+    class Consumer : public detail::stream
+    {
+    public:
+        class Frame
+        {
+            Consumer * _M_cons;
+
+        public:
+            explicit Frame(Consumer *c)
+            : _M_cons(c)
+            {}
+
+            Frame(Frame &&other)
+            : _M_cons(other._M_cons)
+            {
+                other._M_cons = 0;
+            }
+
+            Frame & operator=(Frame &&other)
+            {
+                if (this != &other) {
+                    release();
+                    _M_cons = other._M_cons;
+                    other._M_cons = 0;
+                }
+                return *this;
+            }
+
+            ~Frame()
+            {
+                release();
+            }
+
+            /* false if the frame couldn't be obtained */
+            explicit operator bool() const
+            { return _M_cons != 0; }
+
+            span<const unsigned char> data() const
+            { return span<const unsigned char>(_M_cons->base(), _M_cons->mapped() ? _M_cons->_M_map_size : _M_cons->_M_image_size); }
+
+            span<const unsigned char> plane(int n) const
+            {
+                span<unsigned char> p = _M_cons->plane(n);
+                return span<const unsigned char>(p.data(), p.size());
+            }
+
+            /* sequence, repeat flag and publication time of the frame */
+            bool info(struct vscull_frame_info &fi) const
+            { return _M_cons->_M_dev.frame_info(fi); }
+
+            void release()
+            {
+                if (_M_cons)
+                    _M_cons->_M_leased = false;
+                _M_cons = 0;
+            }
+
+        private:
+            Frame(const Frame &) = delete;
+            Frame & operator=(const Frame &) = delete;
+        };
+
+        explicit Consumer(int minor = 0, access a = access::automatic)
+        : detail::stream(minor, a, PROT_READ)
+        {}
+
+        Consumer(Consumer &&) = default;
+        Consumer & operator=(Consumer &&) = default;
+
+        /* acquire() skips the frames identical to the previous one (static sources) */
+        bool skip_unchanged(bool on = true)
+        { return _M_dev.skip(on); }
+
+        /* wait for the next frame and lease it: only one lease at a time */
+        Frame acquire()
+        {
+            lease();
+            if (!sync()) {
+                _M_leased = false;
+                return Frame(0);
+            }
+            return Frame(this);
+        }
+
+    private:
+        bool sync()
+        {
+            if (mapped())
+                return _M_dev.sync();
+
+            ssize_t r;
+            while ((r = _M_dev.read(&_M_buf[0], _M_image_size)) < 0 && errno == EINTR)
+            { }
+            if (r < 0) {
+                std::clog << "read: " << _M_dev.name() << " error" << std::endl;
+                return false;
+            }
+            return true;
+        }
+    };
+}
+
+#endif /* _VSCULL_STREAM_H_ */
@@ -0,0 +1,659 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+/* vscull_stress: concurrency stress of a device, with throughput and latency figures.
+
+   Writers fill each frame with a token (the CLOCK_MONOTONIC time of the write) repeated
+   over the image; readers check that a frame read holds a single token (a frame is fresh,
+   zeroed memory beyond the part written after a resize) and take the latency from it.
+   The first pass runs writers and readers only, the second one adds mappers (open, mmap,
+   VIDIOCSYNC, munmap, close), resizers (VSIOCSPAR between the given geometries) and
+   reservers (VSIOCSRES, open, close). Busy answers (EBUSY, EAGAIN) are expected there.
+
+   Results are printed in TAP, as kselftest does; the kernel log (/dev/kmsg) is scanned for
+   BUG, WARNING, KASAN and lockdep reports emitted during the run. With -o the figures are
+   saved; with -b they are compared to a saved run, throughput and latency may not regress
+   by more than the tolerance. Exit status: 0 pass, 1 fail, 4 skip (no device). */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+
+#include <vscull_ioctl.h>
+#include <vscull_palette.h>
+#include <vscull_dev.h>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+extern char *__progname;
+
+const char usage[]=
+      "%s [options]\n"
+      "   -m minor            vscull video device (/dev/video0 is default)\n"
+      "   -w writers          writer threads (2 is default)\n"
+      "   -r readers          reader threads (4 is default)\n"
+      "   -M mappers          mapper threads, second pass (2 is default)\n"
+      "   -R resizers         resizer threads, second pass (1 is default)\n"
+      "   -S reservers        reserver threads, second pass (1 is default)\n"
+      "   -s sizes            geometries of the resizers, e.g. 320x240,640x480 (default: the\n"
+      "                       device geometry and its double)\n"
+      "   -d sec              duration of each pass (5 is default)\n"
+      "   -o file             save the figures\n"
+      "   -b file             compare the figures to a saved run\n"
+      "   -T pct              tolerance of the comparison (20 is default)\n"
+      "   -h                  print this help\n";
+
+
+#define KSFT_PASS   0
+#define KSFT_FAIL   1
+#define KSFT_SKIP   4
+
+#define MAX_SAMPLES (1 << 20)       /* latency samples per reader */
+
+
+static inline long long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+struct geometry
+{
+    int width;
+    int height;
+};
+
+
+struct config
+{
+    int minor;
+    int writers;
+    int readers;
+    int mappers;
+    int resizers;
+    int reservers;
+    int seconds;
+    std::vector<geometry> sizes;
+};
+
+
+struct result
+{
+    std::atomic<unsigned long long> frames;     // written
+    std::atomic<unsigned long long> bytes;
+    std::atomic<unsigned long long> wtime;      // ns spent in write()
+    std::atomic<unsigned long long> reads;
+    std::atomic<unsigned long long> torn;
+    std::atomic<unsigned long long> errors;
+    std::atomic<unsigned long long> maps;
+    std::atomic<unsigned long long> map_busy;
+    std::atomic<unsigned long long> resizes;
+    std::atomic<unsigned long long> resize_busy;
+    std::atomic<unsigned long long> reservations;
+    std::vector<long long> latency;             // ns, merged from the readers
+    double elapsed;
+
+    result()
+    : frames(0), bytes(0), wtime(0), reads(0), torn(0), errors(0), maps(0), map_busy(0),
+      resizes(0), resize_busy(0), reservations(0), latency(), elapsed(0)
+    {}
+
+    long long percentile(double p) const
+    {
+        if (latency.empty())
+            return 0;
+        return latency[std::min(latency.size() - 1, size_t(p * latency.size()))];
+    }
+};
+
+
+/* readers and writers stop in two steps: the writers keep feeding blocked readers */
+static std::atomic<bool> stop_readers, stop_writers, stop_others;
+
+
+/* size of the packed image of the current geometry */
+static size_t
+image_size(vscull::Dev &dev)
+{
+    struct vscull_planes pl;
+    size_t size = 0;
+    if (dev.planes(pl)) {
+        for(int n = 0; n < pl.nplanes; n++)
+            size += pl.plane[n].size;
+    }
+    return size;
+}
+
+
+/* largest image of the geometries, for the buffers */
+static size_t
+max_image(const config &cf)
+{
+    size_t max = 0;
+    for(size_t n = 0; n < cf.sizes.size(); n++)
+        max = std::max(max, size_t(cf.sizes[n].width) * cf.sizes[n].height * 4);
+    return max + 4096;
+}
+
+
+static void
+fill(std::vector<unsigned char> &buf, size_t size, uint64_t token)
+{
+    size_t n = 0;
+    for(; n + 8 <= size; n += 8)
+        memcpy(&buf[n], &token, 8);
+    memcpy(&buf[n], &token, size - n);
+}
+
+
+/* the token of a frame, 0 for a fresh frame; -1 if torn */
+static long long
+check(const unsigned char *buf, size_t size)
+{
+    uint64_t token, w;
+    size_t n = 0;
+
+    if (size < 8)
+        return 0;
+
+    memcpy(&token, buf, 8);
+
+    /* the token up to the end of the part written, then zeroes */
+    for(; n + 8 <= size; n += 8) {
+        memcpy(&w, buf + n, 8);
+        if (w != token)
+            break;
+    }
+    if (n + 8 > size && memcmp(buf + n, &token, size - n) == 0)
+        return token;
+
+    for(; n < size; n++)
+        if (buf[n])
+            return -1;
+    return token;
+}
+
+
+static void
+writer(const config &cf, result &res)
+{
+    try {
+        vscull::Dev dev(cf.minor);
+        std::vector<unsigned char> buf(max_image(cf));
+        size_t size = image_size(dev);
+
+        while (!stop_writers) {
+            long long t0 = now_ns();
+            fill(buf, std::min(size, buf.size()), t0 | 1);
+
+            long long t1 = now_ns();
+            ssize_t r = dev.write(&buf[0], std::min(size, buf.size()));
+            long long t2 = now_ns();
+
+            if (r < 0) {
+                if (errno == EINVAL || errno == ENOMEM)     /* resized in the meantime */
+                    size = image_size(dev);
+                else if (errno != EINTR && errno != EBUSY)
+                    res.errors++;
+                continue;
+            }
+
+            res.frames++;
+            res.bytes += r;
+            res.wtime += t2 - t1;
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr << "writer: " << e.what() << std::endl;
+        res.errors++;
+    }
+}
+
+
+static void
+reader(const config &cf, result &res, std::vector<long long> &lat)
+{
+    try {
+        vscull::Dev dev(cf.minor);
+        std::vector<unsigned char> buf(max_image(cf));
+
+        while (!stop_readers) {
+            ssize_t r = dev.read(&buf[0], buf.size());
+            long long t = now_ns();
+
+            if (r < 0) {
+                if (errno != EINTR)
+                    res.errors++;
+                continue;
+            }
+
+            res.reads++;
+
+            long long token = check(&buf[0], r);
+            if (token < 0) {
+                res.torn++;
+                continue;
+            }
+            if (token && lat.size() < MAX_SAMPLES)
+                lat.push_back(t - (token & ~1LL));
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr << "reader: " << e.what() << std::endl;
+        res.errors++;
+    }
+}
+
+
+static void
+mapper(const config &cf, result &res)
+{
+    while (!stop_others) {
+        try {
+            vscull::Dev dev(cf.minor);
+            struct vscull_planes pl;
+            if (!dev.planes(pl)) {
+                res.errors++;
+                continue;
+            }
+
+            size_t page = sysconf(_SC_PAGESIZE);
+            const struct vscull_plane &last = pl.plane[pl.nplanes - 1];
+            size_t extent = (last.offset + last.size + page - 1) & ~(page - 1);
+
+            unsigned char *m = dev.map(extent, PROT_READ);
+            if (m == 0) {
+                if (errno == EAGAIN || errno == EBUSY || errno == ENOMEM)
+                    res.map_busy++;
+                else
+                    res.errors++;
+                continue;
+            }
+
+            dev.sync();
+            volatile unsigned char c = m[dev.offset(false)];
+            (void)c;
+
+            dev.unmap(m, extent);
+            res.maps++;
+        }
+        catch(std::exception &e) {
+            res.errors++;
+        }
+    }
+}
+
+
+static void
+resizer(const config &cf, result &res)
+{
+    try {
+        vscull::Dev dev(cf.minor);
+
+        for(size_t n = 0; !stop_others; n++) {
+            const geometry &g = cf.sizes[n % cf.sizes.size()];
+            dev.width(g.width);
+            dev.height(g.height);
+            errno = 0;
+            if (dev.commit())
+                res.resizes++;
+            else if (errno == 0)
+                ;                   /* same geometry */
+            else if (errno == EBUSY || errno == EAGAIN)
+                res.resize_busy++;
+            else
+                res.errors++;
+            usleep(1000);
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr << "resizer: " << e.what() << std::endl;
+        res.errors++;
+    }
+}
+
+
+static void
+reserver(const config &cf, result &res)
+{
+    try {
+        vscull::Dev dev(cf.minor);
+
+        while (!stop_others) {
+            if (!dev.reserve(getpid())) {
+                res.errors++;
+                continue;
+            }
+            { vscull::Dev other(cf.minor); }    /* open and close with the reservation */
+            dev.reserve(0);
+            res.reservations++;
+        }
+    }
+    catch(std::exception &e) {
+        std::cerr << "reserver: " << e.what() << std::endl;
+        res.errors++;
+    }
+}
+
+
+static void
+run(const config &cf, bool mixed, result &res)
+{
+    std::vector<std::thread> w, r, o;
+    std::vector<std::vector<long long> > lat(cf.readers);
+
+    stop_readers = stop_writers = stop_others = false;
+
+    long long start = now_ns();
+
+    for(int n = 0; n < cf.readers; n++)
+        r.push_back(std::thread(reader, std::cref(cf), std::ref(res), std::ref(lat[n])));
+    for(int n = 0; n < cf.writers; n++)
+        w.push_back(std::thread(writer, std::cref(cf), std::ref(res)));
+
+    if (mixed) {
+        for(int n = 0; n < cf.mappers; n++)
+            o.push_back(std::thread(mapper, std::cref(cf), std::ref(res)));
+        for(int n = 0; n < cf.resizers; n++)
+            o.push_back(std::thread(resizer, std::cref(cf), std::ref(res)));
+        for(int n = 0; n < cf.reservers; n++)
+            o.push_back(std::thread(reserver, std::cref(cf), std::ref(res)));
+    }
+
+    sleep(cf.seconds);
+
+    /* mappers wait for a frame, readers too: the writers stop last */
+    stop_others = true;
+    for(size_t n = 0; n < o.size(); n++)
+        o[n].join();
+    stop_readers = true;
+    for(size_t n = 0; n < r.size(); n++)
+        r[n].join();
+
+    res.elapsed = (now_ns() - start) * 1e-9;
+
+    stop_writers = true;
+    for(size_t n = 0; n < w.size(); n++)
+        w[n].join();
+
+    for(size_t n = 0; n < lat.size(); n++)
+        res.latency.insert(res.latency.end(), lat[n].begin(), lat[n].end());
+    std::sort(res.latency.begin(), res.latency.end());
+}
+
+
+/* BUG, WARNING, KASAN and lockdep reports since the descriptor was opened */
+static int
+kernel_log(int fd, std::string &first)
+{
+    static const char *pattern[] = { "BUG:", "WARNING:", "KASAN", "possible circular locking",
+                                     "possible recursive locking", "inconsistent lock state",
+                                     "general protection", "Oops", 0 };
+    char rec[8192];
+    int found = 0;
+    ssize_t r;
+
+    while ((r = read(fd, rec, sizeof(rec) - 1)) > 0 || (r < 0 && errno == EPIPE)) {
+        if (r < 0)
+            continue;       /* overwritten records */
+        rec[r] = '\0';
+        for(int n = 0; pattern[n]; n++) {
+            if (strstr(rec, pattern[n])) {
+                if (found++ == 0) {
+                    const char *msg = strchr(rec, ';');
+                    first = msg ? msg + 1 : rec;
+                    first.erase(first.find_last_not_of("\n") + 1);
+                }
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+
+static std::map<std::string, double>
+figures(const result &rw)
+{
+    std::map<std::string, double> f;
+    f["rw.fps"]     = rw.frames / rw.elapsed;
+    f["rw.mbps"]    = rw.wtime ? rw.bytes * 1e3 / rw.wtime : 0;     /* bytes per write() ns */
+    f["rw.p50_us"]  = rw.percentile(0.50) / 1e3;
+    f["rw.p99_us"]  = rw.percentile(0.99) / 1e3;
+    return f;
+}
+
+
+static bool
+parse_sizes(const char *s, std::vector<geometry> &sizes)
+{
+    while (*s) {
+        geometry g;
+        int len;
+        if (sscanf(s, "%dx%d%n", &g.width, &g.height, &len) != 2 || g.width <= 0 || g.height <= 0)
+            return false;
+        sizes.push_back(g);
+        s += len;
+        if (*s == ',')
+            s++;
+        else if (*s)
+            return false;
+    }
+    return true;
+}
+
+
+static int test_no = 0;
+static bool failed = false;
+
+static void
+tap(bool ok, const std::string &what)
+{
+    std::cout << (ok ? "ok " : "not ok ") << ++test_no << " " << what << std::endl;
+    failed |= !ok;
+}
+
+
+static std::string
+summary(const result &res, bool mixed)
+{
+    std::ostringstream out;
+    char line[256];
+    snprintf(line, sizeof(line), "%.1f fps, %.1f MB/s in write(), %llu reads, latency p50 %.1f us p99 %.1f us max %.1f us",
+             res.frames / res.elapsed, res.wtime ? res.bytes * 1e3 / res.wtime : 0.0, (unsigned long long)res.reads,
+             res.percentile(0.50) / 1e3, res.percentile(0.99) / 1e3, res.latency.empty() ? 0.0 : res.latency.back() / 1e3);
+    out << line;
+    if (mixed)
+        out << ", " << res.maps << " maps (" << res.map_busy << " busy), " << res.resizes << " resizes ("
+            << res.resize_busy << " busy), " << res.reservations << " reservations";
+    if (res.torn || res.errors)
+        out << " # " << res.torn << " torn frames, " << res.errors << " errors";
+    return out.str();
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+    config cf;
+    const char *save = NULL, *base = NULL;
+    double tolerance = 20;
+
+    cf.minor     = 0;
+    cf.writers   = 2;
+    cf.readers   = 4;
+    cf.mappers   = 2;
+    cf.resizers  = 1;
+    cf.reservers = 1;
+    cf.seconds   = 5;
+
+    while(( i = getopt(argc, argv, "m:w:r:M:R:S:s:d:o:b:T:h")) != EOF)
+        switch(i) {
+        case 'm': cf.minor = atoi(optarg);
+                  break;
+        case 'w': cf.writers = atoi(optarg);
+                  break;
+        case 'r': cf.readers = atoi(optarg);
+                  break;
+        case 'M': cf.mappers = atoi(optarg);
+                  break;
+        case 'R': cf.resizers = atoi(optarg);
+                  break;
+        case 'S': cf.reservers = atoi(optarg);
+                  break;
+        case 's': if (!parse_sizes(optarg, cf.sizes))
+                      errx(1, "bad sizes: %s", optarg);
+                  break;
+        case 'd': cf.seconds = atoi(optarg);
+                  break;
+        case 'o': save = optarg;
+                  break;
+        case 'b': base = optarg;
+                  break;
+        case 'T': tolerance = atof(optarg);
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    if (cf.writers < 1 || cf.readers < 0 || cf.seconds < 1)
+        errx(1, "at least a writer and a second are required");
+
+    std::cout << "TAP version 13" << std::endl;
+
+    std::unique_ptr<vscull::Dev> dev;
+    try {
+        dev.reset(new vscull::Dev(cf.minor));
+    }
+    catch(std::exception &e) {
+        std::cout << "1..0 # SKIP " << e.what() << std::endl;
+        return KSFT_SKIP;
+    }
+
+    if (cf.sizes.empty()) {
+        geometry g = { dev->width(), dev->height() };
+        cf.sizes.push_back(g);
+        g.width *= 2; g.height *= 2;
+        cf.sizes.push_back(g);
+    }
+
+    /* full speed, one frame per write(), no repeats */
+    struct vscull_ioctl par = { dev->width(), dev->height(), dev->depth(), dev->palette(), dev->fps() };
+    int flags = dev->flags();
+    pid_t pid = dev->reserved();
+
+    dev->fps(0);
+    dev->flags(flags & ~(VSCULL_STREAM|VSCULL_HOLD));
+    dev->commit();
+
+    /* Dev reports each failed ioctl: busy devices are expected here */
+    std::streambuf *clog = std::clog.rdbuf(0);
+
+    /* the kernel log from now on */
+    int kmsg = dev->emulated() ? -1 : open("/dev/kmsg", O_RDONLY|O_NONBLOCK);
+    if (kmsg >= 0)
+        lseek(kmsg, 0, SEEK_END);
+
+    std::cout << "1.." << (3 + (base ? 1 : 0)) << std::endl;
+    std::cout << "# " << dev->name() << ": " << par.width << "x" << par.height << " " << PALETTE(par.palette)
+              << ", " << cf.writers << " writers, " << cf.readers << " readers, " << cf.seconds << " sec per pass" << std::endl;
+
+    result rw, mixed;
+
+    run(cf, false, rw);
+    tap(rw.torn == 0 && rw.errors == 0 && rw.frames > 0, "read/write: " + summary(rw, false));
+
+    run(cf, true, mixed);
+    tap(mixed.torn == 0 && mixed.errors == 0 && mixed.frames > 0, "read/write/mmap/resize/reserve: " + summary(mixed, true));
+
+    if (kmsg >= 0) {
+        std::string first;
+        int n = kernel_log(kmsg, first);
+        tap(n == 0, n ? "kernel log # " + std::to_string(n) + " reports, first: " + first : "kernel log");
+        close(kmsg);
+    }
+    else
+        std::cout << "ok " << ++test_no << " kernel log # SKIP /dev/kmsg not available" << std::endl;
+
+    std::map<std::string, double> cur = figures(rw);
+
+    if (base) {
+        std::ifstream in(base);
+        std::map<std::string, double> old;
+        std::string key;
+        double val;
+        while (in >> key >> val)
+            old[key] = val;
+
+        std::ostringstream why;
+        bool ok = !old.empty();
+        if (!ok)
+            why << " # couldn't read " << base;
+
+        /* throughput may not drop, latency may not grow, beyond the tolerance */
+        for(std::map<std::string, double>::iterator it = old.begin(); it != old.end(); ++it) {
+            bool higher_is_better = it->first.find("_us") == std::string::npos;
+            double now = cur[it->first], lim = it->second * (higher_is_better ? 1 - tolerance / 100 : 1 + tolerance / 100);
+            if (higher_is_better ? now < lim : now > lim) {
+                why << (ok ? " # " : ", ") << it->first << " " << now << " (was " << it->second << ")";
+                ok = false;
+            }
+        }
+        tap(ok, "baseline " + std::string(base) + why.str());
+    }
+
+    if (save) {
+        std::ofstream out(save);
+        for(std::map<std::string, double>::iterator it = cur.begin(); it != cur.end(); ++it)
+            out << it->first << " " << it->second << "\n";
+        if (!out)
+            warn("%s", save);
+    }
+
+    /* restore the device */
+    std::clog.rdbuf(clog);
+    dev->width(par.width);
+    dev->height(par.height);
+    dev->fps(par.fps);
+    dev->flags(flags);
+    dev->commit();
+    dev->reserve(pid);
+
+    return failed ? KSFT_FAIL : KSFT_PASS;
+}
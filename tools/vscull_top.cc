@@ -0,0 +1,297 @@
+/*
+    Copyright (c) 2009 Nicola Bonelli <n.bonelli@netresults.it>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+*/
+
+// vscull_top: live activity of the vscull devices. The cumulative counters of all the
+// devices are sampled from the control node (the devices are not opened, the readers and
+// the writers are not disturbed) and the rates are computed between two samples.
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+
+#include <vscull_ioctl.h>
+#include <vscull_dev.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <signal.h>
+
+extern char *__progname;
+
+const char usage[]=
+      "%s [options]\n"
+      "   -i sec              sampling interval (1 is default)\n"
+      "   -n count            samples printed (0: until interrupted, default)\n"
+      "   -s key              sort the devices, worst first: drops (default), lag, pace,\n"
+      "                       fps (written below the device fps), bw, mem, minor\n"
+      "   -m minor            only this device (repeatable)\n"
+      "   -j                  JSON lines: one object per device per sample\n"
+      "   -h                  print this help\n";
+
+static volatile sig_atomic_t stop;
+
+static void
+on_signal(int)
+{
+    stop = 1;
+}
+
+
+/* rates of a file between two samples */
+
+struct file_rate
+{
+    struct vscull_file_stats s;
+    double fps;
+    double drops;
+};
+
+/* rates of a device between two samples */
+
+struct dev_rate
+{
+    struct vscull_dev_stats s;
+    double wfps;            /* frames written */
+    double rfps;            /* frames seen by all the readers */
+    double repeat;          /* frames repeated (VSCULL_HOLD) */
+    double dup;             /* frames written unchanged (VSCULL_DEDUP) */
+    double wbw;             /* bytes/sec */
+    double rbw;
+    double pace_us;         /* mean pacing error of the frames written */
+    double pace_pct;        /* ... in percent of the period */
+    double drops;           /* frames/sec dropped by all the readers */
+    unsigned int lag;       /* worst reader */
+    std::vector<file_rate> files;
+};
+
+
+static double
+rate(unsigned long long now, unsigned long long prev, double dt)
+{
+    return now >= prev && dt > 0 ? (now - prev) / dt : 0;
+}
+
+
+static dev_rate
+diff(const struct vscull_dev_stats &now, const struct vscull_dev_stats *prev)
+{
+    dev_rate r;
+    double dt = prev ? (now.ts - prev->ts) / 1e9 : 0;
+
+    r.s = now;
+    r.wfps = prev ? rate(now.written, prev->written, dt) : 0;
+    r.rfps = prev ? rate(now.rframes, prev->rframes, dt) : 0;
+    r.repeat = prev ? rate(now.repeated, prev->repeated, dt) : 0;
+    r.dup  = prev ? rate(now.duplicates, prev->duplicates, dt) : 0;
+    r.wbw  = prev ? rate(now.wbytes, prev->wbytes, dt) : 0;
+    r.rbw  = prev ? rate(now.rbytes, prev->rbytes, dt) : 0;
+    r.pace_us = r.pace_pct = 0;
+    if (prev && now.pace_n > prev->pace_n) {
+        r.pace_us = (now.pace_err - prev->pace_err) / 1e3 / (now.pace_n - prev->pace_n);
+        if (now.fps > 0)
+            r.pace_pct = r.pace_us * now.fps / 1e4;
+    }
+    r.drops = 0;
+    r.lag = 0;
+
+    for(int n = 0; n < std::min(now.nfiles, VSCULL_MAX_FILES); n++) {
+        const struct vscull_file_stats &f = now.file[n];
+        const struct vscull_file_stats *p = NULL;
+        file_rate fr;
+
+        if (prev)
+            for(int k = 0; k < std::min(prev->nfiles, VSCULL_MAX_FILES); k++)
+                if (prev->file[k].id == f.id)
+                    p = &prev->file[k];
+
+        fr.s = f;
+        fr.fps   = p ? rate(f.frames, p->frames, dt) : 0;
+        fr.drops = p ? rate(f.drops, p->drops, dt) : 0;
+
+        if (f.frames == 0)      /* the writer, or a file that never read */
+            continue;
+
+        r.drops += fr.drops;
+        r.lag = std::max(r.lag, f.lag);
+        r.files.push_back(fr);
+    }
+    return r;
+}
+
+
+/* how bad a device is for the sort key: the higher, the worse */
+
+static double
+badness(const dev_rate &r, const std::string &key)
+{
+    if (key == "lag")
+        return r.lag;
+    if (key == "pace")
+        return r.pace_pct;
+    if (key == "fps")
+        return r.s.fps > 0 ? r.s.fps - r.wfps : 0;
+    if (key == "bw")
+        return r.wbw + r.rbw;
+    if (key == "mem")
+        return r.s.mem;
+    if (key == "minor")
+        return -r.s.minor;
+    return r.drops;
+}
+
+
+static void
+print_table(const std::vector<dev_rate> &rs, double interval)
+{
+    char line[256];
+
+    if (isatty(1))
+        std::cout << "\033[H\033[2J";
+
+    snprintf(line, sizeof(line), "%s: %zu devices, every %.1f sec\n\n", __progname, rs.size(), interval);
+    std::cout << line;
+    std::cout << "minor   pid fps  w.fps  r.fps rep/s dup/s  w.MB/s  r.MB/s  pace.us pace%  rd  lag drops/s  mem.KB\n";
+
+    for(size_t n = 0; n < rs.size(); n++) {
+        const dev_rate &r = rs[n];
+        snprintf(line, sizeof(line), "%5d %5d %3d %6.1f %6.1f %5.1f %5.1f %7.2f %7.2f %8.1f %5.1f %3zu %4u %7.1f %7llu\n",
+                 r.s.minor, (int)r.s.pid, r.s.fps, r.wfps, r.rfps, r.repeat, r.dup, r.wbw / 1e6, r.rbw / 1e6,
+                 r.pace_us, r.pace_pct, r.files.size(), r.lag, r.drops, r.s.mem >> 10);
+        std::cout << line;
+
+        for(size_t k = 0; k < r.files.size(); k++) {
+            const file_rate &f = r.files[k];
+            snprintf(line, sizeof(line), "      reader pid %-6d id %-5u %6.1f fps  lag %-4u drops %llu (%.1f/s)\n",
+                     (int)f.s.pid, f.s.id, f.fps, f.s.lag, f.s.drops, f.drops);
+            std::cout << line;
+        }
+    }
+    std::cout << std::flush;
+}
+
+
+static void
+print_json(const std::vector<dev_rate> &rs)
+{
+    char line[512];
+
+    for(size_t n = 0; n < rs.size(); n++) {
+        const dev_rate &r = rs[n];
+        snprintf(line, sizeof(line),
+                 "{\"ts\":%lld,\"minor\":%d,\"pid\":%d,\"fps\":%d,\"image_size\":%u,\"mem\":%llu,"
+                 "\"seq\":%llu,\"write_fps\":%.2f,\"read_fps\":%.2f,\"repeat_fps\":%.2f,\"dup_fps\":%.2f,"
+                 "\"write_bps\":%.0f,\"read_bps\":%.0f,\"pace_err_us\":%.1f,\"pace_err_pct\":%.2f,"
+                 "\"drops_ps\":%.2f,\"lag\":%u,\"files\":%d,\"readers\":[",
+                 r.s.ts, r.s.minor, (int)r.s.pid, r.s.fps, r.s.image_size, r.s.mem,
+                 r.s.seq, r.wfps, r.rfps, r.repeat, r.dup, r.wbw, r.rbw, r.pace_us, r.pace_pct,
+                 r.drops, r.lag, r.s.nfiles);
+        std::cout << line;
+
+        for(size_t k = 0; k < r.files.size(); k++) {
+            const file_rate &f = r.files[k];
+            snprintf(line, sizeof(line), "%s{\"id\":%u,\"pid\":%d,\"fps\":%.2f,\"lag\":%u,\"frames\":%llu,"
+                     "\"drops\":%llu,\"drops_ps\":%.2f}",
+                     k ? "," : "", f.s.id, (int)f.s.pid, f.fps, f.s.lag, f.s.frames, f.s.drops, f.drops);
+            std::cout << line;
+        }
+        std::cout << "]}\n";
+    }
+    std::cout << std::flush;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int i;
+    double interval = 1;
+    long count = 0;
+    std::string key = "drops";
+    std::vector<int> minors;
+    bool json = false;
+
+    while(( i = getopt(argc, argv, "i:n:s:m:jh")) != EOF)
+        switch(i) {
+        case 'i': interval = atof(optarg);
+                  break;
+        case 'n': count = atol(optarg);
+                  break;
+        case 's': key = optarg;
+                  if (key != "drops" && key != "lag" && key != "pace" && key != "fps" &&
+                      key != "bw" && key != "mem" && key != "minor") {
+                      fprintf(stderr, "bad sort key: %s\n", optarg);
+                      exit(1);
+                  }
+                  break;
+        case 'm': minors.push_back(atoi(optarg));
+                  break;
+        case 'j': json = true;
+                  break;
+        case 'h': fprintf(stderr,usage,__progname); exit(0);
+        case '?': fprintf(stderr,"unknown option!\n"); exit(1);
+        }
+
+    if (interval <= 0) {
+        fprintf(stderr, "bad interval\n");
+        exit(1);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    vscull::Ctl ctl;
+    std::map<int, struct vscull_dev_stats> prev;
+
+    /* the first sample is the baseline of the rates */
+    for(long printed = -1; !stop && (count == 0 || printed < count); printed++) {
+        std::vector<struct vscull_dev_stats> st;
+        std::vector<dev_rate> rs;
+
+        if (!ctl.stats(st))
+            return 1;
+
+        for(size_t n = 0; n < st.size(); n++) {
+            if (!minors.empty() && std::find(minors.begin(), minors.end(), st[n].minor) == minors.end())
+                continue;
+            std::map<int, struct vscull_dev_stats>::const_iterator it = prev.find(st[n].minor);
+            rs.push_back(diff(st[n], it == prev.end() ? NULL : &it->second));
+        }
+
+        prev.clear();
+        for(size_t n = 0; n < st.size(); n++)
+            prev[st[n].minor] = st[n];
+
+        if (printed >= 0) {
+            std::stable_sort(rs.begin(), rs.end(), [&key](const dev_rate &a, const dev_rate &b) {
+                return badness(a, key) > badness(b, key);
+            });
+            if (json)
+                print_json(rs);
+            else
+                print_table(rs, interval);
+        }
+
+        if (count == 0 || printed + 1 < count)
+            usleep((useconds_t)(interval * 1e6));
+    }
+    return 0;
+}
@@ -30,12 +30,239 @@ struct vscull_ioctl
     int fps;
 };
 
+/* frame enqueued for scheduled presentation (VSIOCQFRAME) */
+
+struct vscull_qframe
+{
+    const void *data;       /* frame payload */
+    unsigned int size;      /* payload size in bytes */
+    long long pts;          /* presentation time (CLOCK_MONOTONIC, nsec) */
+};
+
+/* plane layout of the frame (VSIOCGPLANES) */
+
+#define VSCULL_MAX_PLANES   3
+#define VSCULL_MAX_FRAME    (256 << 20)     /* max. frame extent: larger geometries are refused (E2BIG) */
+
+struct vscull_plane
+{
+    unsigned int offset;    /* offset in the frame (mmap offset with VSCULL_PLANAR) */
+    unsigned int size;      /* plane size in bytes */
+    unsigned int stride;    /* bytes per line */
+};
+
+struct vscull_planes
+{
+    int nplanes;
+    struct vscull_plane plane[VSCULL_MAX_PLANES];
+};
+
+/* frame buffer pool statistics (VSIOCGPOOL) */
+
+struct vscull_pool_stats
+{
+    unsigned long long hits;        /* allocations served by the pool */
+    unsigned long long misses;      /* allocations served by vmalloc() */
+    unsigned long long trims;       /* buffers released by the idle trimmer */
+    unsigned long long cached;      /* bytes held by the pool */
+    unsigned int buffers;           /* buffers held by the pool */
+    unsigned int max_kb;            /* pool cap (KB) */
+};
+
+/* NUMA placement of the frame (VSIOCGNUMA) */
+
+struct vscull_numa
+{
+    int node;               /* placement: NUMA node, or -1 to follow the writer */
+    int frame_node;         /* node of the frame (-1: not allocated) */
+    int writer_cpu;         /* cpu of the last writer (-1: none) */
+    int reader_cpu;         /* cpu of the last reader (-1: none) */
+};
+
+/* producer memory used as the frame (VSIOCSIMPORT) */
+
+struct vscull_import
+{
+    void *addr;             /* page-aligned shared mapping (NULL: back to a private frame) */
+    unsigned long size;     /* at least the frame size reported by VIDIOCGMBUF */
+};
+
+/* frame memory of a device and of the module, in bytes (VSIOCGMEM) */
+
+struct vscull_mem
+{
+    unsigned long long used;        /* frames, stage and queued frames of the device */
+    unsigned long long limit;       /* max. of the device (0: no limit, VSIOCSMEM) */
+    unsigned long long total;       /* used by all the devices */
+    unsigned long long budget;      /* max. of all the devices (0: no limit, mem_budget_kb) */
+};
+
+/* mosaic: the frames of a master are sliced into tiles published by child devices
+   (VSIOCSMOSAIC on the master). A tile is at (x, y) of the master frame and has the
+   geometry of the child; master and children share the palette. */
+
+#define VSCULL_MAX_TILES    64
+
+struct vscull_tile
+{
+    int minor;              /* child device */
+    int x;                  /* top-left corner in the master frame (pixels) */
+    int y;
+};
+
+struct vscull_mosaic
+{
+    int count;              /* tiles (0: no mosaic) */
+    int master;             /* VSIOCGMOSAIC: minor of the master of a child, or -1 */
+    struct vscull_tile tile[VSCULL_MAX_TILES];
+};
+
+/* composition: the frame of a device is split in regions, each one written by its own
+   producer concurrently with the others (VSIOCSREGIONS, then VSIOCSREGION on the producer's
+   file). A frame is published when every region has been updated, and/or every period_ms
+   if any region has been updated since the last frame. */
+
+#define VSCULL_MAX_REGIONS  32
+
+#define VSCULL_TRIG_ALL     0x0001      /* publish when all the regions have been updated */
+#define VSCULL_TRIG_TIMER   0x0002      /* publish every period_ms, if any region was updated */
+
+struct vscull_region
+{
+    int x;                  /* top-left corner in the frame (pixels) */
+    int y;
+    int width;
+    int height;
+};
+
+struct vscull_regions
+{
+    int count;              /* regions (0: single writer) */
+    int trigger;            /* VSCULL_TRIG_* */
+    unsigned int period_ms; /* VSCULL_TRIG_TIMER */
+    unsigned int pending;   /* VSIOCGREGIONS: regions updated since the last frame (bitmask) */
+    struct vscull_region region[VSCULL_MAX_REGIONS];
+};
+
+/* control node (/dev/vscull): bulk query (VSIOCBGSTATE, VSIOCBGSTATS) and configuration (VSIOCBSPAR) */
+
+#define VSCULL_CTL_NAME     "vscull"
+#define VSCULL_MAXDEVS      256     /* max. entries of a bulk request */
+
+struct vscull_dev_state
+{
+    int minor;
+    struct vscull_ioctl par;
+    int flags;
+    pid_t pid;                  /* reservation */
+    int openers;
+    int frame_node;
+    unsigned int frame_size;    /* mmap() size */
+    unsigned int image_size;    /* read()/write() size */
+    unsigned long long mem;     /* frame memory held by the device */
+    unsigned long long mem_limit;   /* max. frame memory (0: no limit) */
+};
+
+/* activity counters of a device and of its open files, cumulative (VSIOCBGSTATS): rates are
+   computed by the sampler from two snapshots */
+
+#define VSCULL_MAX_FILES    16
+
+struct vscull_file_stats
+{
+    unsigned int id;            /* unique file id: snapshots of the same file */
+    pid_t pid;                  /* opener */
+    unsigned int lag;           /* frames published and not yet seen */
+    unsigned long long frames;  /* frames seen (read(), VIDIOCSYNC) */
+    unsigned long long drops;   /* frames published and never seen */
+};
+
+struct vscull_dev_stats
+{
+    int minor;
+    pid_t pid;                  /* reservation */
+    int fps;
+    unsigned int image_size;
+    unsigned long long mem;     /* frame memory held by the device */
+    long long ts;               /* snapshot time (CLOCK_MONOTONIC, nsec) */
+    unsigned long long seq;     /* frames published */
+    unsigned long long written; /* frames published by the writers */
+    unsigned long long repeated;    /* frames repeated (VSCULL_HOLD) */
+    unsigned long long duplicates;  /* frames written identical to the previous one (VSCULL_DEDUP) */
+    unsigned long long wbytes;  /* bytes written (write(), VSIOCQFRAME) */
+    unsigned long long rframes; /* frames seen by the readers */
+    unsigned long long rbytes;  /* bytes read */
+    unsigned long long pace_err;    /* sum of |interval - 1/fps| between frames written, nsec */
+    unsigned long long pace_n;  /* intervals in pace_err */
+    int nfiles;                 /* open files (entries: VSCULL_MAX_FILES at most) */
+    struct vscull_file_stats file[VSCULL_MAX_FILES];
+};
+
+struct vscull_dev_par
+{
+    int minor;
+    struct vscull_ioctl par;
+    int result;                 /* set by VSIOCBSPAR: 0 or -errno */
+};
+
+struct vscull_bulk
+{
+    int count;                  /* entries; VSIOCBGSTATE returns the number of devices */
+    void *entries;              /* struct vscull_dev_state/vscull_dev_par/vscull_dev_stats array */
+};
+
+/* device flags (VSIOCGFLAGS/VSIOCSFLAGS) */
+
+#define VSCULL_PLANAR       0x0001      /* planes stored page-aligned */
+#define VSCULL_NOCACHE      0x0002      /* non-temporal copies of the frames written */
+#define VSCULL_CACHED       0x0004      /* cached copies, whatever the frame size */
+#define VSCULL_STREAM       0x0008      /* write() accepts chunks, a frame is published when complete */
+#define VSCULL_HOLD         0x0010      /* the last frame is repeated at the device fps while the writer stalls */
+#define VSCULL_DEDUP        0x0020      /* write() detects the frames identical to the last one published */
+
+/* frame last seen by a reader, with read() or VIDIOCSYNC (VSIOCGFINFO). Frames flagged as
+   repeats or duplicates don't wake the readers of the files with VSIOCSSKIP set. */
+
+#define VSCULL_FRAME_REPEAT 0x0001      /* repeat of the previous frame (VSCULL_HOLD) */
+#define VSCULL_FRAME_DUP    0x0002      /* written identical to the previous frame (VSCULL_DEDUP) */
+
+struct vscull_frame_info
+{
+    unsigned int seq;       /* frames published by the device */
+    unsigned int flags;     /* VSCULL_FRAME_* */
+    unsigned int repeats;   /* consecutive repeats of the last frame written */
+    long long ts;           /* publication time (CLOCK_MONOTONIC, nsec) */
+};
+
 #define VSCULL_IOC_MAGIC    'k'
 
 #define VSIOCGPAR   _IOR(VSCULL_IOC_MAGIC, 1, struct vscull_ioctl)
 #define VSIOCSPAR   _IOW(VSCULL_IOC_MAGIC, 2, struct vscull_ioctl) 
 #define VSIOCGRES   _IOR(VSCULL_IOC_MAGIC, 3, pid_t) 
 #define VSIOCSRES   _IOW(VSCULL_IOC_MAGIC, 4, pid_t) 
+#define VSIOCQFRAME _IOW(VSCULL_IOC_MAGIC, 5, struct vscull_qframe)
+#define VSIOCQFLUSH _IO(VSCULL_IOC_MAGIC, 6)
+#define VSIOCGFLAGS _IOR(VSCULL_IOC_MAGIC, 7, int)
+#define VSIOCSFLAGS _IOW(VSCULL_IOC_MAGIC, 8, int)
+#define VSIOCGPLANES _IOR(VSCULL_IOC_MAGIC, 9, struct vscull_planes)
+#define VSIOCSPLANE _IOW(VSCULL_IOC_MAGIC, 10, int)
+#define VSIOCGPOOL  _IOR(VSCULL_IOC_MAGIC, 11, struct vscull_pool_stats)
+#define VSIOCGNUMA  _IOR(VSCULL_IOC_MAGIC, 12, struct vscull_numa)
+#define VSIOCSNUMA  _IOW(VSCULL_IOC_MAGIC, 13, int)
+#define VSIOCSIMPORT _IOW(VSCULL_IOC_MAGIC, 14, struct vscull_import)
+#define VSIOCPUBLISH _IO(VSCULL_IOC_MAGIC, 15)
+#define VSIOCBGSTATE _IOWR(VSCULL_IOC_MAGIC, 16, struct vscull_bulk)
+#define VSIOCBSPAR  _IOWR(VSCULL_IOC_MAGIC, 17, struct vscull_bulk)
+#define VSIOCGMEM   _IOR(VSCULL_IOC_MAGIC, 18, struct vscull_mem)
+#define VSIOCSMEM   _IOW(VSCULL_IOC_MAGIC, 19, unsigned long long)
+#define VSIOCSMOSAIC _IOW(VSCULL_IOC_MAGIC, 20, struct vscull_mosaic)
+#define VSIOCGMOSAIC _IOR(VSCULL_IOC_MAGIC, 21, struct vscull_mosaic)
+#define VSIOCSREGIONS _IOW(VSCULL_IOC_MAGIC, 22, struct vscull_regions)
+#define VSIOCGREGIONS _IOR(VSCULL_IOC_MAGIC, 23, struct vscull_regions)
+#define VSIOCSREGION _IOW(VSCULL_IOC_MAGIC, 24, int)
+#define VSIOCGFINFO _IOR(VSCULL_IOC_MAGIC, 25, struct vscull_frame_info)
+#define VSIOCBGSTATS _IOWR(VSCULL_IOC_MAGIC, 26, struct vscull_bulk)
+#define VSIOCSSKIP  _IOW(VSCULL_IOC_MAGIC, 27, int)
 
 
 #endif /* _VSCULL_IOCTL_H_ */
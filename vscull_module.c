@@ -21,9 +21,20 @@
 
 #include <linux/version.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include <linux/vmalloc.h>
 #include <linux/mm.h>
 #include <linux/time.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/err.h>
+#include <linux/wait.h>
+#include <linux/topology.h>
+#include <linux/pagemap.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
 #include <linux/videodev.h>
 #include <media/v4l2-common.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
@@ -33,12 +44,16 @@
 #include "vscull_ioctl.h"
 #include "vscull_palette.h"
 
+#ifndef NUMA_NO_NODE
+#define NUMA_NO_NODE    (-1)
+#endif
+
 /* module parameter */
 
 #define NDEVS    8          /* max. number of video devices allowed */
-#define MAXDEVS 256         /* max. minor for video devices */
+#define MAXDEVS VSCULL_MAXDEVS  /* max. minor for video devices */
 
-#define VIDEOFRAME_SIZE(w,h,d)       ((w*h*(d>>3)))
+#define VSCULL_FLAGS    (VSCULL_PLANAR|VSCULL_NOCACHE|VSCULL_CACHED|VSCULL_STREAM|VSCULL_HOLD|VSCULL_DEDUP)
 
 static unsigned int ndevs       = 1;
 static unsigned int fps         = 25; 
@@ -53,6 +68,14 @@ static unsigned int depth       = 32;
 static unsigned int palette     = 15;   // default: yuv 4:2:0 planar 
 static unsigned int debug       = 0;
 static unsigned int framebuf    = 1;
+static unsigned int qdepth      = 8;
+static unsigned int pool_max_kb = 65536;
+static unsigned int pool_trim_ms = 30000;
+static unsigned int idle_ms     = 60000;
+static unsigned int numa_migrate = 32;
+static unsigned int nocache_kb  = 1024;
+static unsigned int mem_budget_kb = 0;
+static unsigned int dev_mem_kb  = 0;
 
 /* v4l palettes available are defined in include/linux/videodev.h:
 
@@ -106,6 +129,30 @@ MODULE_PARM_DESC(debug, "debug level (0-4)");
 module_param(framebuf,uint,0);
 MODULE_PARM_DESC(debug, "framebuf (0-32)");
 
+module_param(qdepth,uint,0);
+MODULE_PARM_DESC(qdepth, "max. number of frames queued for scheduled presentation");
+
+module_param(pool_max_kb,uint,0);
+MODULE_PARM_DESC(pool_max_kb, "max. KB of frame buffers cached by the pool (0: no pool)");
+
+module_param(pool_trim_ms,uint,0);
+MODULE_PARM_DESC(pool_trim_ms, "release the pooled frame buffers unused for longer (ms, 0: never)");
+
+module_param(idle_ms,uint,0);
+MODULE_PARM_DESC(idle_ms, "release the frame of a device closed for longer (ms, 0: never)");
+
+module_param(numa_migrate,uint,0);
+MODULE_PARM_DESC(numa_migrate, "writes from another NUMA node before the frame follows the writer (0: never)");
+
+module_param(nocache_kb,uint,0);
+MODULE_PARM_DESC(nocache_kb, "frames written from this size on (KB) bypass the cache (0: never)");
+
+module_param(mem_budget_kb,uint,0);
+MODULE_PARM_DESC(mem_budget_kb, "max. KB of frame memory of all the devices (0: no limit)");
+
+module_param(dev_mem_kb,uint,0);
+MODULE_PARM_DESC(dev_mem_kb, "default max. KB of frame memory of a device (0: no limit, see VSIOCSMEM)");
+
 
 #define dprintk(num, format, args...) \
     do { \
@@ -114,18 +161,92 @@ MODULE_PARM_DESC(debug, "framebuf (0-32)");
     } while (0)
 
 
+/* frame pending presentation (VSIOCQFRAME) */
+
+struct vscull_qentry
+{
+    struct list_head list;
+    s64     pts;                // presentation time (ns, CLOCK_MONOTONIC)
+    size_t  size;
+    char    data[0];
+};
+
+
 struct vscull_device 
 {
     struct timeval timer_read;
     struct timeval timer_write;
 
     struct video_device *vd;    // video_device
-    char * frame;  
+    atomic_long_t mem;          // frame memory charged to the device (frames, stage, queue)
+    size_t mem_limit;           // max. frame memory (0: no limit)
+    char * frame;               // allocated on the first open, released when idle
     int    frame_size;
+    size_t frame_alloc;         // size of the buffer borrowed from the pool
+
+    struct page ** import_pages;    // pages of the producer memory used as the frame (VSIOCSIMPORT)
+    int    import_npages;
+
+    char * stage;               // frame being accumulated by streaming writes (VSCULL_STREAM)
+    size_t stage_alloc;
+    size_t wpos;                // bytes of the image accumulated
+
+    int    dvalid;              // the frame holds the last frame published: VSCULL_DEDUP compares with it
+    char * dbuf;                // VSCULL_DEDUP bounce page
+
+    int    openers;             // open files
+
+    int    numa_node;           // placement policy: node, or NUMA_NO_NODE to follow the writer
+    int    frame_node;          // node of the frame
+    int    numa_strikes;        // consecutive writes from another node
+    int    written;
+    int    writer_cpu;
+    int    reader_cpu;
+    struct delayed_work idle_work;
+
+    spinlock_t map_lock;        // mmap() vs frame reallocation (mmap_sem is held by mmap)
+    int    mapped;              // vmas mapping the frame
+    int    resizing;
 
     struct semaphore    sem;
 
-    struct completion   comp;
+    atomic_t            seq;        // frames published
+    wait_queue_head_t   fwait;      // readers waiting for a new frame
+
+    spinlock_t          flock;      // info of the last frame vs seq, statistics, files
+    s64                 fts;        // publication time of the last frame
+    unsigned int        frepeats;   // consecutive repeats of the last frame written
+    unsigned int        fflags;     // VSCULL_FRAME_* of the last frame
+    atomic_t            useq;       // last frame whose content changed
+    u64                 uframes;    // frames whose content changed
+    wait_queue_head_t   uwait;      // readers skipping the unchanged frames (VSIOCSSKIP)
+    s64                 wts;        // publication time of the last frame written
+    u64                 wframes;    // frames published by the writers
+    u64                 repeated;   // frames repeated
+    u64                 duplicates; // frames written identical to the previous one
+    u64                 rframes;    // frames seen by the readers
+    u64                 pace_err;   // sum of |interval - 1/fps| (nsec)
+    u64                 pace_n;
+    atomic_long_t       wbytes;
+    atomic_long_t       rbytes;
+    struct list_head    files;      // open files (struct vscull_fh)
+    struct hrtimer      htimer;     // VSCULL_HOLD: armed at each frame
+    struct work_struct  hwork;      // repeats the last frame
+
+    struct vscull_mosaic *mosaic;   // tiles fed by this device (master), or NULL
+    int                 master;     // minor of the master feeding this device, or -1
+
+    struct vscull_regions *regions; // regions written concurrently (composition), or NULL
+    struct rw_semaphore rsem;       // region writers (shared) vs composition changes
+    unsigned long       rpending;   // regions updated since the last frame (bitmask)
+    struct delayed_work rwork;      // VSCULL_TRIG_TIMER
+
+    struct list_head    queue;      // frames pending presentation, sorted by pts
+    int                 queued;
+    spinlock_t          qlock;
+    wait_queue_head_t   qwait;      // writers waiting for a free queue slot
+    struct hrtimer      qtimer;     // armed at the pts of the queue head
+    struct work_struct  qwork;      // presents the expired frames
 
     // int users;               // number of processes enabled to open the device concurrently (disabled)
     pid_t pid;                  // pid of the process booking this device (leak reservation: the device could be already opened)
@@ -143,149 +264,2165 @@ struct vscull_device
 
     int palette;
 
+    int flags;                  // VSCULL_* device flags
+
+    int nplanes;
+    struct vscull_plane plane[VSCULL_MAX_PLANES];
+    int image_size;             // size of the packed image, as accepted by read()/write()
+
 } * vscull_dev[MAXDEVS];            
 
 
-static char * vscull_alloc_video_frame(struct vscull_device *dev, int w, int h, int d)
+/* per open file */
+
+struct vscull_fh
+{
+    struct vscull_device *dev;
+    int plane;                  // plane returned by read() (-1: the whole frame)
+    unsigned int seq;           // last frame seen by this reader
+    int region;                 // region written by this file (-1: the whole frame)
+    struct vscull_frame_info info;  // last frame seen
+
+    struct list_head list;      // files of the device
+    unsigned int id;
+    pid_t pid;                  // opener
+    u64 frames;                 // frames seen
+    u64 drops;                  // frames published and not seen
+    int skip;                   // not woken by the unchanged frames (VSIOCSSKIP)
+    u64 uframes;                // changed frames published when last seen (skip)
+};
+
+
+static atomic_t vscull_file_id = ATOMIC_INIT(0);
+
+
+/* frame buffer pool: buffers released by the devices are cached by size class (4 classes
+   per power of two, up to 25% slack) and handed out again to the next allocation of the
+   same class, instead of a vfree()/vmalloc() pair. Buffers unused for pool_trim_ms are 
+   released by the trimmer. */
+
+#define POOL_CLASSES    128
+
+struct vscull_pool_buf
+{
+    struct list_head list;
+    void *  addr;
+    size_t  size;
+    int     node;
+    unsigned long stamp;        // jiffies at release
+};
+
+static struct vscull_pool
+{
+    struct mutex        lock;
+    struct list_head    free[POOL_CLASSES];     // most recently released first
+    size_t              cached;
+    unsigned int        buffers;
+    unsigned long       hits;
+    unsigned long       misses;
+    unsigned long       trims;
+} vscull_pool;
+
+static void vscull_pool_trim_fn(struct work_struct *w);
+static DECLARE_DELAYED_WORK(vscull_pool_trim_work, vscull_pool_trim_fn);
+
+
+static inline int vscull_buf_node(const void *addr)
+{
+    return page_to_nid(vmalloc_to_page(addr));
+}
+
+
+/* size class of a buffer: return the class index and the rounded size */
+static int vscull_pool_class(size_t size, size_t *csize)
+{
+    unsigned long pages = PAGE_ALIGN(size) >> PAGE_SHIFT;
+    int order, idx;
+
+    if (pages < 4) {
+        *csize = pages << PAGE_SHIFT;
+        return pages;
+    }
+
+    order = fls(pages) - 1;
+    pages = ALIGN(pages, 1UL << (order - 2));
+    idx   = (order - 1) * 4 + (pages >> (order - 2)) - 4;
+
+    *csize = pages << PAGE_SHIFT;
+    return idx;
+}
+
+
+static void * vscull_vmalloc(size_t size, int node)
+{
+    return (node == NUMA_NO_NODE) ? vmalloc(size) : vmalloc_node(size, node);
+}
+
+
+/* size of the buffer handed out by the pool for a frame of the given size */
+static size_t vscull_pool_size(size_t size)
+{
+    size_t csize;
+    int idx = vscull_pool_class(size, &csize);
+
+    return (pool_max_kb == 0 || idx >= POOL_CLASSES) ? PAGE_ALIGN(size) : csize;
+}
+
+
+/* borrow a buffer placed on the given node (NUMA_NO_NODE: any) */
+static void * vscull_pool_get(size_t size, int node, size_t *alloc)
+{
+    struct vscull_pool_buf *b = NULL, *pos;
+    void *addr;
+    int idx;
+
+    idx = vscull_pool_class(size, alloc);
+
+    if (pool_max_kb == 0 || idx >= POOL_CLASSES) {
+        *alloc = PAGE_ALIGN(size);
+        idx = -1;
+    }
+
+    mutex_lock(&vscull_pool.lock);
+    if (idx >= 0) {
+        list_for_each_entry(pos, &vscull_pool.free[idx], list) {
+            if (node == NUMA_NO_NODE || pos->node == node) {
+                b = pos;
+                break;
+            }
+        }
+    }
+    if (b) {
+        list_del(&b->list);
+        vscull_pool.cached -= b->size;
+        vscull_pool.buffers--;
+        vscull_pool.hits++;
+    }
+    else
+        vscull_pool.misses++;
+    mutex_unlock(&vscull_pool.lock);
+
+    if (b) {
+        addr = b->addr;
+        kfree(b);
+    }
+    else {
+        addr = vscull_vmalloc(*alloc, node);
+        if (addr == NULL)
+            return NULL;
+    }
+
+    /* frames are mapped to user-space: never expose stale data */
+    memset(addr, 0, *alloc);
+    return addr;
+}
+
+
+static void vscull_pool_put(void *addr, size_t size)
+{
+    struct vscull_pool_buf *b;
+    size_t csize;
+    int idx;
+
+    if (addr == NULL)
+        return;
+
+    idx = vscull_pool_class(size, &csize);
+
+    if (csize != size || idx >= POOL_CLASSES || 
+        (b = kmalloc(sizeof(struct vscull_pool_buf), GFP_KERNEL)) == NULL) {
+        vfree(addr);
+        return;
+    }
+
+    b->addr  = addr;
+    b->size  = size;
+    b->node  = vscull_buf_node(addr);
+    b->stamp = jiffies;
+
+    mutex_lock(&vscull_pool.lock);
+    if (vscull_pool.cached + size > (size_t)pool_max_kb << 10) {
+        mutex_unlock(&vscull_pool.lock);
+        kfree(b);
+        vfree(addr);
+        return;
+    }
+    list_add(&b->list, &vscull_pool.free[idx]);
+    vscull_pool.cached += size;
+    vscull_pool.buffers++;
+    mutex_unlock(&vscull_pool.lock);
+
+    if (pool_trim_ms)
+        schedule_delayed_work(&vscull_pool_trim_work, msecs_to_jiffies(pool_trim_ms));
+}
+
+
+/* release the buffers idle for longer than pool_trim_ms (all of them, if force) */
+static void vscull_pool_trim(int force)
+{
+    struct vscull_pool_buf *b, *tmp;
+    unsigned long expire = jiffies - msecs_to_jiffies(pool_trim_ms);
+    LIST_HEAD(drop);
+    int i, left;
+
+    mutex_lock(&vscull_pool.lock);
+    for(i = 0; i < POOL_CLASSES; i++) {
+        list_for_each_entry_safe(b, tmp, &vscull_pool.free[i], list) {
+            if (!force && time_after(b->stamp, expire))
+                continue;
+            list_move(&b->list, &drop);
+            vscull_pool.cached -= b->size;
+            vscull_pool.buffers--;
+            vscull_pool.trims++;
+        }
+    }
+    left = vscull_pool.buffers;
+    mutex_unlock(&vscull_pool.lock);
+
+    list_for_each_entry_safe(b, tmp, &drop, list) {
+        vfree(b->addr);
+        kfree(b);
+    }
+
+    if (left && !force)
+        schedule_delayed_work(&vscull_pool_trim_work, msecs_to_jiffies(pool_trim_ms));
+}
+
+
+static void vscull_pool_trim_fn(struct work_struct *w)
+{
+    vscull_pool_trim(0);
+}
+
+
+static void vscull_pool_init(void)
+{
+    int i;
+
+    mutex_init(&vscull_pool.lock);
+    for(i = 0; i < POOL_CLASSES; i++)
+        INIT_LIST_HEAD(&vscull_pool.free[i]);
+}
+
+
+static void vscull_pool_release(void)
+{
+    cancel_delayed_work_sync(&vscull_pool_trim_work);
+    vscull_pool_trim(1);
+
+    printk(KERN_INFO "vscull: frame pool: %lu hits, %lu misses, %lu trimmed\n", 
+                      vscull_pool.hits, vscull_pool.misses, vscull_pool.trims);
+}
+
+
+/* frame memory budget: the memory of the frames, of the stage and of the queued frames is
+   charged to the device (mem_limit) and to the module (mem_budget_kb) before it is 
+   allocated. Buffers cached by the pool are not charged: they are capped by pool_max_kb. */
+
+static atomic_long_t vscull_mem_used = ATOMIC_LONG_INIT(0);
+
+static int vscull_mem_charge(struct vscull_device *sd, size_t size)
+{
+    long used;
+
+    used = atomic_long_add_return(size, &sd->mem);
+    if (sd->mem_limit && (size_t)used > sd->mem_limit) {
+        atomic_long_sub(size, &sd->mem);
+        printk(KERN_INFO "vscull: /dev/video%d: frame memory over the device limit (%lu/%lu KB)\n",
+                          sd->vd ? sd->vd->minor : -1, (used >> 10), (unsigned long)(sd->mem_limit >> 10));
+        return -EDQUOT;
+    }
+
+    used = atomic_long_add_return(size, &vscull_mem_used);
+    if (mem_budget_kb && used > ((long)mem_budget_kb << 10)) {
+        atomic_long_sub(size, &vscull_mem_used);
+        atomic_long_sub(size, &sd->mem);
+        printk(KERN_INFO "vscull: frame memory over the budget (%lu/%u KB)\n", (used >> 10), mem_budget_kb);
+        return -EDQUOT;
+    }
+    return 0;
+}
+
+
+static void vscull_mem_uncharge(struct vscull_device *sd, size_t size)
+{
+    atomic_long_sub(size, &sd->mem);
+    atomic_long_sub(size, &vscull_mem_used);
+}
+
+
+/* borrow a frame buffer for the device (sem held): 0, -EDQUOT (over budget) or -ENOMEM */
+static int vscull_frame_get(struct vscull_device *sd, int node, char **addr, size_t *alloc)
+{
+    size_t size = vscull_pool_size(sd->frame_size);
+    int ret;
+
+    ret = vscull_mem_charge(sd, size);
+    if (ret < 0)
+        return ret;
+
+    *addr = vscull_pool_get(sd->frame_size, node, alloc);
+    if (*addr == NULL) {
+        vscull_mem_uncharge(sd, size);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+
+static void vscull_frame_put(struct vscull_device *sd, char *addr, size_t alloc)
+{
+    if (addr == NULL)
+        return;
+
+    vscull_pool_put(addr, alloc);
+    vscull_mem_uncharge(sd, alloc);
+}
+
+
+/* frames queued for presentation are charged as well */
+static struct vscull_qentry * vscull_qentry_alloc(struct vscull_device *sd, size_t size)
+{
+    struct vscull_qentry *e;
+    int ret;
+
+    ret = vscull_mem_charge(sd, sizeof(*e) + size);
+    if (ret < 0)
+        return ERR_PTR(ret);
+
+    e = vscull_vmalloc(sizeof(*e) + size, NUMA_NO_NODE);
+    if (e == NULL) {
+        vscull_mem_uncharge(sd, sizeof(*e) + size);
+        return ERR_PTR(-ENOMEM);
+    }
+    e->size = size;
+    return e;
+}
+
+
+static void vscull_qentry_free(struct vscull_device *sd, struct vscull_qentry *e)
+{
+    vscull_mem_uncharge(sd, sizeof(*e) + e->size);
+    vfree(e);
+}
+
+
+/* compute the plane layout of the frame from the palette descriptor (see vscull_palette.h):
+   planar palettes are split in Y, U and V; with VSCULL_PLANAR each plane starts on a page 
+   boundary, so that it can be mmapped and read on its own. Return the extent of the frame,
+   or -E2BIG if it exceeds VSCULL_MAX_FRAME (the layout is then to be computed again). */
+
+static long vscull_frame_layout(struct vscull_device *dev)
+{
+    const struct vscull_format *fmt = PALETTE_FORMAT(dev->palette);
+    size_t stride[VSCULL_MAX_PLANES], rows[VSCULL_MAX_PLANES];
+    size_t off = 0, image = 0;
+    int n;
+
+    memset(dev->plane, 0, sizeof(dev->plane));
+
+    dev->nplanes    = fmt->nplanes;
+    dev->image_size = 0;
+
+    /* sizes are bounded before they are multiplied: a geometry can't overflow the frame */
+
+    if (dev->width <= 0 || dev->height <= 0)
+        return 0;
+
+    if (dev->nplanes == 1) {
+        size_t bpp = fmt->bpp ? fmt->bpp : dev->depth;
+        if (bpp && (size_t)dev->width > ((size_t)VSCULL_MAX_FRAME << 3) / bpp)
+            return -E2BIG;
+        stride[0] = DIV_ROUND_UP(dev->width * bpp, 8);
+        rows[0]   = dev->height;
+    }
+    else {
+        stride[0] = dev->width;
+        rows[0]   = dev->height;
+
+        for(n = 1; n < dev->nplanes; n++) {
+            stride[n] = DIV_ROUND_UP((size_t)dev->width, 1 << fmt->hsub);
+            rows[n]   = DIV_ROUND_UP((size_t)dev->height, 1 << fmt->vsub);
+        }
+    }
+
+    for(n = 0; n < dev->nplanes; n++) {
+        if (stride[n] > VSCULL_MAX_FRAME || (stride[n] && rows[n] > VSCULL_MAX_FRAME / stride[n]))
+            return -E2BIG;
+        if (dev->flags & VSCULL_PLANAR)
+            off = PAGE_ALIGN(off);
+        off   += stride[n] * rows[n];
+        image += stride[n] * rows[n];
+        if (off > VSCULL_MAX_FRAME)
+            return -E2BIG;
+    }
+
+    for(off = 0, n = 0; n < dev->nplanes; n++) {
+        if (dev->flags & VSCULL_PLANAR)
+            off = PAGE_ALIGN(off);
+        dev->plane[n].stride = stride[n];
+        dev->plane[n].size   = stride[n] * rows[n];
+        dev->plane[n].offset = off;
+        off += dev->plane[n].size;
+    }
+    dev->image_size = image;
+
+    return off;
+}
+
+
+/* node where the frame is to be placed: the policy node or, if the frame follows the writer,
+   the node of the last writer (NUMA_NO_NODE: local to the caller) */
+static int vscull_frame_node(struct vscull_device *dev)
 {
-    dev->width  = w;
-    dev->height = h;
-    dev->depth  = d;
+    if (dev->numa_node != NUMA_NO_NODE)
+        return dev->numa_node;
+
+    return dev->writer_cpu < 0 ? NUMA_NO_NODE : cpu_to_node(dev->writer_cpu);
+}
 
-    vfree(dev->frame);
-    dev->frame_size = 0;
 
-    dev->frame = vmalloc( (VIDEOFRAME_SIZE(dev->width, dev->height, dev->depth )/PAGE_SIZE + 1)*PAGE_SIZE );
+/* allocate the frame on demand (sem held) */
+static int vscull_alloc_video_frame(struct vscull_device *dev)
+{
+    int ret;
 
     if (dev->frame)
-        dev->frame_size = (VIDEOFRAME_SIZE(dev->width, dev->height, dev->depth)/PAGE_SIZE + 1)*PAGE_SIZE; // mmap() maps multiple of PAGE_SIZE
+        return 0;
+
+    ret = vscull_frame_get(dev, vscull_frame_node(dev), &dev->frame, &dev->frame_alloc);
+    dev->frame_node = dev->frame ? vscull_buf_node(dev->frame) : NUMA_NO_NODE;
     
-    printk(KERN_INFO "vscull: alloc_video_frame(%p): w=%d, h=%d, d=%d (size=%d bytes)\n", dev->frame, w, h, d, dev->frame_size); 
-    return dev->frame;
+    dprintk(1, KERN_INFO "vscull: alloc_video_frame(%p): w=%d, h=%d, d=%d, p=%d (size=%d bytes, node=%d)\n", dev->frame, 
+                      dev->width, dev->height, dev->depth, dev->palette, dev->frame_size, dev->frame_node); 
+
+    return ret;
 }
 
 
-static void vscull_sleep(int fps, struct timeval * timer)
+static void vscull_free_stage(struct vscull_device *dev)
 {
-    if (fps > 0 ) {
+    vscull_frame_put(dev, dev->stage, dev->stage_alloc);
+    dev->stage = NULL;
+    dev->stage_alloc = 0;
+    dev->wpos = 0;
+}
 
-        struct timeval now;
-        int wait_time;
-        int msec;
 
-        do_gettimeofday(&now);
+static void vscull_free_video_frame(struct vscull_device *dev)
+{
+    int i;
 
-        msec = (now.tv_sec-timer->tv_sec)*1000 + (now.tv_usec - timer->tv_usec)/1000;
+    if (dev->import_pages) {
+        vunmap(dev->frame);
+        for(i = 0; i < dev->import_npages; i++) {
+            set_page_dirty_lock(dev->import_pages[i]);
+            put_page(dev->import_pages[i]);
+        }
+        vfree(dev->import_pages);
+        dev->import_pages  = NULL;
+        dev->import_npages = 0;
+    }
+    else
+        vscull_frame_put(dev, dev->frame, dev->frame_alloc);
 
-        wait_time = HZ/fps - msecs_to_jiffies(msec);
+    dev->frame = NULL;
+    dev->frame_alloc = 0;
+    dev->frame_node = NUMA_NO_NODE;
+    dev->dvalid = 0;
 
-        if (wait_time>0) {
+    vscull_free_stage(dev);
+}
 
-            set_current_state(TASK_INTERRUPTIBLE);
-            schedule_timeout(wait_time);   
 
-            timer->tv_usec += 1000000/fps;
-            if ( timer->tv_usec > 1000000 ) {
-                timer->tv_sec  += 1;
-                timer->tv_usec -= 1000000;
-            }
+/* set the geometry of the device: the frame is released and, if the device is in use, 
+   allocated again with the new layout (otherwise on the next open) */
+
+static int vscull_set_geometry(struct vscull_device *dev, int w, int h, int d, int p)
+{
+    int ow = dev->width, oh = dev->height, od = dev->depth, op = dev->palette;
+    long extent;
+
+    dev->width   = w;
+    dev->height  = h;
+    dev->depth   = d;
+    dev->palette = p;
+
+    /* a frame too large is refused before the current one is released */
+    extent = vscull_frame_layout(dev);
+    if (extent < 0) {
+        printk(KERN_INFO "vscull: %dx%d (depth %d, palette %d): frame larger than %d bytes\n", w, h, d, p, VSCULL_MAX_FRAME);
+        dev->width   = ow;
+        dev->height  = oh;
+        dev->depth   = od;
+        dev->palette = op;
+        vscull_frame_layout(dev);
+        return extent;
+    }
+
+    vscull_free_video_frame(dev);
+
+    dev->frame_size = PAGE_ALIGN(max_t(long, extent, 1)); // mmap() maps multiple of PAGE_SIZE
+
+    return dev->openers ? vscull_alloc_video_frame(dev) : 0;
+}
+
+
+static void vscull_idle_fn(struct work_struct *w)
+{
+    struct vscull_device *sd = container_of(w, struct vscull_device, idle_work.work);
+
+    down(&sd->sem);
+
+    if (sd->openers == 0 && sd->queued == 0 && sd->frame) {
+
+        /* mappings outlive the file: the frame is released once unmapped */
+        spin_lock(&sd->map_lock);
+        if (sd->mapped) {
+            spin_unlock(&sd->map_lock);
+            up(&sd->sem);
+            schedule_delayed_work(&sd->idle_work, msecs_to_jiffies(idle_ms));
             return;
         }
+        sd->resizing = 1;
+        spin_unlock(&sd->map_lock);
 
-        /* we lost the temporal reference */
-        do_gettimeofday(timer);
-       
+        vscull_free_video_frame(sd);
+
+        spin_lock(&sd->map_lock);
+        sd->resizing = 0;
+        spin_unlock(&sd->map_lock);
+
+        dprintk(1, KERN_INFO "vscull: /dev/video%d idle, frame released.\n", sd->vd->minor);
     }
+
+    up(&sd->sem);
 }
 
 
-static int vscull_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg) 
-{   
-    struct vscull_device * sd = (struct vscull_device *)file->private_data;
+/* realloc the frame of a configured device (sem held): pages mapped by user-space can't be
+   handed back to the pool, so the geometry can't change while the frame is mmapped */
 
-    switch(cmd) {
+static int vscull_realloc_video_frame(struct vscull_device *sd, int w, int h, int d, int p)
+{
+    int ret;
 
-    case VSIOCGPAR: /* specific vscull ioctl */
-        {   
-            struct vscull_ioctl par;
+    if (sd->regions) {
+        printk(KERN_INFO "vscull: /dev/video%d: frame is composed, can't change geometry\n", sd->vd->minor);
+        return -EBUSY;
+    }
 
-            if ( down_interruptible(&sd->sem) )
-                     return -ERESTARTSYS;
+    spin_lock(&sd->map_lock);
+    if (sd->mapped) {
+        spin_unlock(&sd->map_lock);
+        printk(KERN_INFO "vscull: /dev/video%d: frame is mmapped, can't change geometry\n", sd->vd->minor);
+        return -EBUSY;
+    }
+    sd->resizing = 1;
+    spin_unlock(&sd->map_lock);
 
-            par.width   = sd->width;
-            par.height  = sd->height;
-            par.depth   = sd->depth;
-            par.palette = sd->palette;
-            par.fps     = sd->fps;
+    ret = vscull_set_geometry(sd, w, h, d, p);
 
-            up(&sd->sem);
+    spin_lock(&sd->map_lock);
+    sd->resizing = 0;
+    spin_unlock(&sd->map_lock);
 
-            if ( copy_to_user((void __user *)arg, &par, sizeof(par)) )
-                return -EFAULT;
+    if ( ret < 0 ) {
+        printk (KERN_INFO "vscull: Couldn't allocate video frame.\n");
+        return ret;
+    }
 
-            dprintk(1, KERN_INFO "vscull: VSIOCGPAR successfully called\n"); 
+    return 0;
+}
+
+
+/* use the pages of a producer's shared memory (an mmapped memfd, shm segment or file) as the 
+   frame: the pages stay pinned until the frame is released, so that the producer renders in 
+   place, VSIOCPUBLISH only signals the readers and mmap() maps the same pages (sem held) */
+
+static int vscull_import_video_frame(struct vscull_device *sd, unsigned long addr, unsigned long size)
+{
+    struct page **pages;
+    int n = sd->frame_size >> PAGE_SHIFT;
+    int got, i, ret = -EFAULT;
+    void *frame = NULL;
+
+    if ((addr & ~PAGE_MASK) || size < sd->frame_size)
+        return -EINVAL;
+
+    if (sd->regions)
+        return -EBUSY;
+
+    pages = vmalloc(n * sizeof(struct page *));
+    if (pages == NULL)
+        return -ENOMEM;
+
+    down_read(&current->mm->mmap_sem);
+    got = get_user_pages(current, current->mm, addr, n, 1, 0, pages, NULL);
+    up_read(&current->mm->mmap_sem);
+
+    if (got < n)
+        goto fail;
+
+    frame = vmap(pages, n, VM_MAP, PAGE_KERNEL);
+    if (frame == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    spin_lock(&sd->map_lock);
+    if (sd->mapped) {
+        spin_unlock(&sd->map_lock);
+        vunmap(frame);
+        ret = -EBUSY;
+        goto fail;
+    }
+    sd->resizing = 1;
+    spin_unlock(&sd->map_lock);
+
+    vscull_free_video_frame(sd);
+
+    sd->frame         = frame;
+    sd->import_pages  = pages;
+    sd->import_npages = n;
+    sd->frame_node    = page_to_nid(pages[0]);
+
+    spin_lock(&sd->map_lock);
+    sd->resizing = 0;
+    spin_unlock(&sd->map_lock);
+
+    dprintk(1, KERN_INFO "vscull: /dev/video%d frame imported (%d pages)\n", sd->vd->minor, n);
+    return 0;
+
+fail:
+    for(i = 0; i < got; i++)
+        put_page(pages[i]);
+    vfree(pages);
+    return ret;
+}
+
+
+/* back to a private frame (sem held) */
+static int vscull_unimport_video_frame(struct vscull_device *sd)
+{
+    if (sd->import_pages == NULL)
+        return 0;
+
+    if (sd->regions)
+        return -EBUSY;
+
+    spin_lock(&sd->map_lock);
+    if (sd->mapped) {
+        spin_unlock(&sd->map_lock);
+        return -EBUSY;
+    }
+    sd->resizing = 1;
+    spin_unlock(&sd->map_lock);
+
+    vscull_free_video_frame(sd);
+
+    spin_lock(&sd->map_lock);
+    sd->resizing = 0;
+    spin_unlock(&sd->map_lock);
+
+    return sd->openers ? vscull_alloc_video_frame(sd) : 0;
+}
+
+
+/* move the frame, with its content, to another NUMA node (sem held) */
+static int vscull_migrate_video_frame(struct vscull_device *sd, int node)
+{
+    char *frame = NULL;
+    size_t alloc;
+    int ret;
+
+    if (sd->frame == NULL)
+        return 0;
+
+    /* imported pages belong to the producer, region writers don't take sem */
+    if (sd->import_pages || sd->regions)
+        return -EBUSY;
+
+    spin_lock(&sd->map_lock);
+    if (sd->mapped) {
+        spin_unlock(&sd->map_lock);
+        return -EBUSY;
+    }
+    sd->resizing = 1;
+    spin_unlock(&sd->map_lock);
+
+    ret = vscull_frame_get(sd, node, &frame, &alloc);
+    if (ret == 0) {
+        memcpy(frame, sd->frame, sd->frame_size);
+        vscull_frame_put(sd, sd->frame, sd->frame_alloc);
+        sd->frame       = frame;
+        sd->frame_alloc = alloc;
+        sd->frame_node  = vscull_buf_node(frame);
+    }
+
+    spin_lock(&sd->map_lock);
+    sd->resizing = 0;
+    spin_unlock(&sd->map_lock);
+
+    dprintk(1, KERN_INFO "vscull: /dev/video%d frame migrated to node %d\n", sd->vd->minor, sd->frame_node);
+    return ret;
+}
+
+
+/* the frame follows the writer: it moves to the writer's node on the first write and after
+   numa_migrate consecutive writes from that node (a mmapped frame can't move) */
+
+static void vscull_numa_follow(struct vscull_device *sd)
+{
+    int cpu  = raw_smp_processor_id();
+    int node = cpu_to_node(cpu);
+
+    sd->writer_cpu = cpu;
+
+    if (sd->numa_node != NUMA_NO_NODE || numa_migrate == 0 || node == sd->frame_node) {
+        sd->numa_strikes = 0;
+        sd->written = 1;
+        return;
+    }
+
+    if (sd->written && ++sd->numa_strikes < numa_migrate)
+        return;
+
+    sd->numa_strikes = 0;
+    sd->written = 1;
+    vscull_migrate_video_frame(sd, node);
+}
+
+
+/* map an offset of the packed image onto the frame: return the address and the 
+   number of contiguous bytes available from there */
+
+static char * vscull_frame_addr(struct vscull_device *sd, char *frame, size_t pos, size_t *len)
+{
+    int n;
+
+    if (!(sd->flags & VSCULL_PLANAR)) {
+        *len = sd->image_size - pos;
+        return frame + pos;
+    }
+
+    for(n = 0; n < sd->nplanes; n++) {
+        if (pos < sd->plane[n].size) {
+            *len = sd->plane[n].size - pos;
+            return frame + sd->plane[n].offset + pos;
+        }
+        pos -= sd->plane[n].size;
+    }
+
+    *len = 0;
+    return NULL;
+}
+
+
+/* frames are not touched by the kernel once written: large frames are copied with non-temporal
+   stores, not to evict the working set of the producer and the consumers from the LLC. 
+   VSCULL_NOCACHE and VSCULL_CACHED force either mode. */
+
+static inline int vscull_nocache(struct vscull_device *sd)
+{
+    if (sd->flags & VSCULL_CACHED)
+        return 0;
+    if (sd->flags & VSCULL_NOCACHE)
+        return 1;
+    return nocache_kb && sd->image_size >= (nocache_kb << 10);
+}
+
+
+static int vscull_copy_from_user(struct vscull_device *sd, char *frame, size_t pos, const char __user *buf, size_t count)
+{
+#ifdef ARCH_HAS_NOCACHE_UACCESS
+    int nocache = vscull_nocache(sd);
+
+    if (nocache && !access_ok(VERIFY_READ, buf, count))
+        return -EFAULT;
+#endif
+
+    while (count > 0) {
+        size_t len;
+        char *p = vscull_frame_addr(sd, frame, pos, &len);
+        if (p == NULL)
+            return -EINVAL;
+
+        len = min(len, count);
+#ifdef ARCH_HAS_NOCACHE_UACCESS
+        if (nocache) {
+            if (__copy_from_user_nocache(p, buf, len))
+                return -EFAULT;
+        }
+        else
+#endif
+        if (copy_from_user(p, buf, len))
+            return -EFAULT;
+
+        buf += len; pos += len; count -= len;
+    }
+    return 0;
+}
+
+
+static int vscull_copy_to_user(struct vscull_device *sd, char *frame, size_t pos, char __user *buf, size_t count)
+{
+    while (count > 0) {
+        size_t len;
+        char *p = vscull_frame_addr(sd, frame, pos, &len);
+        if (p == NULL)
+            return -EINVAL;
+
+        len = min(len, count);
+        if (copy_to_user(buf, p, len))
+            return -EFAULT;
+
+        buf += len; pos += len; count -= len;
+    }
+    return 0;
+}
+
+
+static void vscull_copy_frame(struct vscull_device *sd, char *frame, const char *buf, size_t count)
+{
+    size_t pos = 0;
+
+    while (count > 0) {
+        size_t len;
+        char *p = vscull_frame_addr(sd, frame, pos, &len);
+        if (p == NULL)
+            return;
+
+        len = min(len, count);
+        memcpy(p, buf, len);
+
+        buf += len; pos += len; count -= len;
+    }
+}
+
+
+/* duplicate suppression (VSCULL_DEDUP): the payload is compared with the frame last published
+   a page at a time, through a bounce page, and written from the first page that differs. An
+   unchanged payload is not written at all. Returns 1 if the payload is the frame (sem held) */
+
+static int vscull_copy_changed(struct vscull_device *sd, const char __user *buf, size_t count)
+{
+    size_t pos = 0, len;
+    char *p;
+
+    if (!sd->dvalid)
+        goto copy;
+
+    if (sd->dbuf == NULL && (sd->dbuf = (char *)__get_free_page(GFP_KERNEL)) == NULL)
+        goto copy;
+
+    while (pos < count) {
+        p = vscull_frame_addr(sd, sd->frame, pos, &len);
+        if (p == NULL)
+            return -EINVAL;
+
+        len = min_t(size_t, min(len, count - pos), PAGE_SIZE);
+        if (copy_from_user(sd->dbuf, buf + pos, len))
+            return -EFAULT;
+
+        if (memcmp(sd->dbuf, p, len)) {
+            memcpy(p, sd->dbuf, len);
+            pos += len;
+            goto copy;
+        }
+        pos += len;
+    }
+    return 1;
+
+copy:
+    return vscull_copy_from_user(sd, sd->frame, pos, buf + pos, count - pos);
+}
+
+
+/* the images of two frames are the same (VSCULL_DEDUP, streaming writes) */
+static int vscull_frame_same(struct vscull_device *sd, char *a, char *b)
+{
+    size_t pos = 0, len;
+    char *p;
+
+    while (pos < sd->image_size) {
+        p = vscull_frame_addr(sd, a, pos, &len);
+        if (p == NULL)
+            break;
+        if (memcmp(p, b + (p - a), len))
+            return 0;
+        pos += len;
+    }
+    return 1;
+}
+
+
+static void vscull_sleep(int fps, struct timeval * timer)
+{
+    if (fps > 0 ) {
+
+        struct timeval now;
+        int wait_time;
+        int msec;
+
+        do_gettimeofday(&now);
+
+        msec = (now.tv_sec-timer->tv_sec)*1000 + (now.tv_usec - timer->tv_usec)/1000;
+
+        wait_time = HZ/fps - msecs_to_jiffies(msec);
+
+        if (wait_time>0) {
+
+            set_current_state(TASK_INTERRUPTIBLE);
+            schedule_timeout(wait_time);   
+
+            timer->tv_usec += 1000000/fps;
+            if ( timer->tv_usec > 1000000 ) {
+                timer->tv_sec  += 1;
+                timer->tv_usec -= 1000000;
+            }
+            return;
+        }
+
+        /* we lost the temporal reference */
+        do_gettimeofday(timer);
+       
+    }
+}
+
+
+/* hold mode (VSCULL_HOLD): the timer is armed one frame period and a half after each frame
+   written, one period after each repeat; when it fires the work publishes the last frame 
+   again, flagged as a repeat, until the writer resumes or the last file is closed. */
+
+static void vscull_hold_arm(struct vscull_device *sd, int halves)
+{
+    int fps = sd->fps;
+
+    if ((sd->flags & VSCULL_HOLD) && fps > 0)
+        hrtimer_start(&sd->htimer, ns_to_ktime(halves * (NSEC_PER_SEC / 2 / fps)), HRTIMER_MODE_REL);
+}
+
+
+/* publish a frame: flags (VSCULL_FRAME_*) mark a frame identical to the previous one, which
+   doesn't wake the readers skipping the unchanged frames */
+
+static void vscull_frame_out(struct vscull_device *sd, int flags)
+{
+    s64 now = ktime_to_ns(ktime_get()), err;
+    int fps = sd->fps;
+    unsigned int seq;
+
+    spin_lock(&sd->flock);
+    if (flags & VSCULL_FRAME_REPEAT)
+        sd->repeated++;
+    else {
+        /* pacing: distance of the interval between frames written from the period */
+        if (fps > 0 && sd->wframes) {
+            err = now - sd->wts - NSEC_PER_SEC / fps;
+            sd->pace_err += err < 0 ? -err : err;
+            sd->pace_n++;
+        }
+        sd->wts = now;
+        sd->wframes++;
+        if (flags & VSCULL_FRAME_DUP)
+            sd->duplicates++;
+    }
+    sd->fts      = now;
+    sd->fflags   = flags;
+    sd->frepeats = (flags & VSCULL_FRAME_REPEAT) ? sd->frepeats + 1 : 0;
+    if (!flags)
+        sd->uframes++;
+    smp_wmb();  /* the frame before the sequence */
+    seq = atomic_inc_return(&sd->seq);
+    if (!flags)
+        atomic_set(&sd->useq, seq);
+    spin_unlock(&sd->flock);
+
+    wake_up_interruptible_all(&sd->fwait);
+    if (!flags)
+        wake_up_interruptible_all(&sd->uwait);
+
+    vscull_hold_arm(sd, (flags & VSCULL_FRAME_REPEAT) ? 2 : 3);
+}
+
+
+/* wake up the readers waiting for a new frame */
+static void vscull_mosaic_feed(struct vscull_device *sd, int flags);
+
+static void vscull_publish_frame(struct vscull_device *sd, int flags)
+{
+    vscull_frame_out(sd, flags);
+
+    if (sd->mosaic)
+        vscull_mosaic_feed(sd, flags);
+}
+
+
+static enum hrtimer_restart vscull_htimer_fn(struct hrtimer *t)
+{
+    struct vscull_device *sd = container_of(t, struct vscull_device, htimer);
+
+    schedule_work(&sd->hwork);
+    return HRTIMER_NORESTART;
+}
+
+
+/* repeats are not fed to the mosaic: children in hold mode repeat on their own */
+static void vscull_hwork_fn(struct work_struct *w)
+{
+    struct vscull_device *sd = container_of(w, struct vscull_device, hwork);
+    int fps = sd->fps;
+    s64 last;
+
+    if (!(sd->flags & VSCULL_HOLD) || fps <= 0 || atomic_read(&sd->seq) == 0 || sd->openers == 0)
+        return;
+
+    spin_lock(&sd->flock);
+    last = sd->fts;
+    spin_unlock(&sd->flock);
+
+    /* the writer resumed while the work was pending */
+    if (ktime_to_ns(ktime_get()) - last < NSEC_PER_SEC / 2 / fps)
+        return;
+
+    vscull_frame_out(sd, VSCULL_FRAME_REPEAT);
+}
+
+
+/* mosaic: the frames of a master device are sliced into tiles, each one published by a
+   child device with its own geometry (the size of the tile), sequence and readers. Tiles
+   are copied row by row, once per frame, when the master publishes. Master and children
+   share the palette; a tile that doesn't fit the master any longer (reconfigured devices)
+   is skipped. Children are fed by the master only: writes to them are refused (EBUSY). */
+
+static DEFINE_MUTEX(vscull_mosaic_lock);    /* master/children relations */
+
+/* rectangles of a frame (mosaic tiles, composition regions): the corner must be aligned
+   to the chroma subsampling and to the macropixels, pixels must be whole bytes and the 
+   rectangle must fit the frame. Return the alignment (pixels), or -EINVAL. */
+
+static int vscull_rect_check(struct vscull_device *sd, int x, int y, int w, int h, int *ya)
+{
+    const struct vscull_format *fmt = PALETTE_FORMAT(sd->palette);
+    int bpp = fmt->bpp ? fmt->bpp : sd->depth;
+    int xa = 1;
+
+    *ya = 1;
+
+    if (fmt->nplanes == 1 && (bpp == 0 || bpp % 8))     /* packed 4:2:0/4:1:1, raw */
+        return -EINVAL;
+
+    if (fmt->nplanes > 1) {
+        xa  = 1 << fmt->hsub;
+        *ya = 1 << fmt->vsub;
+    }
+    else if (sd->palette == VIDEO_PALETTE_YUV422 || sd->palette == VIDEO_PALETTE_YUYV || sd->palette == VIDEO_PALETTE_UYVY)
+        xa = 2;                                         /* macropixels */
+
+    if (x < 0 || y < 0 || w <= 0 || h <= 0 || x % xa || y % *ya || x + w > sd->width || y + h > sd->height)
+        return -EINVAL;
+
+    return xa;
+}
+
+
+/* a w x h rectangle at (x, y) in plane n: bytes per row, rows and offset of the corner */
+static size_t vscull_rect_plane(struct vscull_device *sd, int n, int x, int y, int w, int h, int *rows, size_t *off)
+{
+    const struct vscull_format *fmt = PALETTE_FORMAT(sd->palette);
+    int bpp = fmt->nplanes > 1 ? 8 : (fmt->bpp ? fmt->bpp : sd->depth);
+    int hs  = n ? fmt->hsub : 0, vs = n ? fmt->vsub : 0;
+
+    *rows = DIV_ROUND_UP(h, 1 << vs);
+    *off  = sd->plane[n].offset + (y >> vs) * sd->plane[n].stride + (x >> hs) * bpp / 8;
+    return DIV_ROUND_UP(w, 1 << hs) * bpp / 8;
+}
+
+
+/* check a tile against the master (both sems held): 0 or -EINVAL */
+static int vscull_tile_check(struct vscull_device *m, struct vscull_device *c, int x, int y)
+{
+    int ya;
+
+    if (c->palette != m->palette || c->depth != m->depth || c->nplanes != m->nplanes)
+        return -EINVAL;
+
+    return vscull_rect_check(m, x, y, c->width, c->height, &ya) < 0 ? -EINVAL : 0;
+}
+
+
+/* copy a tile from the master frame (both sems held) */
+static void vscull_tile_copy(struct vscull_device *m, struct vscull_device *c, int x, int y)
+{
+    int n, r, rows;
+    size_t len, off;
+
+    for(n = 0; n < m->nplanes; n++) {
+        const char *src;
+        char *dst = c->frame + c->plane[n].offset;
+
+        len = vscull_rect_plane(m, n, x, y, c->width, c->height, &rows, &off);
+        src = m->frame + off;
+
+        for(r = 0; r < rows; r++) {
+            memcpy(dst, src, len);
+            src += m->plane[n].stride;
+            dst += c->plane[n].stride;
+        }
+    }
+}
+
+
+static void vscull_mosaic_feed(struct vscull_device *sd, int flags)
+{
+    struct vscull_device *c;
+    int i;
+
+    down(&sd->sem);
+
+    for(i = 0; sd->mosaic && sd->frame && i < sd->mosaic->count; i++) {
+        const struct vscull_tile *t = &sd->mosaic->tile[i];
+
+        c = vscull_dev[t->minor];
+        down(&c->sem);
+
+        if (c->openers == 0) {      /* nobody to publish to */
+            up(&c->sem);
+            continue;
+        }
+
+        if (vscull_tile_check(sd, c, t->x, t->y) < 0 || vscull_alloc_video_frame(c) < 0) {
+            up(&c->sem);
+            dprintk(2, KERN_INFO "vscull: /dev/video%d: tile /dev/video%d skipped\n", sd->vd->minor, t->minor);
+            continue;
+        }
+
+        vscull_tile_copy(sd, c, t->x, t->y);
+        up(&c->sem);
+
+        vscull_publish_frame(c, flags);
+    }
+
+    up(&sd->sem);
+}
+
+
+/* set the tiles of a master (count = 0: no mosaic) */
+static int vscull_set_mosaic(struct vscull_device *sd, struct vscull_mosaic *mo)
+{
+    struct vscull_mosaic *old;
+    struct vscull_device *c;
+    int i, j, ret = 0;
+
+    if (mo->count < 0 || mo->count > VSCULL_MAX_TILES)
+        return -EINVAL;
+
+    mutex_lock(&vscull_mosaic_lock);
+
+    if (sd->master >= 0) {
+        ret = -EBUSY;           /* a child can't be a master */
+        goto out;
+    }
+
+    for(i = 0; i < mo->count; i++) {
+        const struct vscull_tile *t = &mo->tile[i];
+
+        if (t->minor < 0 || t->minor >= MAXDEVS || (c = vscull_dev[t->minor]) == NULL || c == sd) {
+            ret = -EINVAL;
+            goto out;
+        }
+        if (c->mosaic || c->regions || (c->master >= 0 && c->master != sd->vd->minor)) {
+            ret = -EBUSY;       /* a master, a composed device (regions are set under the lock
+                                   too) or the child of another master */
+            goto out;
+        }
+        for(j = 0; j < i; j++)
+            if (mo->tile[j].minor == t->minor) {
+                ret = -EINVAL;
+                goto out;
+            }
+
+        down(&sd->sem);
+        down(&c->sem);
+        ret = vscull_tile_check(sd, c, t->x, t->y);
+        up(&c->sem);
+        up(&sd->sem);
+        if (ret < 0)
+            goto out;
+    }
+
+    /* release the children of the old mosaic, then adopt the new ones */
+    down(&sd->sem);
+    old = sd->mosaic;
+    for(i = 0; old && i < old->count; i++)
+        vscull_dev[old->tile[i].minor]->master = -1;
+
+    sd->mosaic = NULL;
+    if (mo->count) {
+        sd->mosaic = kmalloc(sizeof(*mo), GFP_KERNEL);
+        if (sd->mosaic == NULL)
+            ret = -ENOMEM;
+        else {
+            memcpy(sd->mosaic, mo, sizeof(*mo));
+            for(i = 0; i < mo->count; i++)
+                vscull_dev[mo->tile[i].minor]->master = sd->vd->minor;
+        }
+    }
+    up(&sd->sem);
+    kfree(old);
+
+out:
+    mutex_unlock(&vscull_mosaic_lock);
+    return ret;
+}
+
+
+/* composition: producers write their own region of the frame concurrently, under the 
+   shared side of rsem (composition changes take it exclusive, with sem held). The frame 
+   can't be replaced while composed: geometry changes, import and NUMA migration are 
+   refused (EBUSY). Each update sets the bit of the region in rpending; with VSCULL_TRIG_ALL
+   the writer completing the set clears it (cmpxchg) and publishes, with VSCULL_TRIG_TIMER
+   the work publishes every period_ms if any region was updated. Readers may see a frame
+   being composed, as with an mmapped frame. When the regions change, the files bound to a
+   region follow the same rectangle in the new set; if it's gone their writes fail (ESTALE)
+   until they are bound again. */
+
+#define VSCULL_REGION_STALE (-2)    /* fh->region: the region bound is gone */
+
+/* size of the image of a region, as accepted by write(): planes packed, rows of the region */
+static size_t vscull_region_size(struct vscull_device *sd, const struct vscull_region *r)
+{
+    size_t size = 0, off;
+    int n, rows;
+
+    for(n = 0; n < sd->nplanes; n++)
+        size += vscull_rect_plane(sd, n, r->x, r->y, r->width, r->height, &rows, &off) * rows;
+
+    return size;
+}
+
+
+/* copy the image of a region into the frame (rsem held) */
+static int vscull_region_copy(struct vscull_device *sd, const struct vscull_region *r, const char __user *buf)
+{
+    int n, i, rows;
+    size_t len, off;
+
+    for(n = 0; n < sd->nplanes; n++) {
+        len = vscull_rect_plane(sd, n, r->x, r->y, r->width, r->height, &rows, &off);
+        for(i = 0; i < rows; i++, buf += len, off += sd->plane[n].stride)
+            if (copy_from_user(sd->frame + off, buf, len))
+                return -EFAULT;
+    }
+
+    return 0;
+}
+
+
+/* the region idx has been updated (rsem held): return 1 if the frame is to be published */
+static int vscull_region_done(struct vscull_device *sd, int idx)
+{
+    unsigned long all = sd->regions->count < BITS_PER_LONG ? (1UL << sd->regions->count) - 1 : ~0UL;
+    unsigned long old, new;
+
+    do {
+        old = ACCESS_ONCE(sd->rpending);
+        new = old | (1UL << idx);
+        if ((sd->regions->trigger & VSCULL_TRIG_ALL) && new == all)
+            new = 0;
+    }
+    while (cmpxchg(&sd->rpending, old, new) != old);
+
+    return new == 0;
+}
+
+
+/* write the region bound to the file, or signal it updated in place (buf NULL) */
+static ssize_t vscull_write_region(struct vscull_device *sd, struct vscull_fh *fh, const char __user *buf, size_t count)
+{
+    struct vscull_region r;
+    int ret = 0, publish = 0, idx;
+
+    down_read(&sd->rsem);
+
+    idx = fh->region;
+    if (sd->regions == NULL || idx < 0 || idx >= sd->regions->count) {
+        up_read(&sd->rsem);
+        return idx == VSCULL_REGION_STALE ? -ESTALE : -EINVAL;
+    }
+
+    r = sd->regions->region[idx];
+
+    if (buf && count != vscull_region_size(sd, &r)) {
+        up_read(&sd->rsem);
+        printk(KERN_INFO "vscull: region %d: %u bytes written, %u expected.\n", idx, (unsigned int)count, 
+                         (unsigned int)vscull_region_size(sd, &r));
+        return -EINVAL;
+    }
+
+    if (sd->frame == NULL)
+        ret = -ENOMEM;
+    else if (buf) {
+        ret = vscull_region_copy(sd, &r, buf);
+        sd->dvalid = 0;         /* not the frame published (VSCULL_DEDUP) */
+    }
+
+    if (ret == 0)
+        publish = vscull_region_done(sd, idx);
+
+    up_read(&sd->rsem);
+
+    /* out of rsem: the mosaic of the device takes sem */
+    if (publish)
+        vscull_publish_frame(sd, 0);
+
+    return ret < 0 ? ret : count;
+}
+
+
+static void vscull_rwork_fn(struct work_struct *w)
+{
+    struct vscull_device *sd = container_of(w, struct vscull_device, rwork.work);
+    unsigned int period;
+    unsigned long pending;
+
+    down_read(&sd->rsem);
+    if (sd->regions == NULL || !(sd->regions->trigger & VSCULL_TRIG_TIMER)) {
+        up_read(&sd->rsem);
+        return;
+    }
+    period  = sd->regions->period_ms;
+    pending = xchg(&sd->rpending, 0);
+    up_read(&sd->rsem);
+
+    if (pending)
+        vscull_publish_frame(sd, 0);
+
+    schedule_delayed_work(&sd->rwork, msecs_to_jiffies(period));
+}
+
+
+/* set the regions of a device (count = 0: back to a single writer) */
+static int vscull_set_regions(struct vscull_device *sd, struct vscull_regions *rg)
+{
+    struct vscull_regions *old, *new = NULL;
+    const struct vscull_region *bound;
+    struct vscull_fh *fh;
+    int i, j, ya, xa;
+
+    if (rg->count < 0 || rg->count > VSCULL_MAX_REGIONS)
+        return -EINVAL;
+
+    if (rg->count && ((rg->trigger & ~(VSCULL_TRIG_ALL|VSCULL_TRIG_TIMER)) || rg->trigger == 0 ||
+                      ((rg->trigger & VSCULL_TRIG_TIMER) && rg->period_ms == 0)))
+        return -EINVAL;
+
+    /* mosaic relations and regions exclude each other: both are set under vscull_mosaic_lock */
+    mutex_lock(&vscull_mosaic_lock);
+
+    if (down_interruptible(&sd->sem)) {
+        mutex_unlock(&vscull_mosaic_lock);
+        return -ERESTARTSYS;
+    }
+
+    if (sd->master >= 0 || sd->mosaic) {
+        up(&sd->sem);
+        mutex_unlock(&vscull_mosaic_lock);
+        return -EBUSY;          /* mosaic child or master */
+    }
+
+    for(i = 0; i < rg->count; i++) {
+        const struct vscull_region *r = &rg->region[i];
+
+        /* both corners aligned (or on the edge), so that regions don't share chroma samples */
+        xa = vscull_rect_check(sd, r->x, r->y, r->width, r->height, &ya);
+        if (xa < 0 || ((r->x + r->width) % xa && r->x + r->width != sd->width) ||
+                      ((r->y + r->height) % ya && r->y + r->height != sd->height))
+            goto inval;
+
+        for(j = 0; j < i; j++) {
+            const struct vscull_region *q = &rg->region[j];
+            if (r->x < q->x + q->width && q->x < r->x + r->width &&
+                r->y < q->y + q->height && q->y < r->y + r->height)
+                goto inval;     /* overlapping */
+        }
+    }
+
+    if (rg->count) {
+        int ret = vscull_alloc_video_frame(sd);
+        if (ret < 0) {
+            up(&sd->sem);
+            mutex_unlock(&vscull_mosaic_lock);
+            return ret;
+        }
+        new = kmalloc(sizeof(*new), GFP_KERNEL);
+        if (new == NULL) {
+            up(&sd->sem);
+            mutex_unlock(&vscull_mosaic_lock);
+            return -ENOMEM;
+        }
+        memcpy(new, rg, sizeof(*new));
+        new->pending = 0;
+    }
+
+    down_write(&sd->rsem);
+    old = sd->regions;
+    sd->regions  = new;
+    sd->rpending = 0;
+
+    /* rebind the files to the same rectangle, if any */
+    spin_lock(&sd->flock);
+    list_for_each_entry(fh, &sd->files, list) {
+        if (fh->region < 0 || old == NULL)
+            continue;
+        bound = &old->region[fh->region];
+        fh->region = VSCULL_REGION_STALE;
+        for(i = 0; new && i < new->count; i++)
+            if (!memcmp(&new->region[i], bound, sizeof(*bound)))
+                fh->region = i;
+    }
+    spin_unlock(&sd->flock);
+
+    up_write(&sd->rsem);
+
+    up(&sd->sem);
+    mutex_unlock(&vscull_mosaic_lock);
+
+    /* the work publishes: it takes sem when the device is a mosaic master */
+    cancel_delayed_work_sync(&sd->rwork);
+    if (new && (new->trigger & VSCULL_TRIG_TIMER))
+        schedule_delayed_work(&sd->rwork, msecs_to_jiffies(new->period_ms));
+
+    kfree(old);
+    return 0;
+
+inval:
+    up(&sd->sem);
+    mutex_unlock(&vscull_mosaic_lock);
+    return -EINVAL;
+}
+
+
+/* a frame has been published since the last one seen by the reader */
+static inline int vscull_frame_ready(struct vscull_fh *fh)
+{
+    if (fh->skip)
+        return (int)(atomic_read(&fh->dev->useq) - fh->seq) > 0;
+    return (unsigned int)atomic_read(&fh->dev->seq) != fh->seq;
+}
+
+
+/* readers skipping the unchanged frames are woken by the changed ones only */
+static inline wait_queue_head_t * vscull_fwait(struct vscull_fh *fh)
+{
+    return fh->skip ? &fh->dev->uwait : &fh->dev->fwait;
+}
+
+
+static inline void vscull_frame_seen(struct vscull_fh *fh)
+{
+    struct vscull_device *sd = fh->dev;
+
+    unsigned int seq;
+
+    spin_lock(&sd->flock);
+    seq = atomic_read(&sd->seq);
+    if (seq != fh->seq) {
+        fh->frames++;
+        if (!fh->skip)
+            fh->drops += seq - fh->seq - 1;
+        else if (sd->uframes > fh->uframes)
+            fh->drops += sd->uframes - fh->uframes - 1;
+        sd->rframes++;
+    }
+    fh->seq = seq;
+    fh->uframes = sd->uframes;
+    fh->info.seq     = fh->seq;
+    fh->info.flags   = sd->fflags;
+    fh->info.repeats = sd->frepeats;
+    fh->info.ts      = sd->fts;
+    spin_unlock(&sd->flock);
+    smp_rmb();
+}
+
+
+/* scheduled presentation: VSIOCQFRAME enqueues a frame sorted by pts, the hrtimer
+   fires at the pts of the queue head and the work copies the frame out to the readers */
+
+static int vscull_queue_frame(struct vscull_device *sd, struct vscull_qentry *e, int nonblock)
+{
+    struct vscull_qentry *pos;
+
+    spin_lock(&sd->qlock);
+
+    while (sd->queued >= qdepth) {
+        spin_unlock(&sd->qlock);
+        if (nonblock)
+            return -EAGAIN;
+        if (wait_event_interruptible(sd->qwait, sd->queued < qdepth))
+            return -ERESTARTSYS;
+        spin_lock(&sd->qlock);
+    }
+
+    /* frames with the same pts are kept in FIFO order */
+    list_for_each_entry(pos, &sd->queue, list) {
+        if (pos->pts > e->pts)
+            break;
+    }
+    list_add_tail(&e->list, &pos->list);
+    sd->queued++;
+
+    if (sd->queue.next == &e->list)
+        hrtimer_start(&sd->qtimer, ns_to_ktime(e->pts), HRTIMER_MODE_ABS);
+
+    spin_unlock(&sd->qlock);
+    return 0;
+}
+
+
+static void vscull_queue_flush(struct vscull_device *sd)
+{
+    struct vscull_qentry *e, *tmp;
+    LIST_HEAD(drop);
+
+    spin_lock(&sd->qlock);
+    list_splice_init(&sd->queue, &drop);
+    sd->queued = 0;
+    spin_unlock(&sd->qlock);
+
+    list_for_each_entry_safe(e, tmp, &drop, list) {
+        list_del(&e->list);
+        vscull_qentry_free(sd, e);
+    }
+
+    wake_up_interruptible(&sd->qwait);
+}
+
+
+static enum hrtimer_restart vscull_qtimer_fn(struct hrtimer *t)
+{
+    struct vscull_device *sd = container_of(t, struct vscull_device, qtimer);
+    int cpu = sd->reader_cpu;
+
+    /* present the frame on the reader's cpu: the copy is cache-hot for the reader */
+    if (cpu >= 0 && cpu_online(cpu))
+        schedule_work_on(cpu, &sd->qwork);
+    else
+        schedule_work(&sd->qwork);
+
+    return HRTIMER_NORESTART;
+}
+
+
+static void vscull_qwork_fn(struct work_struct *w)
+{
+    struct vscull_device *sd = container_of(w, struct vscull_device, qwork);
+    struct vscull_qentry *e = NULL, *next;
+    s64 now = ktime_to_ns(ktime_get());
+
+    spin_lock(&sd->qlock);
+
+    /* pick the latest expired frame: late frames superseded by it are dropped */
+    while (!list_empty(&sd->queue)) {
+        next = list_first_entry(&sd->queue, struct vscull_qentry, list);
+        if (next->pts > now) {
+            hrtimer_start(&sd->qtimer, ns_to_ktime(next->pts), HRTIMER_MODE_ABS);
+            break;
+        }
+        list_del(&next->list);
+        sd->queued--;
+        if (e) {
+            dprintk(2, KERN_INFO "vscull: /dev/video%d late frame dropped (pts=%lld)\n", sd->vd->minor, e->pts);
+            vscull_qentry_free(sd, e);
+        }
+        e = next;
+    }
+
+    spin_unlock(&sd->qlock);
+
+    if (!e)
+        return;
+
+    wake_up_interruptible(&sd->qwait);
+
+    /* the frame may have been resized since the frame was queued, the device may have become
+       a mosaic child or composed (regions are set with sem held): the frame is then dropped */
+    down(&sd->sem);
+    if (sd->master >= 0 || sd->regions) {
+        up(&sd->sem);
+        dprintk(2, KERN_INFO "vscull: /dev/video%d frame dropped, device busy (pts=%lld)\n", sd->vd->minor, e->pts);
+        vscull_qentry_free(sd, e);
+        return;
+    }
+    if (vscull_alloc_video_frame(sd) == 0)
+        vscull_copy_frame(sd, sd->frame, e->data, min_t(size_t, e->size, sd->image_size));
+    up(&sd->sem);
+
+    vscull_qentry_free(sd, e);
+
+    vscull_publish_frame(sd, 0);
+}
+
+
+/* set the parameters of a device, reallocating the frame if the geometry changed */
+static int vscull_set_par(struct vscull_device *sd, struct vscull_ioctl *par)
+{
+    int ret = 0;
+
+    if (par->width <= 0 || par->height <= 0 || par->depth < 0 || par->palette < 0 || par->fps < 0)
+        return -EINVAL;
+
+    if ( down_interruptible(&sd->sem) )
+        return -ERESTARTSYS;
+
+    if (par->width != sd->width || par->height != sd->height || par->depth != sd->depth || par->palette != sd->palette)
+        ret = vscull_realloc_video_frame(sd, par->width, par->height, par->depth, par->palette);
+
+    if (ret == 0)
+        sd->fps = par->fps;
+
+    up(&sd->sem);
+    return ret;
+}
+
+
+static void vscull_get_state(struct vscull_device *sd, struct vscull_dev_state *st)
+{
+    memset(st, 0, sizeof(*st));
+
+    down(&sd->sem);
+
+    st->minor       = sd->vd->minor;
+    st->par.width   = sd->width;
+    st->par.height  = sd->height;
+    st->par.depth   = sd->depth;
+    st->par.palette = sd->palette;
+    st->par.fps     = sd->fps;
+    st->flags       = sd->flags;
+    st->pid         = sd->pid;
+    st->openers     = sd->openers;
+    st->frame_node  = sd->frame_node;
+    st->frame_size  = sd->frame_size;
+    st->image_size  = sd->image_size;
+    st->mem         = atomic_long_read(&sd->mem) + 
+                      ((unsigned long long)sd->import_npages << PAGE_SHIFT);
+    st->mem_limit   = sd->mem_limit;
+
+    up(&sd->sem);
+}
+
+
+/* snapshot of the counters of a device and of its files */
+static void vscull_get_stats(struct vscull_device *sd, struct vscull_dev_stats *st)
+{
+    struct vscull_fh *fh;
+    unsigned int seq;
+
+    memset(st, 0, sizeof(*st));
+
+    st->minor       = sd->vd->minor;
+    st->pid         = sd->pid;
+    st->fps         = sd->fps;
+    st->image_size  = sd->image_size;
+    st->mem         = atomic_long_read(&sd->mem) + ((unsigned long long)sd->import_npages << PAGE_SHIFT);
+    st->wbytes      = (unsigned long)atomic_long_read(&sd->wbytes);
+    st->rbytes      = (unsigned long)atomic_long_read(&sd->rbytes);
+
+    spin_lock(&sd->flock);
+
+    seq = atomic_read(&sd->seq);
+    st->ts          = ktime_to_ns(ktime_get());
+    st->seq         = seq;
+    st->written     = sd->wframes;
+    st->repeated    = sd->repeated;
+    st->duplicates  = sd->duplicates;
+    st->rframes     = sd->rframes;
+    st->pace_err    = sd->pace_err;
+    st->pace_n      = sd->pace_n;
+
+    list_for_each_entry(fh, &sd->files, list) {
+        if (st->nfiles < VSCULL_MAX_FILES) {
+            struct vscull_file_stats *f = &st->file[st->nfiles];
+            f->id     = fh->id;
+            f->pid    = fh->pid;
+            f->lag    = fh->skip ? sd->uframes - fh->uframes : seq - fh->seq;
+            f->frames = fh->frames;
+            f->drops  = fh->drops;
+        }
+        st->nfiles++;
+    }
+
+    spin_unlock(&sd->flock);
+}
+
+
+static int vscull_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg) 
+{   
+    struct vscull_fh * fh = (struct vscull_fh *)file->private_data;
+    struct vscull_device * sd = fh->dev;
+
+    switch(cmd) {
+
+    case VSIOCGPAR: /* specific vscull ioctl */
+        {   
+            struct vscull_ioctl par;
+
+            if ( down_interruptible(&sd->sem) )
+                     return -ERESTARTSYS;
+
+            par.width   = sd->width;
+            par.height  = sd->height;
+            par.depth   = sd->depth;
+            par.palette = sd->palette;
+            par.fps     = sd->fps;
+
+            up(&sd->sem);
+
+            if ( copy_to_user((void __user *)arg, &par, sizeof(par)) )
+                return -EFAULT;
+
+            dprintk(1, KERN_INFO "vscull: VSIOCGPAR successfully called\n"); 
+            return 0;
+        }
+    case VSIOCSPAR: /* specific vscull ioctl */
+        {            
+            struct vscull_ioctl par;
+
+            int ret;
+
+            if (copy_from_user(&par, (void __user *)arg, sizeof(par))) 
+                return -EFAULT;
+            
+            ret = vscull_set_par(sd, &par);
+            if (ret < 0)
+                return ret;
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSPAR successfully called\n"); 
+            return 0;
+        }  
+    case VSIOCGRES: /* vscull specific ioctl */
+        {            
+            if ( down_interruptible(&sd->sem) )
+                     return -ERESTARTSYS;
+            
+            if (put_user(sd->pid, (pid_t __user *)arg) < 0) {
+                up(&sd->sem);
+                return -EFAULT;
+            }
+
+            up(&sd->sem);
+            dprintk(1, KERN_INFO "vscull: VSIOCGRES successfully called\n");
+            return 0; 
+        }
+    case VSIOCSRES: /* vscull specific ioctl */
+        {            
+            pid_t val;
+            if ( down_interruptible(&sd->sem) )
+                     return -ERESTARTSYS;
+
+            if ( get_user(val, (pid_t __user *)arg) < 0 ) {
+                up(&sd->sem);
+                return -EFAULT;
+            }
+            sd->pid = val; 
+            up(&sd->sem);
+            dprintk(1, KERN_INFO "vscull: VSIOCSRES successfully called\n");
+            return 0; 
+        } 
+    case VSIOCQFRAME: /* vscull specific ioctl */
+        {
+            struct vscull_qframe qf;
+            struct vscull_qentry *e;
+            int ret;
+
+            if (copy_from_user(&qf, (void __user *)arg, sizeof(qf)))
+                return -EFAULT;
+
+            /* fed by the mosaic master, or composed by the region writers (see vscull_qwork_fn) */
+            if (sd->master >= 0 || sd->regions)
+                return -EBUSY;
+
+            if (qf.size > sd->image_size) {
+                printk(KERN_INFO "vscull: VSIOCQFRAME: buffer overrun (%u/%u bytes)\n", qf.size, sd->image_size);
+                return -EINVAL;
+            }
+
+            e = vscull_qentry_alloc(sd, qf.size);
+            if (IS_ERR(e))
+                return PTR_ERR(e);
+
+            if (copy_from_user(e->data, (void __user *)qf.data, qf.size)) {
+                vscull_qentry_free(sd, e);
+                return -EFAULT;
+            }
+
+            e->pts  = qf.pts;
+
+            ret = vscull_queue_frame(sd, e, file->f_flags & O_NONBLOCK);
+            if (ret < 0) {
+                vscull_qentry_free(sd, e);
+                return ret;
+            }
+            atomic_long_add(qf.size, &sd->wbytes);
+
+            dprintk(2, KERN_INFO "vscull: VSIOCQFRAME successfully called (pts=%lld)\n", qf.pts);
+            return 0;
+        }
+    case VSIOCQFLUSH: /* vscull specific ioctl */
+        {
+            vscull_queue_flush(sd);
+            dprintk(1, KERN_INFO "vscull: VSIOCQFLUSH successfully called\n");
+            return 0;
+        }
+    case VSIOCGFLAGS: /* vscull specific ioctl */
+        {
+            if (put_user(sd->flags, (int __user *)arg) < 0)
+                return -EFAULT;
+
+            dprintk(1, KERN_INFO "vscull: VSIOCGFLAGS successfully called\n");
+            return 0;
+        }
+    case VSIOCSFLAGS: /* vscull specific ioctl */
+        {
+            int val, old, ret;
+
+            if (get_user(val, (int __user *)arg) < 0)
+                return -EFAULT;
+
+            if (val & ~VSCULL_FLAGS)
+                return -EINVAL;
+
+            if ( down_interruptible(&sd->sem) )
+                return -ERESTARTSYS;
+
+            old = sd->flags;
+
+            /* the plane layout changed: realloc the frame first, the flags don't change if it fails */
+            if ((old ^ val) & VSCULL_PLANAR) {
+                sd->flags = val;
+                ret = vscull_realloc_video_frame(sd, sd->width, sd->height, sd->depth, sd->palette);
+                if (ret < 0) {
+                    sd->flags = old;
+                    if (ret != -EBUSY)  /* the frame was released, or refused, with the new layout */
+                        sd->frame_size = PAGE_ALIGN(max_t(long, vscull_frame_layout(sd), 1));
+                    up(&sd->sem);
+                    return ret;
+                }
+            }
+
+            sd->flags = val;
+
+            /* a partial frame is dropped when leaving or entering the streaming mode */
+            if ((old ^ val) & VSCULL_STREAM)
+                vscull_free_stage(sd);
+
+            /* hold mode: the cadence starts from the last frame, if any */
+            if ((old ^ val) & VSCULL_HOLD) {
+                if ((val & VSCULL_HOLD) && atomic_read(&sd->seq))
+                    vscull_hold_arm(sd, 2);
+                else
+                    hrtimer_cancel(&sd->htimer);
+            }
+
+            up(&sd->sem);
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSFLAGS successfully called (flags=0x%x)\n", val);
+            return 0;
+        }
+    case VSIOCGPLANES: /* vscull specific ioctl */
+        {
+            struct vscull_planes pl;
+
+            if ( down_interruptible(&sd->sem) )
+                return -ERESTARTSYS;
+
+            pl.nplanes = sd->nplanes;
+            memcpy(pl.plane, sd->plane, sizeof(pl.plane));
+
+            up(&sd->sem);
+
+            if (copy_to_user((void __user *)arg, &pl, sizeof(pl)))
+                return -EFAULT;
+
+            dprintk(1, KERN_INFO "vscull: VSIOCGPLANES successfully called\n");
+            return 0;
+        }
+    case VSIOCSPLANE: /* vscull specific ioctl */
+        {
+            int val;
+
+            if (get_user(val, (int __user *)arg) < 0)
+                return -EFAULT;
+
+            if (val < -1 || val >= VSCULL_MAX_PLANES)
+                return -EINVAL;
+
+            fh->plane = val;
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSPLANE successfully called (plane=%d)\n", val);
+            return 0;
+        }
+    case VSIOCGPOOL: /* vscull specific ioctl */
+        {
+            struct vscull_pool_stats st;
+
+            mutex_lock(&vscull_pool.lock);
+            st.hits    = vscull_pool.hits;
+            st.misses  = vscull_pool.misses;
+            st.trims   = vscull_pool.trims;
+            st.cached  = vscull_pool.cached;
+            st.buffers = vscull_pool.buffers;
+            st.max_kb  = pool_max_kb;
+            mutex_unlock(&vscull_pool.lock);
+
+            if (copy_to_user((void __user *)arg, &st, sizeof(st)))
+                return -EFAULT;
+
+            dprintk(1, KERN_INFO "vscull: VSIOCGPOOL successfully called\n");
+            return 0;
+        }
+    case VSIOCGMEM: /* vscull specific ioctl */
+        {
+            struct vscull_mem mem;
+
+            mem.used   = atomic_long_read(&sd->mem);
+            mem.limit  = sd->mem_limit;
+            mem.total  = atomic_long_read(&vscull_mem_used);
+            mem.budget = (unsigned long long)mem_budget_kb << 10;
+
+            if (copy_to_user((void __user *)arg, &mem, sizeof(mem)))
+                return -EFAULT;
+
+            dprintk(1, KERN_INFO "vscull: VSIOCGMEM successfully called\n");
+            return 0;
+        }
+    case VSIOCSMEM: /* vscull specific ioctl */
+        {
+            unsigned long long limit;
+
+            /* the limits are set by the administrator, not by the tenants */
+            if (!capable(CAP_SYS_ADMIN))
+                return -EPERM;
+
+            if (copy_from_user(&limit, (void __user *)arg, sizeof(limit)))
+                return -EFAULT;
+
+            if ( down_interruptible(&sd->sem) )
+                return -ERESTARTSYS;
+            sd->mem_limit = limit;
+            up(&sd->sem);
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSMEM successfully called (limit=%llu)\n", limit);
+            return 0;
+        }
+    case VSIOCSMOSAIC: /* vscull specific ioctl */
+        {
+            struct vscull_mosaic *mo;
+            int ret;
+
+            mo = kmalloc(sizeof(*mo), GFP_KERNEL);
+            if (mo == NULL)
+                return -ENOMEM;
+
+            if (copy_from_user(mo, (void __user *)arg, sizeof(*mo))) {
+                kfree(mo);
+                return -EFAULT;
+            }
+
+            ret = vscull_set_mosaic(sd, mo);
+            kfree(mo);
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSMOSAIC called (ret=%d)\n", ret);
+            return ret;
+        }
+    case VSIOCGMOSAIC: /* vscull specific ioctl */
+        {
+            struct vscull_mosaic *mo;
+            int ret = 0;
+
+            mo = kzalloc(sizeof(*mo), GFP_KERNEL);
+            if (mo == NULL)
+                return -ENOMEM;
+
+            mutex_lock(&vscull_mosaic_lock);
+            if (sd->mosaic)
+                memcpy(mo, sd->mosaic, sizeof(*mo));
+            mo->master = sd->master;
+            mutex_unlock(&vscull_mosaic_lock);
+
+            if (copy_to_user((void __user *)arg, mo, sizeof(*mo)))
+                ret = -EFAULT;
+            kfree(mo);
+
+            dprintk(1, KERN_INFO "vscull: VSIOCGMOSAIC successfully called\n");
+            return ret;
+        }
+    case VSIOCSREGIONS: /* vscull specific ioctl */
+        {
+            struct vscull_regions *rg;
+            int ret;
+
+            rg = kmalloc(sizeof(*rg), GFP_KERNEL);
+            if (rg == NULL)
+                return -ENOMEM;
+
+            if (copy_from_user(rg, (void __user *)arg, sizeof(*rg))) {
+                kfree(rg);
+                return -EFAULT;
+            }
+
+            ret = vscull_set_regions(sd, rg);
+            kfree(rg);
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSREGIONS called (ret=%d)\n", ret);
+            return ret;
+        }
+    case VSIOCGREGIONS: /* vscull specific ioctl */
+        {
+            struct vscull_regions *rg;
+            int ret = 0;
+
+            rg = kzalloc(sizeof(*rg), GFP_KERNEL);
+            if (rg == NULL)
+                return -ENOMEM;
+
+            down_read(&sd->rsem);
+            if (sd->regions) {
+                memcpy(rg, sd->regions, sizeof(*rg));
+                rg->pending = ACCESS_ONCE(sd->rpending);
+            }
+            up_read(&sd->rsem);
+
+            if (copy_to_user((void __user *)arg, rg, sizeof(*rg)))
+                ret = -EFAULT;
+            kfree(rg);
+
+            dprintk(1, KERN_INFO "vscull: VSIOCGREGIONS successfully called\n");
+            return ret;
+        }
+    case VSIOCSREGION: /* vscull specific ioctl */
+        {
+            int val;
+
+            if (get_user(val, (int __user *)arg) < 0)
+                return -EFAULT;
+
+            /* exclusive: the binding is read by the writers under the shared side */
+            down_write(&sd->rsem);
+            if (val < -1 || (val >= 0 && (sd->regions == NULL || val >= sd->regions->count))) {
+                up_write(&sd->rsem);
+                return -EINVAL;
+            }
+            fh->region = val;
+            up_write(&sd->rsem);
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSREGION successfully called (region=%d)\n", val);
+            return 0;
+        }
+    case VSIOCSSKIP: /* vscull specific ioctl */
+        {
+            int val;
+
+            if (get_user(val, (int __user *)arg) < 0)
+                return -EFAULT;
+
+            spin_lock(&sd->flock);
+            fh->skip    = val != 0;
+            fh->uframes = sd->uframes;
+            spin_unlock(&sd->flock);
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSSKIP successfully called (skip=%d)\n", fh->skip);
+            return 0;
+        }
+    case VSIOCGFINFO: /* vscull specific ioctl */
+        {
+            if (copy_to_user((void __user *)arg, &fh->info, sizeof(fh->info)))
+                return -EFAULT;
+
+            dprintk(2, KERN_INFO "vscull: VSIOCGFINFO successfully called\n");
+            return 0;
+        }
+    case VSIOCGNUMA: /* vscull specific ioctl */
+        {
+            struct vscull_numa numa;
+
+            if ( down_interruptible(&sd->sem) )
+                return -ERESTARTSYS;
+
+            numa.node       = sd->numa_node;
+            numa.frame_node = sd->frame_node;
+            numa.writer_cpu = sd->writer_cpu;
+            numa.reader_cpu = sd->reader_cpu;
+
+            up(&sd->sem);
+
+            if (copy_to_user((void __user *)arg, &numa, sizeof(numa)))
+                return -EFAULT;
+
+            dprintk(1, KERN_INFO "vscull: VSIOCGNUMA successfully called\n");
             return 0;
         }
-    case VSIOCSPAR: /* specific vscull ioctl */
-        {            
-            struct vscull_ioctl par;
+    case VSIOCSNUMA: /* vscull specific ioctl */
+        {
+            int node, ret = 0;
 
-            if (copy_from_user(&par, (void __user *)arg, sizeof(par))) 
+            if (get_user(node, (int __user *)arg) < 0)
                 return -EFAULT;
-            
-            if (par.width != sd->width || par.height != sd->height || par.depth != sd->depth) {             
-                 
-                 if ( down_interruptible(&sd->sem) )
-                     return -ERESTARTSYS;
-
-                 if ( !vscull_alloc_video_frame(sd, par.width, par.height, par.depth) ) {
-                     printk (KERN_INFO "vscull: Couldn't allocate video frame.\n");
-                     up(&sd->sem);
-                     return -EFAULT;
-                 }
-                
-                 sd->width = par.width;
-                 sd->height = par.height;
-                 sd->depth = par.depth;
-
-                 up(&sd->sem);
-            }
 
-            sd->palette = par.palette;
-            sd->fps = par.fps;
+            if (node != NUMA_NO_NODE && (node < 0 || node >= MAX_NUMNODES || !node_online(node)))
+                return -EINVAL;
 
-            dprintk(1, KERN_INFO "vscull: VSIOCSPAR successfully called\n"); 
-            return 0;
-        }  
-    case VSIOCGRES: /* vscull specific ioctl */
-        {            
             if ( down_interruptible(&sd->sem) )
-                     return -ERESTARTSYS;
-            
-            if (put_user(sd->pid, (pid_t __user *)arg) < 0) {
-                up(&sd->sem);
-                return -EFAULT;
-            }
+                return -ERESTARTSYS;
+
+            sd->numa_node = node;
+            if (node != NUMA_NO_NODE && sd->frame && sd->frame_node != node)
+                ret = vscull_migrate_video_frame(sd, node);
 
             up(&sd->sem);
-            dprintk(1, KERN_INFO "vscull: VSIOCGRES successfully called\n");
-            return 0; 
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSNUMA successfully called (node=%d)\n", node);
+            return ret;
         }
-    case VSIOCSRES: /* vscull specific ioctl */
-        {            
-            pid_t val;
-            if ( down_interruptible(&sd->sem) )
-                     return -ERESTARTSYS;
+    case VSIOCSIMPORT: /* vscull specific ioctl */
+        {
+            struct vscull_import imp;
+            int ret;
 
-            if ( get_user(val, (pid_t __user *)arg) < 0 ) {
-                up(&sd->sem);
+            if (copy_from_user(&imp, (void __user *)arg, sizeof(imp)))
                 return -EFAULT;
-            }
-            sd->pid = val; 
+
+            if ( down_interruptible(&sd->sem) )
+                return -ERESTARTSYS;
+
+            if (imp.addr)
+                ret = vscull_import_video_frame(sd, (unsigned long)imp.addr, imp.size);
+            else
+                ret = vscull_unimport_video_frame(sd);
+
             up(&sd->sem);
-            dprintk(1, KERN_INFO "vscull: VSIOCSRES successfully called\n");
-            return 0; 
-        } 
+
+            dprintk(1, KERN_INFO "vscull: VSIOCSIMPORT called (addr=%p, ret=%d)\n", imp.addr, ret);
+            return ret;
+        }
+    case VSIOCPUBLISH: /* vscull specific ioctl */
+        {
+            /* the frame has been updated in place (imported or mmapped frame) */
+            if (sd->master >= 0)
+                return -EBUSY;
+
+            if (fh->region != -1) {
+                int ret = vscull_write_region(sd, fh, NULL, 0);
+                return ret < 0 ? ret : 0;
+            }
+
+            vscull_publish_frame(sd, 0);
+            vscull_sleep(sd->fps, &sd->timer_write);
+
+            dprintk(2, KERN_INFO "vscull: VSIOCPUBLISH successfully called\n");
+            return 0;
+        }
     case VIDIOCGCAP: /* get video capability */
         {
             struct video_capability cap = {
@@ -471,8 +2608,19 @@ static int vscull_ioctl(struct inode *inode, struct file *file, unsigned int cmd
     case VIDIOCSYNC: /* Sync with mmap grabbing */
         {
             int *frame = (int *)arg;
+            int fps = sd->fps;
+            long ret;
+
+            sd->reader_cpu = raw_smp_processor_id();
 
-            wait_for_completion_timeout(&sd->comp, msecs_to_jiffies(1000/sd->fps));
+            /* one frame period at most; unpaced devices (fps 0) and readers skipping the
+               unchanged frames wait for the frame */
+            ret = wait_event_interruptible_timeout(*vscull_fwait(fh), vscull_frame_ready(fh), 
+                                                   fps > 0 && !fh->skip ? msecs_to_jiffies(1000/fps) : MAX_SCHEDULE_TIMEOUT);
+            if (ret < 0)
+                return -ERESTARTSYS;
+
+            vscull_frame_seen(fh);
 
             // vscull_sleep(sd->fps, &sd->timer_read);
 
@@ -509,7 +2657,7 @@ static int vscull_ioctl(struct inode *inode, struct file *file, unsigned int cmd
                 .height = sd->height,
                 .width = sd->width,
                 .depth = sd->depth,
-                .bytesperline = sd->width*(sd->depth>>3)
+                .bytesperline = sd->plane[0].stride
             };
 
             if (copy_to_user((void __user *)arg, &vid, sizeof(vid)))
@@ -544,14 +2692,18 @@ int is_reserved(pid_t p, int minor)
 static int vscull_open(struct inode *inode, struct file *file) 
 {
     int minor = iminor(inode);
+    struct vscull_fh * fh;
+    int ret;
+
+    /* reservations are made by process (getpid()): the threads share the one of their process */
 
-    if ( !has_reservation(current->pid) )
+    if ( !has_reservation(current->tgid) )
         goto avail;
 
-    dprintk(1, KERN_INFO "vscull: pid %d has a reservation...\n", current->pid);
+    dprintk(1, KERN_INFO "vscull: pid %d has a reservation...\n", current->tgid);
 
-    if ( !is_reserved(current->pid, minor) ) {
-        dprintk(1, KERN_INFO "vscull: pid %d has reserved another device (EBUSY)\n", current->pid);
+    if ( !is_reserved(current->tgid, minor) ) {
+        dprintk(1, KERN_INFO "vscull: pid %d has reserved another device (EBUSY)\n", current->tgid);
         return -EBUSY;
     }
    
@@ -563,7 +2715,39 @@ static int vscull_open(struct inode *inode, struct file *file)
     //     return -EBUSY;
     // }
 
-    file->private_data = vscull_dev[minor]; 
+    fh = kzalloc(sizeof(struct vscull_fh), GFP_KERNEL);
+    if (fh == NULL)
+        return -ENOMEM;
+
+    fh->dev   = vscull_dev[minor];
+    fh->plane = -1;
+    fh->region = -1;
+    fh->id    = atomic_inc_return(&vscull_file_id);
+    fh->pid   = current->tgid;
+    fh->seq   = atomic_read(&vscull_dev[minor]->seq) - 1;  /* the current frame is readable */
+
+    /* the frame is allocated on the first open: over the memory budget the device is opened
+       anyway, so that it can be reconfigured, and the frame is allocated on demand */
+
+    if (down_interruptible(&fh->dev->sem)) {
+        kfree(fh);
+        return -ERESTARTSYS;
+    }
+    ret = vscull_alloc_video_frame(fh->dev);
+    if (ret < 0 && ret != -EDQUOT) {
+        up(&fh->dev->sem);
+        kfree(fh);
+        printk(KERN_INFO "vscull: couldn't allocate video frame.\n");
+        return ret;
+    }
+    fh->dev->openers++;
+    up(&fh->dev->sem);
+
+    spin_lock(&fh->dev->flock);
+    list_add_tail(&fh->list, &fh->dev->files);
+    spin_unlock(&fh->dev->flock);
+
+    file->private_data = fh; 
 
     dprintk(1, KERN_INFO "vscull: /dev/video%d successfully opened (pid=%d)\n", minor,current->pid);
     return 0;    
@@ -573,6 +2757,31 @@ static int vscull_open(struct inode *inode, struct file *file)
 static int vscull_release(struct inode *inode, struct file *file)
 {
     int minor = iminor(inode);
+    struct vscull_fh * fh = (struct vscull_fh *)file->private_data;
+    struct vscull_device * sd = fh->dev;
+
+    int last;
+
+    /* the frame of a device closed for idle_ms is released */
+
+    spin_lock(&sd->flock);
+    list_del(&fh->list);
+    spin_unlock(&sd->flock);
+
+    down(&sd->sem);
+    last = --sd->openers == 0;
+    if (last && idle_ms)
+        schedule_delayed_work(&sd->idle_work, msecs_to_jiffies(idle_ms));
+    up(&sd->sem);
+
+    /* nobody to repeat the frame to: the next frame published arms the hold timer again */
+    if (last) {
+        hrtimer_cancel(&sd->htimer);
+        cancel_work_sync(&sd->hwork);
+        hrtimer_cancel(&sd->htimer);
+    }
+
+    kfree(fh);
 
     dprintk(1, KERN_INFO "vscull: /dev/video%d released.\n", minor);
     return 0;
@@ -594,94 +2803,308 @@ static int vscull_release(struct inode *inode, struct file *file)
 //     return 0;
 // }
 
+static void vscull_vma_open(struct vm_area_struct *vma)
+{
+    struct vscull_device * sd = (struct vscull_device *)vma->vm_private_data;
+
+    spin_lock(&sd->map_lock);
+    sd->mapped++;
+    spin_unlock(&sd->map_lock);
+}
+
+static void vscull_vma_close(struct vm_area_struct *vma)
+{
+    struct vscull_device * sd = (struct vscull_device *)vma->vm_private_data;
+
+    spin_lock(&sd->map_lock);
+    sd->mapped--;
+    spin_unlock(&sd->map_lock);
+}
+
+static struct vm_operations_struct vscull_vm_ops = {
+            open:       vscull_vma_open,
+            close:      vscull_vma_close,
+};
+
 static int vscull_mmap(struct file *f, struct vm_area_struct *vma) 
 {
-    struct vscull_device * sd = (struct vscull_device *)f->private_data;
+    struct vscull_device * sd = ((struct vscull_fh *)f->private_data)->dev;
     struct page *page = NULL;
 
+    char * frame;
     unsigned long pos;
-    unsigned long start = (unsigned long)(vma->vm_start);
-    unsigned long size  = (unsigned long)(vma->vm_end-vma->vm_start);
+    unsigned long start  = (unsigned long)(vma->vm_start);
+    unsigned long size   = (unsigned long)(vma->vm_end-vma->vm_start);
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;  /* planes are mapped at their offset (VSCULL_PLANAR) */
 
-    if ( size > sd->frame_size ) {
-        printk(KERN_INFO "vscull: mmap buffer overrun (memorymap size exceedes the frame size: %lu/%u)\n", size, sd->frame_size);
+    /* pin the frame: it can't be reallocated until the last vma is closed */
+
+    spin_lock(&sd->map_lock);
+    if (sd->resizing) {
+        spin_unlock(&sd->map_lock);
+        return -EAGAIN;
+    }
+
+    if ( offset > sd->frame_size || size > sd->frame_size - offset ) {
+        spin_unlock(&sd->map_lock);
+        printk(KERN_INFO "vscull: mmap buffer overrun (memorymap size exceedes the frame size: %lu+%lu/%u)\n", offset, size, sd->frame_size);
         return -EINVAL;
     }
 
-    pos = (unsigned long) sd->frame;
+    frame = sd->frame;
+    if (frame == NULL) {
+        spin_unlock(&sd->map_lock);
+        return -ENOMEM;
+    }
+    sd->mapped++;
+    spin_unlock(&sd->map_lock);
+
+    pos = (unsigned long) frame + offset;
 
     while (size > 0) {
         page = (void *)vmalloc_to_pfn((void *)pos);
         
-        if ( remap_pfn_range(vma, start, (unsigned long)page, PAGE_SIZE, PAGE_SHARED))
-           return -EAGAIN; 
+        if ( remap_pfn_range(vma, start, (unsigned long)page, PAGE_SIZE, PAGE_SHARED)) {
+            spin_lock(&sd->map_lock);
+            sd->mapped--;
+            spin_unlock(&sd->map_lock);
+            return -EAGAIN; 
+        }
 
         start += PAGE_SIZE;
         pos   += PAGE_SIZE;
         size  -= PAGE_SIZE;
     }
+
+    vma->vm_ops = &vscull_vm_ops;
+    vma->vm_private_data = sd;
     
-    dprintk(1, KERN_INFO "vscull: /dev/video%d mmaped (%p)\n", sd->vd->minor, sd->frame);
+    dprintk(1, KERN_INFO "vscull: /dev/video%d mmaped (%p)\n", sd->vd->minor, frame);
     return 0;
 }
 
 
 static ssize_t vscull_read(struct file *f, char __user *buf, size_t count, loff_t *ppos)
 {
-    struct vscull_device * sd = (struct vscull_device *)f->private_data;
+    struct vscull_fh * fh = (struct vscull_fh *)f->private_data;
+    struct vscull_device * sd = fh->dev;
+    int plane = fh->plane;
+    int ret;
+
+    /* blocking I/O: wait for a frame not yet seen by this reader */
+
+    if (!vscull_frame_ready(fh)) {
+        if (f->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        if (wait_event_interruptible(*vscull_fwait(fh), vscull_frame_ready(fh)))
+            return -ERESTARTSYS;
+    }
         
     if (down_interruptible(&sd->sem))
         return -ERESTARTSYS;
 
-    if (count > sd->frame_size) {
+    vscull_frame_seen(fh);
+
+    if (plane >= sd->nplanes) {
         up(&sd->sem);
-        printk(KERN_INFO "vscull: buffer overrun. Can't read %u/%u bytes.\n",(unsigned int)count,sd->frame_size);
         return -EINVAL;
     }
 
-    if (copy_to_user((void __user *)buf, sd->frame, count*sizeof(char))) {
+    ret = vscull_alloc_video_frame(sd);
+    if (ret < 0) {
         up(&sd->sem);
-        return -EFAULT;
+        return ret;
+    }
+
+    sd->reader_cpu = raw_smp_processor_id();
+
+    /* the frame is page-aligned: reads of the whole mapped size get the image only */
+    count = min_t(size_t, count, plane < 0 ? sd->image_size : sd->plane[plane].size);
+
+    if (plane < 0)
+        ret = vscull_copy_to_user(sd, sd->frame, 0, buf, count);
+    else
+        ret = copy_to_user(buf, sd->frame + sd->plane[plane].offset, count) ? -EFAULT : 0; 
+
+    if (ret < 0) {
+        up(&sd->sem);
+        return ret;
     }
     
     up(&sd->sem);
 
-    /* blocking I/O */
+    atomic_long_add(count, &sd->rbytes);
+    return count; 
+}
 
-    if (wait_for_completion_interruptible(&sd->comp)) {
-        return -EFAULT;
+
+/* readable when a new frame has been published, always writable */
+static unsigned int vscull_poll(struct file *f, poll_table *wait)
+{
+    struct vscull_fh * fh = (struct vscull_fh *)f->private_data;
+    unsigned int mask = POLLOUT | POLLWRNORM;
+
+    poll_wait(f, vscull_fwait(fh), wait);
+
+    if (vscull_frame_ready(fh))
+        mask |= POLLIN | POLLRDNORM;
+
+    return mask;
+}
+
+
+/* the staged frame is complete: it becomes the frame, swapped if nobody maps the frame (sem held) */
+static void vscull_commit_stage(struct vscull_device *sd)
+{
+    char * frame;
+    size_t alloc;
+
+    spin_lock(&sd->map_lock);
+    if (!sd->mapped && !sd->resizing && !sd->import_pages && !sd->regions) {
+        frame = sd->frame;
+        alloc = sd->frame_alloc;
+        sd->frame       = sd->stage;
+        sd->frame_alloc = sd->stage_alloc;
+        sd->stage       = frame;
+        sd->stage_alloc = alloc;
+        spin_unlock(&sd->map_lock);
+        sd->frame_node = vscull_buf_node(sd->frame);
+        return;
     }
+    spin_unlock(&sd->map_lock);
 
-    return count; 
+    memcpy(sd->frame, sd->stage, sd->frame_size);
+}
+
+
+/* streaming writes (VSCULL_STREAM): chunks of any size are accumulated at the write offset
+   and a frame is published each time a whole image has arrived (sem held, released on exit) */
+
+static ssize_t vscull_write_stream(struct vscull_device *sd, const char __user *buf, size_t count)
+{
+    size_t done = 0, len;
+    int ret, dup;
+
+    while (done < count) {
+
+        if (sd->stage == NULL) {
+            ret = vscull_frame_get(sd, sd->frame_node, &sd->stage, &sd->stage_alloc);
+            sd->wpos = 0;
+            if (ret < 0) {
+                up(&sd->sem);
+                return done ? done : ret;
+            }
+        }
+
+        len = min_t(size_t, count - done, sd->image_size - sd->wpos);
+
+        ret = vscull_copy_from_user(sd, sd->stage, sd->wpos, buf + done, len);
+        if (ret < 0) {
+            up(&sd->sem);
+            return done ? done : ret;
+        }
+
+        done    += len;
+        sd->wpos += len;
+
+        if (sd->wpos < sd->image_size)
+            break;
+
+        sd->wpos = 0;
+        dup = (sd->flags & VSCULL_DEDUP) && sd->dvalid && vscull_frame_same(sd, sd->stage, sd->frame);
+        if (!dup) {
+            vscull_commit_stage(sd);
+            sd->dvalid = 1;
+        }
+
+        up(&sd->sem);
+
+        vscull_publish_frame(sd, dup ? VSCULL_FRAME_DUP : 0);
+        vscull_sleep(sd->fps, &sd->timer_write);
+
+        if (done == count)
+            return done;
+
+        /* the device may have been reconfigured in the meantime */
+        if (down_interruptible(&sd->sem))
+            return done;
+
+        if (!(sd->flags & VSCULL_STREAM) || vscull_alloc_video_frame(sd) < 0) {
+            up(&sd->sem);
+            return done;
+        }
+    }
+
+    up(&sd->sem);
+    return done;
 }
 
 
 static ssize_t vscull_write(struct file *f, const char __user *buf, size_t count, loff_t *ppos)
 {
-    struct vscull_device * sd = (struct vscull_device *)f->private_data;
+    struct vscull_fh * fh = (struct vscull_fh *)f->private_data;
+    struct vscull_device * sd = fh->dev;
+    ssize_t ret;
+    int dup;
+
+    /* composition: no device-wide lock */
+    if (fh->region != -1) {
+        ret = vscull_write_region(sd, fh, buf, count);
+        if (ret > 0)
+            atomic_long_add(ret, &sd->wbytes);
+        return ret;
+    }
 
     if (down_interruptible(&sd->sem))
         return -ERESTARTSYS;
 
-    if (count > sd->frame_size) {
+    if (sd->master >= 0) {
+        up(&sd->sem);
+        return -EBUSY;          /* fed by the mosaic master */
+    }
+
+    if (count > sd->image_size && !(sd->flags & VSCULL_STREAM)) {
         up(&sd->sem);
-        printk(KERN_INFO "vscull: buffer overrun. Can't write %u/%u bytes.\n",(unsigned int)count, sd->frame_size);
+        printk(KERN_INFO "vscull: buffer overrun. Can't write %u/%u bytes.\n",(unsigned int)count, sd->image_size);
         return -EINVAL;
     }
 
+    ret = vscull_alloc_video_frame(sd);
+    if (ret < 0) {
+        up(&sd->sem);
+        return ret;
+    }
+
+    vscull_numa_follow(sd);
+
+    if (sd->flags & VSCULL_STREAM) {
+        ret = vscull_write_stream(sd, buf, count);
+        if (ret > 0)
+            atomic_long_add(ret, &sd->wbytes);
+        return ret;
+    }
+
     /* copy the frame from user */
 
-    if (copy_from_user(sd->frame, (void __user*)buf, count)) {
+    if (sd->flags & VSCULL_DEDUP)
+        dup = vscull_copy_changed(sd, buf, count);
+    else
+        dup = vscull_copy_from_user(sd, sd->frame, 0, buf, count);
+
+    if (dup < 0) {
         up(&sd->sem);
         printk (KERN_INFO "vscull: copy_from_user() error\n");
         return -EFAULT;
     }
+    sd->dvalid = 1;
 
     /* uplock the device */
     up(&sd->sem);
 
+    atomic_long_add(count, &sd->wbytes);
+
     /* signaling the complete condition */
-    complete(&sd->comp);
+    vscull_publish_frame(sd, dup ? VSCULL_FRAME_DUP : 0);
 
     /* blocking I/O */
     vscull_sleep(sd->fps, &sd->timer_write);
@@ -696,6 +3119,7 @@ static struct file_operations vscull_fops = {
             release:    vscull_release,
             // flush:      vscull_flush,
             read:       vscull_read,
+            poll:       vscull_poll,
             mmap:       vscull_mmap,
             write:      vscull_write,
             ioctl:      vscull_ioctl,
@@ -703,6 +3127,206 @@ static struct file_operations vscull_fops = {
             llseek:     no_llseek,
 };
 
+/* control node (/dev/vscull): VSIOCBGSTATE returns the state of all the devices in one 
+   snapshot, VSIOCBSPAR configures many devices in one call, reallocating their frames in 
+   parallel on the online cpus */
+
+struct vscull_bulk_work
+{
+    struct work_struct   work;
+    struct vscull_device *sd;
+    struct vscull_ioctl  par;
+    int                  result;
+    atomic_t           * pending;
+    struct completion  * done;
+};
+
+
+static void vscull_bulk_fn(struct work_struct *w)
+{
+    struct vscull_bulk_work *bw = container_of(w, struct vscull_bulk_work, work);
+
+    bw->result = vscull_set_par(bw->sd, &bw->par);
+
+    if (atomic_dec_and_test(bw->pending))
+        complete(bw->done);
+}
+
+
+static int vscull_bulk_get_state(struct vscull_bulk *bulk)
+{
+    struct vscull_dev_state *st;
+    int i, n = 0;
+
+    if (bulk->count < 0 || bulk->count > MAXDEVS)
+        return -EINVAL;
+
+    st = kcalloc(MAXDEVS, sizeof(struct vscull_dev_state), GFP_KERNEL);
+    if (st == NULL)
+        return -ENOMEM;
+
+    for(i = 0; i < MAXDEVS; i++) {
+        if (vscull_dev[i])
+            vscull_get_state(vscull_dev[i], &st[n++]);
+    }
+
+    if (copy_to_user((void __user *)bulk->entries, st, min(n, bulk->count) * sizeof(struct vscull_dev_state))) {
+        kfree(st);
+        return -EFAULT;
+    }
+
+    kfree(st);
+    bulk->count = n;
+    return 0;
+}
+
+
+/* the counters of the devices, one at a time: no allocation of the whole table */
+static int vscull_bulk_get_stats(struct vscull_bulk *bulk)
+{
+    struct vscull_dev_stats *st;
+    int i, n = 0, ret = 0;
+
+    if (bulk->count < 0 || bulk->count > MAXDEVS)
+        return -EINVAL;
+
+    st = kmalloc(sizeof(*st), GFP_KERNEL);
+    if (st == NULL)
+        return -ENOMEM;
+
+    for(i = 0; i < MAXDEVS; i++) {
+        if (!vscull_dev[i])
+            continue;
+        if (n < bulk->count) {
+            vscull_get_stats(vscull_dev[i], st);
+            if (copy_to_user((struct vscull_dev_stats __user *)bulk->entries + n, st, sizeof(*st))) {
+                ret = -EFAULT;
+                break;
+            }
+        }
+        n++;
+    }
+
+    kfree(st);
+    bulk->count = n;
+    return ret;
+}
+
+
+static int vscull_bulk_set_par(struct vscull_bulk *bulk)
+{
+    struct vscull_dev_par *par;
+    struct vscull_bulk_work *bw;
+    struct completion done;
+    atomic_t pending;
+    int i, cpu = 0, ret = 0;
+
+    if (bulk->count <= 0 || bulk->count > MAXDEVS)
+        return -EINVAL;
+
+    par = kcalloc(bulk->count, sizeof(struct vscull_dev_par), GFP_KERNEL);
+    bw  = kcalloc(bulk->count, sizeof(struct vscull_bulk_work), GFP_KERNEL);
+    if (par == NULL || bw == NULL) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    if (copy_from_user(par, (void __user *)bulk->entries, bulk->count * sizeof(struct vscull_dev_par))) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    init_completion(&done);
+    atomic_set(&pending, 1);
+
+    for(i = 0; i < bulk->count; i++) {
+        if (par[i].minor < 0 || par[i].minor >= MAXDEVS || !vscull_dev[par[i].minor]) {
+            par[i].result = -ENODEV;
+            continue;
+        }
+
+        INIT_WORK(&bw[i].work, vscull_bulk_fn);
+        bw[i].sd      = vscull_dev[par[i].minor];
+        bw[i].par     = par[i].par;
+        bw[i].pending = &pending;
+        bw[i].done    = &done;
+
+        /* spread the reallocations over the online cpus */
+        do {
+            cpu = (cpu + 1) % nr_cpu_ids;
+        } while (!cpu_online(cpu));
+
+        atomic_inc(&pending);
+        schedule_work_on(cpu, &bw[i].work);
+    }
+
+    if (!atomic_dec_and_test(&pending))
+        wait_for_completion(&done);
+
+    for(i = 0; i < bulk->count; i++) {
+        if (bw[i].sd)
+            par[i].result = bw[i].result;
+    }
+
+    if (copy_to_user((void __user *)bulk->entries, par, bulk->count * sizeof(struct vscull_dev_par)))
+        ret = -EFAULT;
+
+out:
+    kfree(bw);
+    kfree(par);
+    return ret;
+}
+
+
+static int vscull_ctl_ioctl(struct inode *inode, struct file *file, unsigned int cmd, unsigned long arg) 
+{
+    struct vscull_bulk bulk;
+    int ret;
+
+    if (copy_from_user(&bulk, (void __user *)arg, sizeof(bulk)))
+        return -EFAULT;
+
+    switch(cmd) {
+    case VSIOCBGSTATE:
+        ret = vscull_bulk_get_state(&bulk);
+        break;
+    case VSIOCBSPAR:
+        ret = vscull_bulk_set_par(&bulk);
+        break;
+    case VSIOCBGSTATS:
+        ret = vscull_bulk_get_stats(&bulk);
+        break;
+    default:
+        printk(KERN_INFO "vscull: ioctl 0x%x not implemented for the control device\n",cmd); 
+        return -ENOTTY;
+    }
+
+    if (ret < 0)
+        return ret;
+
+    if (copy_to_user((void __user *)arg, &bulk, sizeof(bulk)))
+        return -EFAULT;
+
+    dprintk(1, KERN_INFO "vscull: control ioctl 0x%x successfully called (%d entries)\n", cmd, bulk.count);
+    return 0;
+}
+
+
+static struct file_operations vscull_ctl_fops = {
+            owner:      THIS_MODULE,
+            ioctl:      vscull_ctl_ioctl,
+            llseek:     no_llseek,
+};
+
+static struct miscdevice vscull_ctl = {
+            minor:      MISC_DYNAMIC_MINOR,
+            name:       VSCULL_CTL_NAME,
+            fops:       &vscull_ctl_fops,
+};
+
+static int vscull_ctl_registered;
+
+
 /* initialize the video_device structure */
 
 static void vscull_video_device_init(struct video_device *vd)
@@ -722,12 +3346,42 @@ static void vscull_video_device_init(struct video_device *vd)
 static int vscull_dev_release(void)
 {
     int i;
+
+    if (vscull_ctl_registered) {
+        misc_deregister(&vscull_ctl);
+        vscull_ctl_registered = 0;
+    }
     for(i = 0 ; i < MAXDEVS; i++) {
         if (!vscull_dev[i])
             continue;
         if ( vscull_dev[i]->vd->minor != -1)
             video_unregister_device(vscull_dev[i]->vd);
-        vfree(vscull_dev[i]->frame);
+        vscull_queue_flush(vscull_dev[i]);          /* nothing left for the work to re-arm */
+        hrtimer_cancel(&vscull_dev[i]->qtimer);
+        cancel_work_sync(&vscull_dev[i]->qwork);
+        hrtimer_cancel(&vscull_dev[i]->qtimer);     /* re-armed by the work */
+        cancel_delayed_work_sync(&vscull_dev[i]->rwork);
+    }
+
+    /* the works above publish, arming the hold timers of the device and of its mosaic
+       children: those are stopped once nothing publishes any longer */
+    for(i = 0 ; i < MAXDEVS; i++) {
+        if (!vscull_dev[i])
+            continue;
+        hrtimer_cancel(&vscull_dev[i]->htimer);
+        cancel_work_sync(&vscull_dev[i]->hwork);
+        hrtimer_cancel(&vscull_dev[i]->htimer);     /* re-armed by the work */
+        cancel_delayed_work_sync(&vscull_dev[i]->idle_work);
+    }
+
+    for(i = 0 ; i < MAXDEVS; i++) {
+        if (!vscull_dev[i])
+            continue;
+        vscull_free_video_frame(vscull_dev[i]);
+        if (vscull_dev[i]->dbuf)
+            free_page((unsigned long)vscull_dev[i]->dbuf);
+        kfree(vscull_dev[i]->mosaic);
+        kfree(vscull_dev[i]->regions);
         kfree(vscull_dev[i]);
     } 
 
@@ -745,6 +3399,8 @@ static int __init vscull_init(void)
     if (ndevs > NDEVS)  
         ndevs = NDEVS; 
 
+    vscull_pool_init();
+
     for(i=0, n = 0; i < ndevs; i++) {
 
         struct vscull_device * dev = 
@@ -759,8 +3415,50 @@ static int __init vscull_init(void)
 
         /* initialize semaphore */
         init_MUTEX(&dev->sem);
-
-        init_completion(&dev->comp);
+        spin_lock_init(&dev->map_lock);
+
+        INIT_DELAYED_WORK(&dev->idle_work, vscull_idle_fn);
+
+        /* NUMA placement: follow the writer */
+        dev->numa_node  = NUMA_NO_NODE;
+        dev->frame_node = NUMA_NO_NODE;
+        dev->writer_cpu = -1;
+        dev->reader_cpu = -1;
+
+        atomic_set(&dev->seq, 0);
+        init_waitqueue_head(&dev->fwait);
+        atomic_set(&dev->useq, 0);
+        init_waitqueue_head(&dev->uwait);
+
+        /* hold mode, statistics */
+        spin_lock_init(&dev->flock);
+        INIT_LIST_HEAD(&dev->files);
+        atomic_long_set(&dev->wbytes, 0);
+        atomic_long_set(&dev->rbytes, 0);
+        hrtimer_init(&dev->htimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        dev->htimer.function = vscull_htimer_fn;
+        INIT_WORK(&dev->hwork, vscull_hwork_fn);
+
+        dev->mosaic = NULL;
+        dev->master = -1;
+
+        /* composition */
+        dev->regions = NULL;
+        dev->rpending = 0;
+        init_rwsem(&dev->rsem);
+        INIT_DELAYED_WORK(&dev->rwork, vscull_rwork_fn);
+
+        /* frame memory budget */
+        atomic_long_set(&dev->mem, 0);
+        dev->mem_limit = (size_t)dev_mem_kb << 10;
+
+        /* initialize presentation queue */
+        INIT_LIST_HEAD(&dev->queue);
+        spin_lock_init(&dev->qlock);
+        init_waitqueue_head(&dev->qwait);
+        hrtimer_init(&dev->qtimer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        dev->qtimer.function = vscull_qtimer_fn;
+        INIT_WORK(&dev->qwork, vscull_qwork_fn);
 
         // dev->users = 2;       /* 2 players: writer and reader */ 
         dev->pid = 0;         /* not reserved */
@@ -779,9 +3477,9 @@ static int __init vscull_init(void)
         dev->contrast = contrast;
         dev->whiteness = whiteness;
 
-        /* alloc frame */
-        if ( !vscull_alloc_video_frame(dev, width, height, depth) ) { 
-            printk (KERN_INFO "vscull: couldn't allocate video frame.\n");
+        /* frame layout (the frame is allocated on the first open) */
+        if (vscull_set_geometry(dev, width, height, depth, palette) < 0) {
+            kfree(dev);
             goto error;
         }
 
@@ -808,7 +3506,6 @@ static int __init vscull_init(void)
         if ( dev->vd->minor >= MAXDEVS ) {
             printk(KERN_INFO "vscull: minor descriptor exceeds MAXDEVS\n");
             video_unregister_device(dev->vd);
-            vfree(dev->frame);
             kfree(dev);
             continue;
         }
@@ -817,12 +3514,20 @@ static int __init vscull_init(void)
         n++;
     }
 
+    ret = misc_register(&vscull_ctl);
+    if (ret < 0) {
+        printk (KERN_INFO "vscull: couldn't register the control device.\n");
+        goto error;
+    }
+    vscull_ctl_registered = 1;
+
     printk(KERN_INFO "vscull: %d video device(s) created.\n", n);
     return 0;
 
 error:
 
     vscull_dev_release();
+    vscull_pool_release();
     printk(KERN_INFO "vscull: error %d while loading vscull driver.\n", ret);    
     return -ENOMEM;
 }
@@ -831,6 +3536,7 @@ error:
 static void __exit vscull_exit(void)
 {
     vscull_dev_release();
+    vscull_pool_release();
     printk(KERN_INFO "vscull unloaded.\n");
 }
 
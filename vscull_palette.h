@@ -20,6 +20,18 @@
 #define _VSCULL_PALETTE_H_ 
 
 #define PALETTE(n) ( (n < sizeof(palette_str)/sizeof(palette_str[0])) ? (palette_str[n]) : (palette_str[0]) )
+#define PALETTE_FORMAT(n) ( ((unsigned int)(n) < sizeof(palette_fmt)/sizeof(palette_fmt[0])) ? (&palette_fmt[n]) : (&palette_fmt[0]) )
+
+/* frame format descriptor: planar formats have a full resolution Y plane (8 bit) 
+   followed by the U and V planes, subsampled by (1 << hsub) x (1 << vsub) */
+
+struct vscull_format
+{
+    int bpp;        /* bits per pixel of the image (0: use the device depth) */
+    int nplanes;
+    int hsub;       /* log2 of the horizontal chroma subsampling */
+    int vsub;       /* log2 of the vertical chroma subsampling */
+};
 
 #ifndef VIDEO_PALETTE_GREY
 #define VIDEO_PALETTE_GREY  1           // Linear greyscale 
@@ -63,8 +75,29 @@ const char *palette_str[] =
     [VIDEO_PALETTE_YUV420P] = "YUV 4:2:0 Planar",
     [VIDEO_PALETTE_YUV410P] = "YUV 4:1:0 Planar"
 };
+
+static const struct vscull_format palette_fmt[] =
+{
+    [0]                     = {  0, 1, 0, 0 },
+    [VIDEO_PALETTE_GREY]    = {  8, 1, 0, 0 },
+    [VIDEO_PALETTE_HI240]   = {  8, 1, 0, 0 },
+    [VIDEO_PALETTE_RGB565]  = { 16, 1, 0, 0 },
+    [VIDEO_PALETTE_RGB24]   = { 24, 1, 0, 0 },
+    [VIDEO_PALETTE_RGB32]   = { 32, 1, 0, 0 },
+    [VIDEO_PALETTE_RGB555]  = { 16, 1, 0, 0 },
+    [VIDEO_PALETTE_YUV422]  = { 16, 1, 0, 0 },
+    [VIDEO_PALETTE_YUYV]    = { 16, 1, 0, 0 },
+    [VIDEO_PALETTE_UYVY]    = { 16, 1, 0, 0 },
+    [VIDEO_PALETTE_YUV420]  = { 12, 1, 0, 0 },
+    [VIDEO_PALETTE_YUV411]  = { 12, 1, 0, 0 },
+    [VIDEO_PALETTE_RAW]     = {  0, 1, 0, 0 },
+    [VIDEO_PALETTE_YUV422P] = { 16, 3, 1, 0 },
+    [VIDEO_PALETTE_YUV411P] = { 12, 3, 2, 0 },
+    [VIDEO_PALETTE_YUV420P] = { 12, 3, 1, 1 },
+    [VIDEO_PALETTE_YUV410P] = {  9, 3, 2, 2 }
+};
 #else
-const char *palette_str[] =
+static const char * const palette_str[] =
 {
     "UNKNOWN",
     "GREY",
@@ -85,5 +118,26 @@ const char *palette_str[] =
     "YUV 4:1:0 Planar"
 };
 
+static const struct vscull_format palette_fmt[] =
+{
+    {  0, 1, 0, 0 },     // UNKNOWN
+    {  8, 1, 0, 0 },     // GREY
+    {  8, 1, 0, 0 },     // HI240
+    { 16, 1, 0, 0 },     // RGB565
+    { 24, 1, 0, 0 },     // RGB24
+    { 32, 1, 0, 0 },     // RGB32
+    { 16, 1, 0, 0 },     // RGB555
+    { 16, 1, 0, 0 },     // YUV422
+    { 16, 1, 0, 0 },     // YUYV
+    { 16, 1, 0, 0 },     // UYVY
+    { 12, 1, 0, 0 },     // YUV420
+    { 12, 1, 0, 0 },     // YUV411
+    {  0, 1, 0, 0 },     // RAW
+    { 16, 3, 1, 0 },     // YUV422P
+    { 12, 3, 2, 0 },     // YUV411P
+    { 12, 3, 1, 1 },     // YUV420P
+    {  9, 3, 2, 2 }      // YUV410P
+};
+
 #endif
 #endif /* _VSCULL_PALETTE_H_ */